@@ -0,0 +1,168 @@
+#include "batch.h"
+
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "snapshot.h"
+#include "source.h"
+#include "vm.h"
+
+// every *.rinha and *.rinha.json of a directory run in one process, each script on its own vm in a worker thread
+// output is captured per script and written in path order, so it reads the same as running them one by one
+
+typedef struct {
+  char* path;
+  char* out;  // captured stdout and stderr of the script
+  size_t outSize;
+  char* err;
+  size_t errSize;
+  int status;  // exit code it would have had on its own
+  bool done;
+} Job;
+
+typedef struct {
+  Job* jobs;
+  int count;
+  atomic_int next;
+  bool useCache;
+  const char* snapshotIn;
+  pthread_mutex_t lock;
+  pthread_cond_t finished;
+} Batch;
+
+static void runJob(Batch* batch, Job* job) {
+  FILE* out = open_memstream(&job->out, &job->outSize);
+  FILE* err = open_memstream(&job->err, &job->errSize);
+  if (out == NULL || err == NULL) {
+    fprintf(stderr, "Not enough memory to run \"%s\".\n", job->path);
+    exit(74);
+  }
+
+  initVM();
+  vm.out = out;
+  vm.err = err;
+
+  Source source = {0};
+  job->status = batch->snapshotIn != NULL ? restoreSnapshot(batch->snapshotIn) : 0;  // a panic here fails only this script
+  if (job->status != 0) {
+    // reported by restoreSnapshot
+  } else if (!openSource(job->path, &source)) {
+    fprintf(err, "Could not read file \"%s\".\n", job->path);
+    job->status = 74;
+  } else {
+    InterpretResult result = interpretFile(job->path, &source, batch->useCache);
+    job->status = result == INTERPRET_COMPILE_ERROR ? 65 : result == INTERPRET_RUNTIME_ERROR ? 70 : 0;
+  }
+
+  freeVM();
+  if (source.chars != NULL) closeSource(&source);  // string constants point into the source, it goes away only with the vm
+  fclose(out);
+  fclose(err);
+}
+
+static void* worker(void* arg) {
+  Batch* batch = (Batch*)arg;
+  for (;;) {
+    int index = atomic_fetch_add(&batch->next, 1);
+    if (index >= batch->count) return NULL;
+
+    runJob(batch, &batch->jobs[index]);
+
+    pthread_mutex_lock(&batch->lock);
+    batch->jobs[index].done = true;
+    pthread_cond_signal(&batch->finished);  // only the main thread waits
+    pthread_mutex_unlock(&batch->lock);
+  }
+}
+
+static int comparePaths(const void* a, const void* b) { return strcmp(((const Job*)a)->path, ((const Job*)b)->path); }
+
+static bool listScripts(Batch* batch, const char* dir) {
+  DIR* handle = opendir(dir);
+  if (handle == NULL) return false;
+
+  int capacity = 0;
+  size_t dirLength = strlen(dir);
+  bool slash = dirLength > 0 && dir[dirLength - 1] == '/';
+
+  struct dirent* entry;
+  while ((entry = readdir(handle)) != NULL) {
+    size_t length = strlen(entry->d_name);
+    bool script = length > 6 && strcmp(entry->d_name + length - 6, ".rinha") == 0;
+    bool ast = length > 11 && strcmp(entry->d_name + length - 11, ".rinha.json") == 0;
+    if (!script && !ast) continue;
+
+    if (capacity < batch->count + 1) {
+      capacity = capacity < 64 ? 64 : capacity * 2;
+      batch->jobs = (Job*)realloc(batch->jobs, sizeof(Job) * capacity);
+    }
+    char* path = (char*)malloc(dirLength + length + 2);
+    if (batch->jobs == NULL || path == NULL) {
+      fprintf(stderr, "Not enough memory to list \"%s\".\n", dir);
+      exit(74);
+    }
+    snprintf(path, dirLength + length + 2, slash ? "%s%s" : "%s/%s", dir, entry->d_name);
+    batch->jobs[batch->count++] = (Job){.path = path};
+  }
+  closedir(handle);
+
+  if (batch->count > 0) qsort(batch->jobs, batch->count, sizeof(Job), comparePaths);
+  return true;
+}
+
+int runBatch(const char* dir, int jobs, bool useCache, const char* snapshotIn) {
+  Batch batch = {.jobs = NULL, .count = 0, .useCache = useCache, .snapshotIn = snapshotIn};
+  if (!listScripts(&batch, dir)) {
+    fprintf(stderr, "Could not open directory \"%s\".\n", dir);
+    return 74;
+  }
+  atomic_init(&batch.next, 0);
+  pthread_mutex_init(&batch.lock, NULL);
+  pthread_cond_init(&batch.finished, NULL);
+
+  if (jobs > batch.count) jobs = batch.count;
+  pthread_t* threads = (pthread_t*)malloc(sizeof(pthread_t) * (jobs > 0 ? jobs : 1));
+  pthread_attr_t attributes;
+  pthread_attr_init(&attributes);
+  pthread_attr_setstacksize(&attributes, VM_THREAD_STACK);
+
+  int started = 0;
+  while (threads != NULL && started < jobs && pthread_create(&threads[started], &attributes, worker, &batch) == 0) started++;
+  pthread_attr_destroy(&attributes);
+  if (batch.count > 0 && started == 0) {
+    fprintf(stderr, "Could not start the batch workers.\n");
+    exit(71);
+  }
+
+  // written as soon as the next script in order is done, while later ones keep running
+  int status = 0;
+  for (int i = 0; i < batch.count; i++) {
+    Job* job = &batch.jobs[i];
+    pthread_mutex_lock(&batch.lock);
+    while (!job->done) pthread_cond_wait(&batch.finished, &batch.lock);
+    pthread_mutex_unlock(&batch.lock);
+
+    printf("==> %s <==\n", job->path);
+    fwrite(job->out, 1, job->outSize, stdout);
+    fflush(stdout);
+    fwrite(job->err, 1, job->errSize, stderr);
+    if (job->status > status) status = job->status;
+
+    free(job->out);
+    free(job->err);
+    free(job->path);
+  }
+
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  free(batch.jobs);
+  pthread_mutex_destroy(&batch.lock);
+  pthread_cond_destroy(&batch.finished);
+  return status;
+}
@@ -0,0 +1,8 @@
+#ifndef crinha_batch_h
+#define crinha_batch_h
+
+#include "common.h"
+
+int runBatch(const char* dir, int jobs, bool useCache, const char* snapshotIn);
+
+#endif
@@ -0,0 +1,373 @@
+#include "bigint.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+
+// magnitudes are arrays of 32-bit limbs, least significant first, so the product of two limbs fits a uint64_t.
+// the work happens in malloc'ed scratch and only the result is allocated on the heap, so nothing here has to be rooted
+
+typedef struct {  // a number or a bigint as sign and magnitude, numbers point at their own limbs
+  const uint32_t* limbs;
+  int count;
+  bool negative;
+  uint32_t small[2];
+} Integer;
+
+static void viewInteger(Value value, Integer* integer) {
+  if (IS_NUMBER(value)) {
+    int64_t number = AS_NUMBER(value);
+    uint64_t magnitude = number < 0 ? 0 - (uint64_t)number : (uint64_t)number;
+    integer->small[0] = (uint32_t)magnitude;
+    integer->small[1] = (uint32_t)(magnitude >> 32);
+    integer->limbs = integer->small;
+    integer->count = integer->small[1] != 0 ? 2 : integer->small[0] != 0 ? 1 : 0;
+    integer->negative = number < 0;
+    return;
+  }
+
+  ObjBigInt* bigInt = AS_BIGINT(value);
+  integer->limbs = bigInt->limbs;
+  integer->count = bigInt->count;
+  integer->negative = bigInt->negative;
+}
+
+static uint32_t* newLimbs(int count) {  // zeroed scratch
+  uint32_t* limbs = (uint32_t*)calloc(count > 0 ? count : 1, sizeof(uint32_t));
+  if (limbs == NULL) runtimePanic("Out of memory: could not allocate %d limbs.", count);
+  return limbs;
+}
+
+static int trim(const uint32_t* limbs, int count) {
+  while (count > 0 && limbs[count - 1] == 0) count--;
+  return count;
+}
+
+static Value makeInteger(uint32_t* limbs, int count, bool negative) {  // takes the scratch, a number whenever it fits
+  count = trim(limbs, count);
+  if (count <= 2) {
+    uint64_t magnitude = count == 0 ? 0 : count == 1 ? limbs[0] : ((uint64_t)limbs[1] << 32) | limbs[0];
+    if (magnitude <= (uint64_t)INT64_MAX || (negative && magnitude == (uint64_t)INT64_MAX + 1)) {
+      free(limbs);
+      return NUMBER_VAL(negative ? (int64_t)(0 - magnitude) : (int64_t)magnitude);
+    }
+  }
+
+  ObjBigInt* bigInt = newBigInt(count);
+  bigInt->negative = negative;
+  memcpy(bigInt->limbs, limbs, sizeof(uint32_t) * count);
+  free(limbs);
+  return OBJ_VAL(bigInt);
+}
+
+static int compareMagnitudes(const uint32_t* a, int aCount, const uint32_t* b, int bCount) {
+  if (aCount != bCount) return aCount < bCount ? -1 : 1;
+  for (int i = aCount - 1; i >= 0; i--) {
+    if (a[i] != b[i]) return a[i] < b[i] ? -1 : 1;
+  }
+  return 0;
+}
+
+static void addInto(uint32_t* result, int count, const uint32_t* b, int bCount) {  // the sum must fit count limbs
+  uint64_t carry = 0;
+  for (int i = 0; i < count && (i < bCount || carry != 0); i++) {
+    carry += (uint64_t)result[i] + (i < bCount ? b[i] : 0);
+    result[i] = (uint32_t)carry;
+    carry >>= 32;
+  }
+}
+
+static void subtractFrom(uint32_t* result, int count, const uint32_t* b, int bCount) {  // result is at least b
+  uint64_t borrow = 0;
+  for (int i = 0; i < count && (i < bCount || borrow != 0); i++) {
+    uint64_t difference = (uint64_t)result[i] - (i < bCount ? b[i] : 0) - borrow;
+    result[i] = (uint32_t)difference;
+    borrow = (difference >> 32) & 1;
+  }
+}
+
+static void schoolbook(uint32_t* result, const uint32_t* a, int aCount, const uint32_t* b, int bCount) {
+  for (int i = 0; i < aCount; i++) {
+    uint64_t carry = 0;
+    for (int j = 0; j < bCount; j++) {
+      carry += (uint64_t)a[i] * b[j] + result[i + j];  // at most 2^64 - 1
+      result[i + j] = (uint32_t)carry;
+      carry >>= 32;
+    }
+    result[i + bCount] = (uint32_t)carry;
+  }
+}
+
+static void multiplyMagnitudes(uint32_t* result, const uint32_t* a, int aCount, const uint32_t* b, int bCount) {  // result has aCount + bCount zeroed limbs
+  if (aCount < bCount) {
+    const uint32_t* limbs = a;
+    a = b;
+    b = limbs;
+    int count = aCount;
+    aCount = bCount;
+    bCount = count;
+  }
+  if (bCount < KARATSUBA_THRESHOLD) {
+    schoolbook(result, a, aCount, b, bCount);
+    return;
+  }
+
+  int half = (aCount + 1) / 2;
+  if (bCount <= half) {  // lopsided, a is cut in pieces the size of b
+    uint32_t* piece = newLimbs(2 * bCount);
+    for (int i = 0; i < aCount; i += bCount) {
+      int length = aCount - i < bCount ? aCount - i : bCount;
+      memset(piece, 0, sizeof(uint32_t) * (length + bCount));
+      multiplyMagnitudes(piece, a + i, length, b, bCount);
+      addInto(result + i, aCount + bCount - i, piece, length + bCount);
+    }
+    free(piece);
+    return;
+  }
+
+  // with a = a1 * B^half + a0 and b alike, a * b = z2 * B^2half + z1 * B^half + z0 where
+  // z1 = (a0 + a1) * (b0 + b1) - z2 - z0, three half sized products instead of four
+  int aHigh = aCount - half;
+  int bHigh = bCount - half;
+  multiplyMagnitudes(result, a, half, b, half);
+  multiplyMagnitudes(result + 2 * half, a + half, aHigh, b + half, bHigh);
+
+  uint32_t* sums = newLimbs(2 * (half + 1));
+  uint32_t* aSum = sums;
+  uint32_t* bSum = sums + half + 1;
+  memcpy(aSum, a, sizeof(uint32_t) * half);
+  addInto(aSum, half + 1, a + half, aHigh);
+  memcpy(bSum, b, sizeof(uint32_t) * half);
+  addInto(bSum, half + 1, b + half, bHigh);
+
+  int middleCount = 2 * (half + 1);
+  uint32_t* middle = newLimbs(middleCount);
+  multiplyMagnitudes(middle, aSum, half + 1, bSum, half + 1);
+  subtractFrom(middle, middleCount, result, trim(result, 2 * half));
+  subtractFrom(middle, middleCount, result + 2 * half, trim(result + 2 * half, aHigh + bHigh));
+  addInto(result + half, aCount + bCount - half, middle, trim(middle, middleCount));
+  free(sums);
+  free(middle);
+}
+
+static void divideMagnitudes(uint32_t* quotient, uint32_t* remainder, const uint32_t* a, int aCount, const uint32_t* b, int bCount) {
+  // aCount >= bCount and the top limb of b is not zero; quotient has aCount - bCount + 1 limbs, remainder bCount
+  if (bCount == 1) {
+    uint64_t rest = 0;
+    for (int i = aCount - 1; i >= 0; i--) {
+      rest = (rest << 32) | a[i];
+      quotient[i] = (uint32_t)(rest / b[0]);
+      rest %= b[0];
+    }
+    remainder[0] = (uint32_t)rest;
+    return;
+  }
+
+  // Knuth's algorithm D: both are shifted so the top limb of the divisor has its high bit set, then each limb of the
+  // quotient is estimated from the top limbs, off by at most two, and fixed by adding the divisor back
+  int shift = __builtin_clz(b[bCount - 1]);
+  uint32_t* divisor = newLimbs(bCount);
+  uint32_t* dividend = newLimbs(aCount + 1);
+  for (int i = bCount - 1; i > 0; i--) divisor[i] = (b[i] << shift) | (uint32_t)((uint64_t)b[i - 1] >> (32 - shift));
+  divisor[0] = b[0] << shift;
+  dividend[aCount] = (uint32_t)((uint64_t)a[aCount - 1] >> (32 - shift));
+  for (int i = aCount - 1; i > 0; i--) dividend[i] = (a[i] << shift) | (uint32_t)((uint64_t)a[i - 1] >> (32 - shift));
+  dividend[0] = a[0] << shift;
+
+  for (int j = aCount - bCount; j >= 0; j--) {
+    uint64_t top = ((uint64_t)dividend[j + bCount] << 32) | dividend[j + bCount - 1];
+    uint64_t estimate = top / divisor[bCount - 1];
+    uint64_t rest = top % divisor[bCount - 1];
+    while (estimate > UINT32_MAX || estimate * divisor[bCount - 2] > ((rest << 32) | dividend[j + bCount - 2])) {
+      estimate--;
+      rest += divisor[bCount - 1];
+      if (rest > UINT32_MAX) break;
+    }
+
+    int64_t borrow = 0;
+    int64_t difference;
+    for (int i = 0; i < bCount; i++) {
+      uint64_t product = estimate * divisor[i];
+      difference = (int64_t)dividend[i + j] - borrow - (int64_t)(product & UINT32_MAX);
+      dividend[i + j] = (uint32_t)difference;
+      borrow = (int64_t)(product >> 32) - (difference >> 32);
+    }
+    difference = (int64_t)dividend[j + bCount] - borrow;
+    dividend[j + bCount] = (uint32_t)difference;
+
+    quotient[j] = (uint32_t)estimate;
+    if (difference < 0) {  // one too many
+      quotient[j]--;
+      uint64_t carry = 0;
+      for (int i = 0; i < bCount; i++) {
+        carry += (uint64_t)dividend[i + j] + divisor[i];
+        dividend[i + j] = (uint32_t)carry;
+        carry >>= 32;
+      }
+      dividend[j + bCount] += (uint32_t)carry;
+    }
+  }
+
+  for (int i = 0; i < bCount; i++) {
+    remainder[i] = (dividend[i] >> shift) | (uint32_t)((uint64_t)dividend[i + 1] << (32 - shift));
+  }
+  free(divisor);
+  free(dividend);
+}
+
+static Value addSigned(Integer* a, Integer* b) {
+  int count = (a->count > b->count ? a->count : b->count) + 1;
+  uint32_t* limbs = newLimbs(count);
+  if (a->negative == b->negative) {
+    memcpy(limbs, a->limbs, sizeof(uint32_t) * a->count);
+    addInto(limbs, count, b->limbs, b->count);
+    return makeInteger(limbs, count, a->negative);
+  }
+
+  if (compareMagnitudes(a->limbs, a->count, b->limbs, b->count) < 0) {
+    Integer* swap = a;
+    a = b;
+    b = swap;
+  }
+  memcpy(limbs, a->limbs, sizeof(uint32_t) * a->count);
+  subtractFrom(limbs, count, b->limbs, b->count);
+  return makeInteger(limbs, count, a->negative);
+}
+
+Value addIntegers(Value a, Value b) {
+  Integer x, y;
+  viewInteger(a, &x);
+  viewInteger(b, &y);
+  return addSigned(&x, &y);
+}
+
+Value subtractIntegers(Value a, Value b) {
+  Integer x, y;
+  viewInteger(a, &x);
+  viewInteger(b, &y);
+  y.negative = !y.negative;
+  return addSigned(&x, &y);
+}
+
+Value multiplyIntegers(Value a, Value b) {
+  Integer x, y;
+  viewInteger(a, &x);
+  viewInteger(b, &y);
+  uint32_t* limbs = newLimbs(x.count + y.count);
+  multiplyMagnitudes(limbs, x.limbs, x.count, y.limbs, y.count);
+  return makeInteger(limbs, x.count + y.count, x.negative != y.negative);
+}
+
+static Value divideSigned(Value a, Value b, bool wantsRemainder) {
+  Integer x, y;
+  viewInteger(a, &x);
+  viewInteger(b, &y);
+  if (compareMagnitudes(x.limbs, x.count, y.limbs, y.count) < 0) return wantsRemainder ? a : NUMBER_VAL(0);
+
+  int quotientCount = x.count - y.count + 1;
+  uint32_t* quotient = newLimbs(quotientCount);
+  uint32_t* remainder = newLimbs(y.count);
+  divideMagnitudes(quotient, remainder, x.limbs, x.count, y.limbs, y.count);
+  if (wantsRemainder) {
+    free(quotient);
+    return makeInteger(remainder, y.count, x.negative);
+  }
+  free(remainder);
+  return makeInteger(quotient, quotientCount, x.negative != y.negative);
+}
+
+Value divideIntegers(Value a, Value b) {
+  return divideSigned(a, b, false);
+}
+
+Value moduloIntegers(Value a, Value b) {
+  return divideSigned(a, b, true);
+}
+
+Value negateInteger(Value a) {
+  Integer x;
+  viewInteger(a, &x);
+  uint32_t* limbs = newLimbs(x.count);
+  memcpy(limbs, x.limbs, sizeof(uint32_t) * x.count);
+  return makeInteger(limbs, x.count, !x.negative);
+}
+
+int compareIntegers(Value a, Value b) {
+  Integer x, y;
+  viewInteger(a, &x);
+  viewInteger(b, &y);
+  if (x.negative != y.negative) return x.negative ? -1 : 1;
+  int magnitude = compareMagnitudes(x.limbs, x.count, y.limbs, y.count);
+  return x.negative ? -magnitude : magnitude;
+}
+
+bool bigIntsEqual(ObjBigInt* a, ObjBigInt* b) {
+  return a->negative == b->negative && a->count == b->count && memcmp(a->limbs, b->limbs, sizeof(uint32_t) * a->count) == 0;
+}
+
+Value parseInteger(const char* chars, int length) {  // a minus and digits, a fraction or an exponent after them is cut off
+  int start = 0;
+  bool negative = length > 0 && chars[0] == '-';
+  if (negative) start++;
+  int end = start;
+  while (end < length && chars[end] >= '0' && chars[end] <= '9') end++;
+
+  if (end - start <= 18) {  // PERF: fits an int64_t, the literals of almost every script
+    int64_t number = 0;
+    for (int i = start; i < end; i++) number = number * 10 + (chars[i] - '0');
+    return NUMBER_VAL(negative ? -number : number);
+  }
+
+  int capacity = (end - start) / 9 + 2;  // a limb holds more than 9 digits
+  uint32_t* limbs = newLimbs(capacity);
+  int count = 0;
+  for (int i = start; i < end;) {  // nine digits at a time, the first group takes the remainder
+    int digits = (end - i) % 9 == 0 ? 9 : (end - i) % 9;
+    uint32_t group = 0;
+    uint32_t scale = 1;
+    for (int j = 0; j < digits; j++, i++) {
+      group = group * 10 + (uint32_t)(chars[i] - '0');
+      scale *= 10;
+    }
+
+    uint64_t carry = group;
+    for (int j = 0; j < count; j++) {
+      carry += (uint64_t)limbs[j] * scale;
+      limbs[j] = (uint32_t)carry;
+      carry >>= 32;
+    }
+    if (carry != 0) limbs[count++] = (uint32_t)carry;
+  }
+  return makeInteger(limbs, count, negative);
+}
+
+char* formatBigInt(ObjBigInt* bigInt, int* length) {  // decimal, malloc'ed and not null terminated
+  int count = bigInt->count;
+  uint32_t* rest = newLimbs(count);
+  memcpy(rest, bigInt->limbs, sizeof(uint32_t) * count);
+  int capacity = count * 10 + 1;  // a limb is less than ten digits, and the sign
+  char* chars = (char*)malloc(capacity);
+  if (chars == NULL) runtimePanic("Out of memory: could not format a number.");
+
+  int at = capacity;  // written backwards, nine digits for each division by 10^9
+  while (count > 0) {
+    uint64_t group = 0;
+    for (int i = count - 1; i >= 0; i--) {
+      group = (group << 32) | rest[i];
+      rest[i] = (uint32_t)(group / 1000000000);
+      group %= 1000000000;
+    }
+    count = trim(rest, count);
+    for (int digits = 0; digits < 9 && (count > 0 || group > 0); digits++) {  // the last group has no leading zeros
+      chars[--at] = (char)('0' + group % 10);
+      group /= 10;
+    }
+  }
+  if (bigInt->negative) chars[--at] = '-';
+
+  *length = capacity - at;
+  memmove(chars, chars + at, *length);
+  free(rest);
+  return chars;
+}
@@ -0,0 +1,25 @@
+#ifndef crinha_bigint_h
+#define crinha_bigint_h
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+#define KARATSUBA_THRESHOLD 32  // limbs, below this schoolbook multiplication is faster
+
+#define IS_INTEGER(value) (IS_NUMBER(value) || IS_BIGINT(value))
+
+// the slow path of integer arithmetic: operands are numbers or bigints, rooted by the caller as the result allocates,
+// and results that fit an int64_t come back as numbers
+Value parseInteger(const char* chars, int length);
+Value addIntegers(Value a, Value b);
+Value subtractIntegers(Value a, Value b);
+Value multiplyIntegers(Value a, Value b);
+Value divideIntegers(Value a, Value b);  // truncates like C, b is not zero
+Value moduloIntegers(Value a, Value b);  // takes the sign of a, b is not zero
+Value negateInteger(Value a);
+int compareIntegers(Value a, Value b);
+bool bigIntsEqual(ObjBigInt* a, ObjBigInt* b);
+char* formatBigInt(ObjBigInt* bigInt, int* length);
+
+#endif
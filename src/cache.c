@@ -0,0 +1,431 @@
+#include "cache.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bigint.h"
+#include "memory.h"
+#include "vm.h"
+
+// the compiled function tree of a script, saved as <path>.bc and mapped back on the next run of the same source:
+// header | function records | constant records | capture records | lines | code | strings
+// records only hold offsets into the sections, so the image is used in place without fixing up pointers. functions the
+// compiler deferred stay deferred: their records point at the body and the captured names in the source
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint64_t sourceHash;
+  uint64_t sourceLength;
+  uint64_t size;  // of the whole image, a truncated file fails the check
+  uint64_t checksum;  // of the rest of the header and every section, a corrupted image fails the check
+  uint32_t functionCount;
+  uint32_t functions;  // offsets of the sections from the start of the image
+  uint32_t constants;
+  uint32_t captures;
+  uint32_t lines;
+  uint32_t code;
+  uint32_t strings;
+} CacheHeader;
+
+static uint64_t checksumImage(const CacheHeader* header, const char* body, size_t count) {
+  CacheHeader fields = *header;
+  fields.checksum = 0;
+  return hashBytes((const char*)&fields, sizeof(fields)) * 0x9e3779b97f4a7c15u ^ hashBytes(body, count);
+}
+
+struct CachedFunction {  // functions are stored in pre-order, the script is the first one
+  int32_t arity;
+  int32_t upvalueCount;
+  int32_t maxStack;
+  int32_t name;  // offset in the strings section, -1 for the script
+  uint32_t nameLength;
+  uint32_t code;  // offsets in their sections
+  uint32_t codeCount;
+  uint32_t lines;
+  uint32_t lineCount;  // runs, see LineStart
+  uint32_t constants;  // index of the first constant record
+  uint32_t constantCount;
+  int32_t body;  // offset of a deferred body in the source, -1 when the code is in the image
+  uint32_t bodyLength;
+  int32_t line;
+  uint32_t captures;  // index of the first capture record, upvalueCount of them
+};
+
+typedef enum {
+  CONSTANT_NIL,
+  CONSTANT_BOOL,
+  CONSTANT_NUMBER,
+  CONSTANT_STRING,
+  CONSTANT_FUNCTION,
+  CONSTANT_BIGINT,
+} ConstantKind;
+
+typedef struct {
+  uint32_t kind;
+  uint32_t length;  // of strings and bigints
+  int64_t value;    // the number or bool, the string offset or the function index
+} CachedConstant;
+
+typedef struct {  // a name captured by a deferred body, in the source
+  uint32_t offset;
+  uint32_t length;
+} CachedCapture;
+
+#define CACHE_MAGIC "CRBC"
+
+static _Thread_local const char* image = NULL;  // strings and code of the loaded functions point into it until closeCache
+static _Thread_local size_t imageSize = 0;
+static _Thread_local const char* imageSource = NULL;  // the source the image was checked against, deferred bodies point into it
+static _Thread_local size_t imageSourceLength = 0;
+
+static char* cacheName(const char* path) {
+  size_t length = strlen(path);
+  char* name = (char*)malloc(length + 4);
+  if (name == NULL) return NULL;
+  memcpy(name, path, length);
+  memcpy(name + length, ".bc", 4);
+  return name;
+}
+
+uint32_t appendImage(ImageBuffer* buffer, const void* data, size_t size) {  // returns the offset of the data in the buffer
+  if (buffer->capacity < buffer->count + size) {
+    size_t capacity = buffer->capacity < 256 ? 256 : buffer->capacity;
+    while (capacity < buffer->count + size) capacity *= 2;
+    char* grown = (char*)realloc(buffer->data, capacity);
+    if (grown == NULL) {
+      buffer->failed = true;
+      return 0;
+    }
+    buffer->data = grown;
+    buffer->capacity = capacity;
+  }
+
+  uint32_t offset = (uint32_t)buffer->count;
+  if (size > 0) memcpy(buffer->data + buffer->count, data, size);
+  buffer->count += size;
+  return offset;
+}
+
+typedef struct {
+  ObjFunction** functions;
+  int* sizes;  // functions in the subtree of each one, so the index of a nested function can be found again
+  int count;
+  int capacity;
+  bool failed;
+} FunctionList;
+
+static int collectFunctions(FunctionList* list, ObjFunction* function) {  // pre-order, returns the size of the subtree
+  if (list->capacity < list->count + 1) {
+    list->capacity = GROW_CAPACITY(list->capacity);
+    ObjFunction** functions = (ObjFunction**)realloc(list->functions, sizeof(ObjFunction*) * list->capacity);
+    if (functions != NULL) list->functions = functions;
+    int* sizes = (int*)realloc(list->sizes, sizeof(int) * list->capacity);
+    if (sizes != NULL) list->sizes = sizes;
+    if (functions == NULL || sizes == NULL) {
+      list->failed = true;
+      return 0;
+    }
+  }
+
+  int index = list->count++;
+  list->functions[index] = function;
+
+  int size = 1;
+  for (int i = 0; i < function->chunk.constants.count && !list->failed; i++) {
+    Value constant = function->chunk.constants.values[i];
+    if (IS_FUNCTION(constant)) size += collectFunctions(list, AS_FUNCTION(constant));
+  }
+
+  list->sizes[index] = size;
+  return size;
+}
+
+static int32_t appendString(ImageBuffer* strings, Table* written, ObjString* string) {  // compile time strings are interned, each one is written once
+  Value offset;
+  if (tableGet(written, string, &offset)) return AS_NUMBER(offset);
+
+  int32_t at = (int32_t)appendImage(strings, string->chars, string->length);
+  tableSet(written, string, NUMBER_VAL(at));
+  return at;
+}
+
+static void writeCaptures(ObjFunction* function, struct CachedFunction* record, ImageBuffer* captures, const char* source) {
+  record->body = (int32_t)(function->deferred->body - source);
+  record->bodyLength = (uint32_t)function->deferred->length;
+  record->line = function->deferred->line;
+  for (int i = 0; i < function->upvalueCount; i++) {
+    Capture* name = &function->deferred->captures[i];
+    CachedCapture capture = {(uint32_t)(name->chars - source), (uint32_t)name->length};
+    appendImage(captures, &capture, sizeof(capture));
+  }
+}
+
+static void writeFunction(FunctionList* list, int index, ImageBuffer* functions, ImageBuffer* constants, ImageBuffer* captures, ImageBuffer* lines, ImageBuffer* code, ImageBuffer* strings, Table* written, const char* source) {
+  ObjFunction* function = list->functions[index];
+  Chunk* chunk = &function->chunk;
+
+  struct CachedFunction record;
+  record.arity = function->arity;
+  record.upvalueCount = function->upvalueCount;
+  record.maxStack = function->maxStack;
+  record.name = -1;
+  record.nameLength = 0;
+  if (function->name != NULL) {
+    record.name = appendString(strings, written, function->name);
+    record.nameLength = (uint32_t)function->name->length;
+  }
+  record.code = appendImage(code, chunk->code, chunk->count);
+  record.codeCount = (uint32_t)chunk->count;
+  record.lines = appendImage(lines, chunk->lines, sizeof(LineStart) * chunk->lineCount);
+  record.lineCount = (uint32_t)chunk->lineCount;
+  record.constants = (uint32_t)(constants->count / sizeof(CachedConstant));
+  record.constantCount = (uint32_t)chunk->constants.count;
+  record.body = -1;
+  record.bodyLength = 0;
+  record.line = 0;
+  record.captures = (uint32_t)(captures->count / sizeof(CachedCapture));
+  if (function->deferred != NULL) writeCaptures(function, &record, captures, source);
+
+  int child = index + 1;
+  for (int i = 0; i < chunk->constants.count; i++) {
+    Value value = chunk->constants.values[i];
+    CachedConstant constant = {CONSTANT_NIL, 0, 0};
+    if (IS_BOOL(value)) {
+      constant.kind = CONSTANT_BOOL;
+      constant.value = AS_BOOL(value);
+    } else if (IS_NUMBER(value)) {
+      constant.kind = CONSTANT_NUMBER;
+      constant.value = AS_NUMBER(value);
+    } else if (IS_STRING(value)) {  // compile time strings, never ropes
+      constant.kind = CONSTANT_STRING;
+      constant.value = appendString(strings, written, AS_STRING(value));
+      constant.length = (uint32_t)AS_STRING(value)->length;
+    } else if (IS_BIGINT(value)) {  // large literals, in decimal among the strings
+      int length;
+      char* digits = formatBigInt(AS_BIGINT(value), &length);
+      constant.kind = CONSTANT_BIGINT;
+      constant.value = appendImage(strings, digits, length);
+      constant.length = (uint32_t)length;
+      free(digits);
+    } else if (IS_FUNCTION(value)) {
+      constant.kind = CONSTANT_FUNCTION;
+      constant.value = child;
+      child += list->sizes[child];
+    }
+    appendImage(constants, &constant, sizeof(constant));
+  }
+
+  appendImage(functions, &record, sizeof(record));
+}
+
+void writeCache(const char* path, ObjFunction* script, const char* source, size_t length) {  // best effort, a failure only costs the next run a compile
+  FunctionList list = {NULL, NULL, 0, 0, false};
+  ImageBuffer functions = {0}, constants = {0}, captures = {0}, lines = {0}, code = {0}, strings = {0};
+  Table written;
+  initTable(&written);
+  push(OBJ_VAL(script));  // the string index allocates
+
+  collectFunctions(&list, script);
+  for (int i = 0; i < list.count && !list.failed; i++) {
+    writeFunction(&list, i, &functions, &constants, &captures, &lines, &code, &strings, &written, source);
+  }
+
+  pop();
+  freeTable(&written);
+
+  CacheHeader header;
+  memset(&header, 0, sizeof(header));  // the padding is part of the checksum
+  memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+  header.version = CACHE_VERSION;
+  header.sourceHash = hashBytes(source, length);
+  header.sourceLength = length;
+  header.functionCount = (uint32_t)list.count;
+  header.functions = sizeof(CacheHeader);
+  header.constants = header.functions + (uint32_t)functions.count;
+  header.captures = header.constants + (uint32_t)constants.count;
+  header.lines = header.captures + (uint32_t)captures.count;
+  header.code = header.lines + (uint32_t)lines.count;
+  header.strings = header.code + (uint32_t)code.count;
+  header.size = header.strings + strings.count;
+
+  ImageBuffer body = {0};  // the sections in one piece, for the checksum
+  appendImage(&body, functions.data, functions.count);
+  appendImage(&body, constants.data, constants.count);
+  appendImage(&body, captures.data, captures.count);
+  appendImage(&body, lines.data, lines.count);
+  appendImage(&body, code.data, code.count);
+  appendImage(&body, strings.data, strings.count);
+  header.checksum = checksumImage(&header, body.data, body.count);
+
+  bool failed = list.failed || functions.failed || constants.failed || captures.failed || lines.failed || code.failed || strings.failed || body.failed || header.size > UINT32_MAX;
+  char* name = cacheName(path);
+  char* temporary = name == NULL ? NULL : (char*)malloc(strlen(name) + 16);
+  if (!failed && temporary != NULL) {  // written aside and renamed, so a concurrent run never maps half a file
+    snprintf(temporary, strlen(name) + 16, "%s.%d", name, (int)getpid());
+    FILE* file = fopen(temporary, "wb");
+    if (file != NULL) {
+      bool written = fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(body.data, 1, body.count, file) == body.count;
+      if (fclose(file) != 0 || !written || rename(temporary, name) != 0) remove(temporary);
+    }
+  }
+
+  free(temporary);
+  free(name);
+  free(list.functions);
+  free(list.sizes);
+  free(functions.data);
+  free(constants.data);
+  free(captures.data);
+  free(lines.data);
+  free(code.data);
+  free(strings.data);
+  free(body.data);
+}
+
+static bool validHeader(const CacheHeader* header, size_t size, const char* source, size_t length) {
+  return memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) == 0 &&
+         header->version == CACHE_VERSION &&
+         header->size == size &&
+         header->sourceLength == length &&
+         header->functionCount > 0 &&
+         header->functions == sizeof(CacheHeader) &&
+         header->functions + (uint64_t)header->functionCount * sizeof(struct CachedFunction) <= header->constants &&
+         header->constants <= header->captures && header->captures <= header->lines && header->lines <= header->code &&
+         header->code <= header->strings && header->strings <= size &&
+         header->checksum == checksumImage(header, (const char*)header + sizeof(CacheHeader), size - sizeof(CacheHeader)) &&
+         header->sourceHash == hashBytes(source, length);  // last, the only check that reads the whole source
+}
+
+ObjFunction* loadCache(const char* path, const char* source, size_t length) {  // NULL when there is no image for this exact source
+  char* name = cacheName(path);
+  if (name == NULL) return NULL;
+  int fd = open(name, O_RDONLY);
+  free(name);
+  if (fd < 0) return NULL;
+
+  struct stat info;
+  if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(CacheHeader)) {
+    close(fd);
+    return NULL;
+  }
+
+  size_t size = (size_t)info.st_size;
+  char* mapped = (char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) return NULL;
+
+  if (!validHeader((const CacheHeader*)mapped, size, source, length)) {
+    munmap(mapped, size);
+    return NULL;
+  }
+
+  closeCache();
+  image = mapped;
+  imageSize = size;
+  imageSource = source;
+  imageSourceLength = length;
+
+  const CacheHeader* header = (const CacheHeader*)image;
+  ObjFunction* script = newFunction();
+  script->cached = (const struct CachedFunction*)(image + header->functions);
+  push(OBJ_VAL(script));  // loading the constants allocates
+  loadCachedFunction(script);
+  pop();
+  return script;
+}
+
+static bool inSection(uint64_t offset, uint64_t size, uint32_t start, uint32_t end) {
+  return offset + size <= (uint64_t)(end - start);
+}
+
+static void loadDeferred(ObjFunction* function, const struct CachedFunction* record) {  // the body is compiled from the source on the first call
+  const CacheHeader* header = (const CacheHeader*)image;
+  const CachedCapture* captures = (const CachedCapture*)(image + header->captures) + record->captures;
+  if ((uint64_t)record->body + record->bodyLength > imageSourceLength || record->upvalueCount < 0 ||
+      !inSection((uint64_t)record->captures * sizeof(CachedCapture), (uint64_t)record->upvalueCount * sizeof(CachedCapture), header->captures, header->lines)) {
+    runtimePanic("Corrupted bytecode cache.");
+  }
+
+  function->deferred = newDeferred(imageSource + record->body, (int)record->bodyLength, record->line, record->upvalueCount);
+  for (int i = 0; i < record->upvalueCount; i++) {
+    if ((uint64_t)captures[i].offset + captures[i].length > imageSourceLength) runtimePanic("Corrupted bytecode cache.");
+    function->deferred->captures[i].chars = imageSource + captures[i].offset;
+    function->deferred->captures[i].length = (int)captures[i].length;
+  }
+}
+
+void loadCachedFunction(ObjFunction* function) {  // function must be reachable, its constants allocate
+  const CacheHeader* header = (const CacheHeader*)image;
+  const struct CachedFunction* record = function->cached;
+  const CachedConstant* constants = (const CachedConstant*)(image + header->constants) + record->constants;
+  const struct CachedFunction* functions = (const struct CachedFunction*)(image + header->functions);
+
+  if (!inSection(record->code, record->codeCount, header->code, header->strings) ||
+      !inSection(record->lines, (uint64_t)record->lineCount * sizeof(LineStart), header->lines, header->code) ||
+      !inSection((uint64_t)record->constants * sizeof(CachedConstant), (uint64_t)record->constantCount * sizeof(CachedConstant), header->constants, header->lines) ||
+      (record->name >= 0 && !inSection((uint32_t)record->name, record->nameLength, header->strings, (uint32_t)header->size))) {
+    runtimePanic("Corrupted bytecode cache.");
+  }
+
+  function->cached = NULL;
+  function->arity = record->arity;
+  function->upvalueCount = record->upvalueCount;
+  function->maxStack = record->maxStack;
+  if (record->name >= 0) function->name = sourceString(image + header->strings + record->name, (int)record->nameLength);
+  if (record->body >= 0) {  // no code in the image, the chunk is filled by the compiler
+    loadDeferred(function, record);
+    return;
+  }
+
+  function->chunk.code = (uint8_t*)(image + header->code + record->code);
+  function->chunk.lines = (LineStart*)(image + header->lines + record->lines);
+  function->chunk.lineCount = (int)record->lineCount;
+  function->chunk.lineCapacity = (int)record->lineCount;
+  function->chunk.count = (int)record->codeCount;
+  function->chunk.capacity = (int)record->codeCount;
+  function->chunk.mapped = true;
+
+  for (uint32_t i = 0; i < record->constantCount; i++) {
+    const CachedConstant* constant = &constants[i];
+    switch (constant->kind) {
+      case CONSTANT_BOOL: addConstant(&function->chunk, BOOL_VAL(constant->value != 0)); break;
+      case CONSTANT_NUMBER: addConstant(&function->chunk, NUMBER_VAL(constant->value)); break;
+      case CONSTANT_STRING:
+      case CONSTANT_BIGINT: {
+        if (constant->value < 0 || !inSection((uint64_t)constant->value, constant->length, header->strings, (uint32_t)header->size)) {
+          runtimePanic("Corrupted bytecode cache.");
+        }
+        const char* chars = image + header->strings + constant->value;
+        Value value = constant->kind == CONSTANT_STRING ? OBJ_VAL(sourceString(chars, (int)constant->length))
+                                                        : parseInteger(chars, (int)constant->length);
+        addConstant(&function->chunk, value);
+        break;
+      }
+      case CONSTANT_FUNCTION: {  // only a shell, its body waits in the image until a closure is made
+        if (constant->value <= 0 || (uint64_t)constant->value >= header->functionCount) {
+          runtimePanic("Corrupted bytecode cache.");
+        }
+        ObjFunction* nested = newFunction();
+        nested->cached = functions + constant->value;
+        addConstant(&function->chunk, OBJ_VAL(nested));
+        break;
+      }
+      default: addConstant(&function->chunk, NIL_VAL); break;
+    }
+  }
+}
+
+void closeCache() {
+  if (image == NULL) return;
+  munmap((void*)image, imageSize);
+  image = NULL;
+  imageSize = 0;
+  imageSource = NULL;
+  imageSourceLength = 0;
+}
@@ -0,0 +1,22 @@
+#ifndef crinha_cache_h
+#define crinha_cache_h
+
+#include "common.h"
+#include "object.h"
+
+#define CACHE_VERSION 7  // bump whenever the opcodes or the layout of the image change
+
+typedef struct {  // growable byte buffer used to lay out an image before writing it
+  char* data;
+  size_t count;
+  size_t capacity;
+  bool failed;
+} ImageBuffer;
+
+uint32_t appendImage(ImageBuffer* buffer, const void* data, size_t size);
+ObjFunction* loadCache(const char* path, const char* source, size_t length);
+void writeCache(const char* path, ObjFunction* script, const char* source, size_t length);
+void loadCachedFunction(ObjFunction* function);
+void closeCache();
+
+#endif
@@ -1,7 +1,9 @@
 #include "chunk.h"
 
 #include <stdlib.h>
+#include <string.h>
 
+#include "code.h"
 #include "memory.h"
 #include "vm.h"
 
@@ -10,32 +12,113 @@ void initChunk(Chunk* chunk) {
   chunk->capacity = 0;
   chunk->code = NULL;
   chunk->lines = NULL;
+  chunk->lineCount = 0;
+  chunk->lineCapacity = 0;
+  chunk->mapped = false;
+  chunk->packed = false;
   initValueArray(&chunk->constants);
 }
 
 void freeChunk(Chunk* chunk) {
-  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-  FREE_ARRAY(int, chunk->lines, chunk->capacity);
+  if (chunk->packed) {  // lives in the code arena, which is released with the vm
+    initChunk(chunk);
+    return;
+  }
+
+  if (!chunk->mapped) {
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+  }
   freeValueArray(&chunk->constants);
   initChunk(chunk);
 }
 
-void writeChunk(Chunk* chunk, uint8_t byte, int line) {
+static void growCode(Chunk* chunk) {
   if (chunk->capacity < chunk->count + 1) {
     int oldCapacity = chunk->capacity;
     chunk->capacity = GROW_CAPACITY(oldCapacity);
     chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-    chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
   }
+}
 
+void writeChunk(Chunk* chunk, uint8_t byte, int line) {
+  growCode(chunk);
   chunk->code[chunk->count] = byte;
-  chunk->lines[chunk->count] = line;
   chunk->count++;
+
+  if (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line) return;  // MEM: most bytes only extend the last run
+  if (chunk->lineCapacity < chunk->lineCount + 1) {
+    int oldCapacity = chunk->lineCapacity;
+    chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->lines = GROW_ARRAY(LineStart, chunk->lines, oldCapacity, chunk->lineCapacity);
+  }
+  chunk->lines[chunk->lineCount].offset = chunk->count - 1;
+  chunk->lines[chunk->lineCount].line = line;
+  chunk->lineCount++;
 };
 
+void insertChunk(Chunk* chunk, int offset, uint8_t byte) {  // the byte joins the line of the code before it
+  growCode(chunk);
+  memmove(chunk->code + offset + 1, chunk->code + offset, chunk->count - offset);
+  chunk->code[offset] = byte;
+  chunk->count++;
+
+  for (int i = chunk->lineCount - 1; i >= 0 && chunk->lines[i].offset > offset; i--) {
+    chunk->lines[i].offset++;
+  }
+}
+
+void removeChunk(Chunk* chunk, int offset, int length) {  // runs starting inside the removed bytes start after them
+  memmove(chunk->code + offset, chunk->code + offset + length, chunk->count - offset - length);
+  chunk->count -= length;
+
+  for (int i = chunk->lineCount - 1; i >= 0 && chunk->lines[i].offset > offset; i--) {
+    chunk->lines[i].offset = chunk->lines[i].offset - length > offset ? chunk->lines[i].offset - length : offset;
+  }
+}
+
+void packChunk(Chunk* chunk) {  // once the chunk is complete, nothing can be added after this
+  // PERF: a function's constants and code end up next to each other in the read-only code arena, sized exactly,
+  // instead of three arrays grown by doubling all over the heap; the line runs go to the cold space as only errors read them
+  if (chunk->mapped || chunk->packed) return;
+
+  Value* constants = (Value*)allocateCode(&vm.code, CODE_HOT, sizeof(Value) * chunk->constants.count + chunk->count);
+  uint8_t* code = (uint8_t*)(constants + chunk->constants.count);
+  LineStart* lines = (LineStart*)allocateCode(&vm.code, CODE_COLD, sizeof(LineStart) * chunk->lineCount);
+  if (chunk->constants.count > 0) memcpy(constants, chunk->constants.values, sizeof(Value) * chunk->constants.count);
+  if (chunk->count > 0) memcpy(code, chunk->code, chunk->count);
+  if (chunk->lineCount > 0) memcpy(lines, chunk->lines, sizeof(LineStart) * chunk->lineCount);
+  sealCode(&vm.code);
+
+  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+  FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+  FREE_ARRAY(Value, chunk->constants.values, chunk->constants.capacity);
+  chunk->constants.values = constants;
+  chunk->constants.capacity = chunk->constants.count;
+  chunk->code = code;
+  chunk->capacity = chunk->count;
+  chunk->lines = lines;
+  chunk->lineCapacity = chunk->lineCount;
+  chunk->packed = true;
+}
+
 int addConstant(Chunk* chunk, Value value) {
   push(value);
   writeValueArray(&chunk->constants, value);
   pop();
   return chunk->constants.count - 1;
 }
+
+int getLine(const Chunk* chunk, int offset) {  // the last run starting at or before offset
+  int low = 0;
+  int high = chunk->lineCount - 1;
+  while (low < high) {
+    int middle = (low + high + 1) / 2;
+    if (chunk->lines[middle].offset <= offset) {
+      low = middle;
+    } else {
+      high = middle - 1;
+    }
+  }
+  return chunk->lineCount > 0 ? chunk->lines[low].line : 0;
+}
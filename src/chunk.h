@@ -6,17 +6,25 @@
 
 typedef enum {
   OP_CONSTANT,
+  OP_CONSTANT_LONG,  // the _LONG forms take a 24-bit operand, emitted only when the index does not fit a byte
   OP_NIL, // faster than storing in the const array, could be used to optimize other frequent values
   OP_TRUE,
   OP_FALSE,
   OP_POP,
   OP_GET_LOCAL,
+  OP_GET_LOCAL_LONG,
   OP_SET_LOCAL,
+  OP_SET_LOCAL_LONG,
   OP_GET_GLOBAL,
+  OP_GET_GLOBAL_LONG,
   OP_GET_UPVALUE,
+  OP_GET_UPVALUE_LONG,
   OP_SET_UPVALUE,
+  OP_SET_UPVALUE_LONG,
   OP_DEFINE_GLOBAL,
+  OP_DEFINE_GLOBAL_LONG,
   OP_SET_GLOBAL,
+  OP_SET_GLOBAL_LONG,
   OP_DEFINE_TUPLE,
   OP_BANG_EQUAL,
   OP_EQUAL,
@@ -32,28 +40,58 @@ typedef enum {
   OP_NOT,
   OP_NEGATE,
   OP_PRINT,
+  OP_FIRST,  // first(x) and second(x) with the natives still in place, see callIntrinsic
+  OP_SECOND,
   OP_JUMP,
+  OP_JUMP_LONG,
   OP_JUMP_IF_TRUE,
+  OP_JUMP_IF_TRUE_LONG,
   OP_JUMP_IF_FALSE,
+  OP_JUMP_IF_FALSE_LONG,
   OP_LOOP,
   OP_CALL,
+  OP_CALL_0,  // the argument count in the opcode, for the common arities
+  OP_CALL_1,
+  OP_CALL_2,
+  OP_CALL_3,
   OP_TCALL,
+  OP_TCALL_0,
+  OP_TCALL_1,
+  OP_TCALL_2,
+  OP_TCALL_3,
   OP_CLOSURE,
+  OP_CLOSURE_LONG,
   OP_CLOSE_UPVALUE,
   OP_RETURN,
 } OpCode;
 
+#define UPVALUE_LOCAL 1  // flags before each upvalue of OP_CLOSURE: a local of the enclosing frame, not one of its upvalues
+#define UPVALUE_WIDE 2   // the index takes two bytes
+
+typedef struct {
+  int offset;  // first byte of a run of code on the same line
+  int line;
+} LineStart;
+
 typedef struct {
   int count;
   int capacity;
   uint8_t* code;
-  int* lines; // can change this to run-length encoding https://en.wikipedia.org/wiki/Run-length_encoding
+  LineStart* lines;  // run-length encoded, only read to report errors
+  int lineCount;
+  int lineCapacity;
   ValueArray constants;
+  bool mapped;  // code and lines point into a bytecode cache image, not owned
+  bool packed;  // constants and code are next to each other in the code arena, see packChunk
 } Chunk;
 
 void initChunk(Chunk* chunk);
 void freeChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
+void insertChunk(Chunk* chunk, int offset, uint8_t byte);
+void removeChunk(Chunk* chunk, int offset, int length);
+void packChunk(Chunk* chunk);
 int addConstant(Chunk* chunk, Value value);
+int getLine(const Chunk* chunk, int offset);
 
 #endif
\ No newline at end of file
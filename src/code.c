@@ -0,0 +1,83 @@
+#include "code.h"
+
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "vm.h"
+
+// chunks are copied here on the first call of their function, so the layout is first call order: a callee usually
+// lands right after the caller that first reached it, and code that never runs never gets here. There is no call graph
+// or profile behind it, and code used in place from a cache or snapshot image keeps the image's order. The line runs go
+// to a space of their own, so error-only data never sits between two functions' code. The space of collected functions
+// is only given back when the whole arena is released, which is bounded by the size of the source anyway
+
+static size_t pageSize() {
+  static _Thread_local size_t size = 0;
+  if (size == 0) size = (size_t)sysconf(_SC_PAGESIZE);
+  return size;
+}
+
+static size_t roundToPage(size_t size) {
+  return (size + pageSize() - 1) & ~(pageSize() - 1);
+}
+
+void initCodeArena(CodeArena* arena) {
+  arena->filling[CODE_HOT] = NULL;
+  arena->filling[CODE_COLD] = NULL;
+  arena->segments = NULL;
+}
+
+static CodeSegment* newSegment(CodeArena* arena, size_t size) {
+  CodeSegment* segment = (CodeSegment*)malloc(sizeof(CodeSegment));  // outside the mapping, sealing would protect it
+  if (segment == NULL) runtimePanic("Out of memory: could not allocate a code segment.");
+  segment->size = roundToPage(size);
+  segment->base = mmap(NULL, segment->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (segment->base == MAP_FAILED) {
+    free(segment);
+    runtimePanic("Out of memory: could not map %zu bytes of code.", size);
+  }
+  segment->used = 0;
+  segment->sealed = 0;
+  segment->next = arena->segments;
+  arena->segments = segment;
+  return segment;
+}
+
+void* allocateCode(CodeArena* arena, CodeSpace space, size_t size) {  // writable until the next sealCode
+  size = (size + CODE_ALIGNMENT - 1) & ~(size_t)(CODE_ALIGNMENT - 1);
+  if (size > CODE_SEGMENT / 2) {  // would waste most of a shared segment, the filling one keeps going
+    CodeSegment* segment = newSegment(arena, size);
+    segment->used = segment->size;
+    return segment->base;
+  }
+
+  CodeSegment* segment = arena->filling[space];
+  if (segment == NULL || segment->size - segment->used < size) {
+    segment = newSegment(arena, CODE_SEGMENT);
+    arena->filling[space] = segment;
+  }
+  void* result = segment->base + segment->used;
+  segment->used += size;
+  return result;
+}
+
+void sealCode(CodeArena* arena) {  // the page the bump pointer is in stays writable for the next chunk
+  for (CodeSegment* segment = arena->segments; segment != NULL; segment = segment->next) {
+    size_t complete = segment->used & ~(pageSize() - 1);
+    if (complete <= segment->sealed) continue;
+    if (mprotect(segment->base + segment->sealed, complete - segment->sealed, PROT_READ) != 0) continue;  // best effort
+    segment->sealed = complete;
+  }
+}
+
+void releaseCodeArena(CodeArena* arena) {
+  CodeSegment* segment = arena->segments;
+  while (segment != NULL) {
+    CodeSegment* next = segment->next;
+    munmap(segment->base, segment->size);
+    free(segment);
+    segment = next;
+  }
+  initCodeArena(arena);
+}
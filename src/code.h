@@ -0,0 +1,32 @@
+#ifndef crinha_code_h
+#define crinha_code_h
+
+#include "common.h"
+
+#define CODE_SEGMENT (1024 * 1024)  // finished chunks are laid out in segments of this size, bigger ones get a segment of their own
+#define CODE_ALIGNMENT 16
+
+typedef enum {
+  CODE_HOT,   // constants and bytecode, read by the interpreter loop
+  CODE_COLD,  // line runs, only read to report errors
+} CodeSpace;
+
+typedef struct CodeSegment {
+  struct CodeSegment* next;
+  char* base;
+  size_t size;
+  size_t used;
+  size_t sealed;  // read-only prefix, whole pages below the bump pointer
+} CodeSegment;
+
+typedef struct {
+  CodeSegment* filling[2];  // per space, the segment new chunks go to; the older ones are sealed and only linked here
+  CodeSegment* segments;
+} CodeArena;
+
+void initCodeArena(CodeArena* arena);
+void* allocateCode(CodeArena* arena, CodeSpace space, size_t size);
+void sealCode(CodeArena* arena);
+void releaseCodeArena(CodeArena* arena);
+
+#endif
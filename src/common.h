@@ -19,6 +19,8 @@
 #endif
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
+#define UINT24_MAX 0xffffff  // the operand of the _LONG opcodes
 
 #endif
 
@@ -4,7 +4,9 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "bigint.h"
 #include "common.h"
+#include "json.h"
 #include "memory.h"
 #include "scanner.h"
 
@@ -37,11 +39,12 @@ typedef struct {
 typedef struct {
   Token name;
   int depth;
+  int slot;  // from the frame base, the same as the index unless the local was declared with temporaries below it
   bool isCaptured;
 } Local;
 
 typedef struct {
-  uint8_t index;
+  uint16_t index;
   bool isLocal;
 } Upvalue;
 
@@ -55,10 +58,18 @@ typedef struct Compiler {
   ObjFunction* function;
   FunctionType type;
 
-  Local locals[UINT8_COUNT];
+  Local* locals;  // grown as needed up to UINT16_COUNT, most functions have a handful
   int localCount;
-  Upvalue upvalues[UINT8_COUNT];
+  int localCapacity;
+  Upvalue* upvalues;
+  int upvalueCapacity;
+  int* constantIndex;  // open addressing over the constants, so equal numbers and strings share one entry
+  int constantCapacity;
+  int lastOp;  // offset of the last opcode, operands can look like OP_CALL
+  int operandStart;  // where the left operand of the infix rule being parsed begins, see call()
+  DeferredBody* deferred;  // set when compiling a deferred body, its upvalues are resolved by name as the enclosing compilers are gone
   int scopeDepth;
+  int stackDepth;  // values on the stack at the current point of the code, including the callee and locals
 } Compiler;
 
 typedef struct {
@@ -68,8 +79,8 @@ typedef struct {
   bool panicMode;
 } Parser;
 
-Parser parser;
-Compiler* current = NULL;  // if compiler is multi-threaded, this can't be global
+_Thread_local Parser parser;  // one compiler per thread, like the vm
+_Thread_local Compiler* current = NULL;
 
 static Chunk* currentChunk() {
   return &current->function->chunk;
@@ -79,16 +90,16 @@ static void errorAt(Token* token, const char* message) {
   if (parser.panicMode) return;
 
   parser.panicMode = true;
-  fprintf(stderr, "[line %d] Error", token->line);
+  fprintf(vm.err, "[line %d] Error", token->line);
 
   if (token->type == TOKEN_EOF) {
-    fprintf(stderr, " at end");
+    fprintf(vm.err, " at end");
   } else if (token->type == TOKEN_ERROR) {
     // Nothing.
   } else {
-    fprintf(stderr, " at '%.*s'", token->length, token->start);
+    fprintf(vm.err, " at '%.*s'", token->length, token->start);
   }
-  fprintf(stderr, ": %s\n", message);
+  fprintf(vm.err, ": %s\n", message);
   parser.hadError = true;
 }
 
@@ -134,76 +145,221 @@ static void emitByte(uint8_t byte) {
   writeChunk(currentChunk(), byte, parser.previous.line);
 }
 
-static void emitBytes(uint8_t byte1, uint8_t byte2) {
-  emitByte(byte1);
-  emitByte(byte2);
+static const int8_t stackEffects[] = {  // calls also pop their arguments, see call()
+    [OP_CONSTANT] = 1, [OP_CONSTANT_LONG] = 1, [OP_NIL] = 1, [OP_TRUE] = 1, [OP_FALSE] = 1, [OP_POP] = -1,
+    [OP_GET_LOCAL] = 1, [OP_GET_LOCAL_LONG] = 1, [OP_SET_LOCAL] = 0, [OP_SET_LOCAL_LONG] = 0,
+    [OP_GET_GLOBAL] = 1, [OP_GET_GLOBAL_LONG] = 1, [OP_GET_UPVALUE] = 1, [OP_GET_UPVALUE_LONG] = 1,
+    [OP_SET_UPVALUE] = 0, [OP_SET_UPVALUE_LONG] = 0, [OP_DEFINE_GLOBAL] = -1, [OP_DEFINE_GLOBAL_LONG] = -1,
+    [OP_SET_GLOBAL] = 0, [OP_SET_GLOBAL_LONG] = 0, [OP_DEFINE_TUPLE] = -1,
+    [OP_BANG_EQUAL] = -1, [OP_EQUAL] = -1, [OP_GREATER] = -1, [OP_GREATER_EQUAL] = -1, [OP_LESS] = -1, [OP_LESS_EQUAL] = -1,
+    [OP_ADD] = -1, [OP_SUBTRACT] = -1, [OP_MULTIPLY] = -1, [OP_DIVIDE] = -1, [OP_MODULO] = -1, [OP_NOT] = 0, [OP_NEGATE] = 0,
+    [OP_PRINT] = 0, [OP_FIRST] = 0, [OP_SECOND] = 0, [OP_JUMP] = 0, [OP_JUMP_LONG] = 0, [OP_JUMP_IF_TRUE] = 0, [OP_JUMP_IF_TRUE_LONG] = 0,
+    [OP_JUMP_IF_FALSE] = 0, [OP_JUMP_IF_FALSE_LONG] = 0, [OP_LOOP] = 0, [OP_CALL] = 0,
+    [OP_CALL_0] = 0, [OP_CALL_1] = 0, [OP_CALL_2] = 0, [OP_CALL_3] = 0, [OP_TCALL] = 0,
+    [OP_TCALL_0] = 0, [OP_TCALL_1] = 0, [OP_TCALL_2] = 0, [OP_TCALL_3] = 0,
+    [OP_CLOSURE] = 1, [OP_CLOSURE_LONG] = 1, [OP_CLOSE_UPVALUE] = -1, [OP_RETURN] = -1,
+};
+
+static void stackEffect(int effect) {
+  current->stackDepth += effect;
+  if (current->stackDepth > current->function->maxStack) {
+    current->function->maxStack = current->stackDepth;
+  }
+}
+
+static void emitOp(uint8_t op) {  // opcodes go through here so the compiler knows how deep the stack gets
+  current->lastOp = currentChunk()->count;
+  emitByte(op);
+  stackEffect(stackEffects[op]);
+}
+
+static void emitBytes(uint8_t op, uint8_t operand) {
+  emitOp(op);
+  emitByte(operand);
+}
+
+static uint8_t longOp(uint8_t op) {
+  switch (op) {
+    case OP_CONSTANT: return OP_CONSTANT_LONG;
+    case OP_GET_LOCAL: return OP_GET_LOCAL_LONG;
+    case OP_SET_LOCAL: return OP_SET_LOCAL_LONG;
+    case OP_GET_GLOBAL: return OP_GET_GLOBAL_LONG;
+    case OP_GET_UPVALUE: return OP_GET_UPVALUE_LONG;
+    case OP_SET_UPVALUE: return OP_SET_UPVALUE_LONG;
+    case OP_DEFINE_GLOBAL: return OP_DEFINE_GLOBAL_LONG;
+    case OP_SET_GLOBAL: return OP_SET_GLOBAL_LONG;
+    case OP_JUMP: return OP_JUMP_LONG;
+    case OP_JUMP_IF_TRUE: return OP_JUMP_IF_TRUE_LONG;
+    case OP_JUMP_IF_FALSE: return OP_JUMP_IF_FALSE_LONG;
+    case OP_CLOSURE: return OP_CLOSURE_LONG;
+    default: return op;
+  }
+}
+
+static void emitIndexed(uint8_t op, int index) {  // a constant, slot or upvalue, the long form only when it does not fit a byte
+  if (index <= UINT8_MAX) {
+    emitBytes(op, (uint8_t)index);
+    return;
+  }
+
+  emitOp(longOp(op));
+  emitByte((index >> 16) & 0xff);
+  emitByte((index >> 8) & 0xff);
+  emitByte(index & 0xff);
 }
 
 static int emitJump(uint8_t instruction) {
-  emitByte(instruction);
+  emitOp(instruction);
   emitByte(0xff);
   emitByte(0xff);
   return currentChunk()->count - 2;
 }
 
 static void patchTailCall() {
-  int call = currentChunk()->count - 2;
+  int call = current->lastOp;
+  if (call < 0 || current->type == TYPE_SCRIPT) return;  // tailCall closes the upvalues of the frame it reuses
 
-  if (call >= 0 &&
-      current->enclosing != NULL &&
-      current->function->upvalueCount == 0 &&
-      currentChunk()->code[call] == OP_CALL) {
+  uint8_t op = currentChunk()->code[call];
+  if (op == OP_CALL) {
     currentChunk()->code[call] = OP_TCALL;
+  } else if (op >= OP_CALL_0 && op <= OP_CALL_3) {  // same size, jumps out of other branches land right after it
+    currentChunk()->code[call] = OP_TCALL_0 + (op - OP_CALL_0);
   }
 }
 
 static void emitReturn(bool returnNil) {
   if (returnNil) {
-    emitByte(OP_NIL);
+    emitOp(OP_NIL);
   } else {
     patchTailCall();
   }
-  emitByte(OP_RETURN);
+  emitOp(OP_RETURN);
 }
 
-static uint8_t makeConstant(Value value) {
+static bool isShared(Value value) {  // numbers and strings, which are interned; every function is its own constant
+  return !IS_OBJ(value) || IS_STRING(value);
+}
+
+static bool sameConstant(Value a, Value b) {
+  if (a.type != b.type) return false;
+  return IS_OBJ(a) ? AS_OBJ(a) == AS_OBJ(b) : AS_NUMBER(a) == AS_NUMBER(b);
+}
+
+static int* findConstant(Value value) {  // the slot of the index of value, -1 if it is not a constant yet
+  uint64_t bits = IS_OBJ(value) ? (uint64_t)(uintptr_t)AS_OBJ(value) : (uint64_t)AS_NUMBER(value);
+  uint32_t index = (uint32_t)(((bits ^ value.type) * 0x9e3779b97f4a7c15u) >> 32) & (current->constantCapacity - 1);
+  ValueArray* constants = &currentChunk()->constants;
+  for (;;) {
+    int* slot = &current->constantIndex[index];
+    if (*slot == -1 || sameConstant(constants->values[*slot], value)) return slot;
+    index = (index + 1) & (current->constantCapacity - 1);
+  }
+}
+
+static void growConstantIndex() {  // kept at most half full
+  int oldCapacity = current->constantCapacity;
+  current->constantCapacity = oldCapacity < 16 ? 16 : oldCapacity * 2;
+  current->constantIndex = GROW_ARRAY(int, current->constantIndex, oldCapacity, current->constantCapacity);
+  for (int i = 0; i < current->constantCapacity; i++) {
+    current->constantIndex[i] = -1;
+  }
+
+  ValueArray* constants = &currentChunk()->constants;
+  for (int i = 0; i < constants->count; i++) {
+    if (isShared(constants->values[i])) *findConstant(constants->values[i]) = i;
+  }
+}
+
+static int makeConstant(Value value) {
+  int* slot = NULL;
+  if (isShared(value)) {
+    if ((currentChunk()->constants.count + 1) * 2 > current->constantCapacity) {
+      push(value);  // growing may collect, and a new string is not reachable yet
+      growConstantIndex();
+      pop();
+    }
+    slot = findConstant(value);
+    if (*slot != -1) return *slot;
+  }
+
   int constant = addConstant(currentChunk(), value);
-  if (constant > UINT8_MAX) {  // COULD BE OP_CONSTANT_16
+  if (constant > UINT24_MAX) {
+    error("Too many constants in one chunk.");
     return 0;
   }
-
-  return (uint8_t)constant;
+  if (slot != NULL) *slot = constant;
+  return constant;
 }
 
 static void emitConstant(Value value) {
-  emitBytes(OP_CONSTANT, makeConstant(value));
+  emitIndexed(OP_CONSTANT, makeConstant(value));
 }
 
-static void patchJump(int offset) {
-  int jump = currentChunk()->count - offset - 2;  // -2 to adjust for the bytecode for the jump offset itself.
+static int patchJumpTo(int offset, int target) {  // the bytes the jump grew by, which moves the code after it
+  int jump = target - offset - 2;  // -2 to adjust for the bytecode for the jump offset itself.
+  Chunk* chunk = currentChunk();
+
+  if (jump <= UINT16_MAX) {
+    chunk->code[offset] = (jump >> 8) & 0xff;
+    chunk->code[offset + 1] = jump & 0xff;
+    return 0;
+  }
 
-  if (jump > UINT16_MAX) {  // if more than 2 bytes needed, create OP_LONG_JUMP
+  if (jump > UINT24_MAX) {
     error("Too much code to jump over.");
+    return 0;
   }
 
-  currentChunk()->code[offset] = (jump >> 8) & 0xff;
-  currentChunk()->code[offset + 1] = jump & 0xff;
+  // rare enough to widen in place instead of reserving three bytes in every jump: the code jumped over moves up a
+  // byte, which keeps its own jumps right as they are relative, and the distance stays the same as the operand grew too
+  insertChunk(chunk, offset, 0);
+  chunk->code[offset - 1] = longOp(chunk->code[offset - 1]);
+  chunk->code[offset] = (jump >> 16) & 0xff;
+  chunk->code[offset + 1] = (jump >> 8) & 0xff;
+  chunk->code[offset + 2] = jump & 0xff;
+  if (current->lastOp > offset) current->lastOp++;
+  return 1;
+}
+
+static int patchJump(int offset) {  // to the end of the code
+  return patchJumpTo(offset, currentChunk()->count);
 }
 
-static void initCompiler(Compiler* compiler, FunctionType type) {
+static Local* pushLocal() {
+  if (current->localCount == current->localCapacity) {
+    int oldCapacity = current->localCapacity;
+    current->localCapacity = GROW_CAPACITY(oldCapacity);
+    current->locals = GROW_ARRAY(Local, current->locals, oldCapacity, current->localCapacity);
+  }
+  return &current->locals[current->localCount++];
+}
+
+static void initCompiler(Compiler* compiler, FunctionType type, Token* name, ObjFunction* deferred) {  // deferred is a function whose body is compiled now, otherwise a new one is made
   compiler->enclosing = current;
   compiler->function = NULL;
   compiler->type = type;
+  compiler->locals = NULL;
   compiler->localCount = 0;
+  compiler->localCapacity = 0;
+  compiler->upvalues = NULL;
+  compiler->upvalueCapacity = 0;
+  compiler->constantIndex = NULL;
+  compiler->constantCapacity = 0;
+  compiler->lastOp = -1;
+  compiler->operandStart = 0;
   compiler->scopeDepth = 0;
-  compiler->function = newFunction();
+  compiler->stackDepth = 1;  // the callee
+  compiler->deferred = deferred != NULL ? deferred->deferred : NULL;
+  compiler->function = deferred != NULL ? deferred : newFunction();
+  compiler->function->maxStack = 1;
   current = compiler;
-  if (type != TYPE_SCRIPT) {
-    current->function->name = copyString(parser.previous.start, parser.previous.length);
+  if (type != TYPE_SCRIPT && deferred == NULL) {
+    current->function->name = sourceString(name->start, name->length);
   }
 
-  Local* local = &current->locals[current->localCount++];
+  Local* local = pushLocal();
   local->depth = 0;
+  local->slot = 0;
   local->isCaptured = false;
   local->name.start = "";
   local->name.length = 0;
@@ -211,11 +367,15 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
 
 static ObjFunction* endCompiler() {
   emitReturn(false);
-  ObjFunction* function = current->function;
+  ObjFunction* function = current->function;  // packed on its first call, see compiled() in vm.c
 
 #ifdef DEBUG_PRINT_CODE
   if (!parser.hadError) {
-    disassembleChunk(currentChunk(), function->name != NULL ? function->name->chars : "<script>");
+    if (function->name != NULL) {
+      disassembleChunk(currentChunk(), function->name->chars, function->name->length);
+    } else {
+      disassembleChunk(currentChunk(), "<script>", 8);
+    }
   }
 #endif
 
@@ -223,6 +383,12 @@ static ObjFunction* endCompiler() {
   return function;
 }
 
+static void freeCompiler(Compiler* compiler) {  // after endCompiler, and after the closure is emitted as it reads the upvalues
+  FREE_ARRAY(Local, compiler->locals, compiler->localCapacity);
+  FREE_ARRAY(Upvalue, compiler->upvalues, compiler->upvalueCapacity);
+  FREE_ARRAY(int, compiler->constantIndex, compiler->constantCapacity);
+}
+
 static void beginScope() {
   current->scopeDepth++;
 }
@@ -232,9 +398,9 @@ static void endScope() {
 
   while (current->localCount > 0 && current->locals[current->localCount - 1].depth > current->scopeDepth) {
     if (current->locals[current->localCount - 1].isCaptured) {
-      emitByte(OP_CLOSE_UPVALUE);
+      emitOp(OP_CLOSE_UPVALUE);
     } else {
-      emitByte(OP_POP);  // PERF: add op OP_POPN to cleanup stack quickly
+      emitOp(OP_POP);  // PERF: add op OP_POPN to cleanup stack quickly
     }
     current->localCount--;
   }
@@ -248,8 +414,8 @@ static void parsePrecedence(Precedence precedence);
 static void function(FunctionType type);
 static void ifStatement();
 
-static uint8_t identifierConstant(Token* name) {
-  return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+static int identifierConstant(Token* name) {
+  return makeConstant(OBJ_VAL(sourceString(name->start, name->length)));
 }
 
 static bool identifiersEqual(Token* a, Token* b) {
@@ -268,7 +434,7 @@ static int resolveLocal(Compiler* compiler, Token* name) {
   return -1;
 }
 
-static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
+static int addUpvalue(Compiler* compiler, uint16_t index, bool isLocal) {
   int upvalueCount = compiler->function->upvalueCount;
 
   for (int i = 0; i < upvalueCount; i++) {
@@ -278,10 +444,15 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
     }
   }
 
-  if (upvalueCount == UINT8_COUNT) {
+  if (upvalueCount == UINT16_COUNT) {
     error("Too many closure variables in function.");
     return 0;
   }
+  if (upvalueCount == compiler->upvalueCapacity) {
+    int oldCapacity = compiler->upvalueCapacity;
+    compiler->upvalueCapacity = GROW_CAPACITY(oldCapacity);
+    compiler->upvalues = GROW_ARRAY(Upvalue, compiler->upvalues, oldCapacity, compiler->upvalueCapacity);
+  }
 
   compiler->upvalues[upvalueCount].isLocal = isLocal;
   compiler->upvalues[upvalueCount].index = index;
@@ -289,32 +460,50 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
   return compiler->function->upvalueCount++;
 }
 
+static int resolveCapture(DeferredBody* deferred, int count, Token* name) {
+  for (int i = 0; i < count; i++) {
+    if (deferred->captures[i].length == name->length && memcmp(deferred->captures[i].chars, name->start, name->length) == 0) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
 static int resolveUpvalue(Compiler* compiler, Token* name) {
+  if (compiler->deferred != NULL) return resolveCapture(compiler->deferred, compiler->function->upvalueCount, name);
   if (compiler->enclosing == NULL) return -1;
 
   int local = resolveLocal(compiler->enclosing, name);
   if (local != -1) {
-    ((Compiler*)compiler->enclosing)->locals[local].isCaptured = true;
-    return addUpvalue(compiler, (uint8_t)local, true);
+    Local* captured = &compiler->enclosing->locals[local];
+    captured->isCaptured = true;
+    return addUpvalue(compiler, (uint16_t)captured->slot, true);
   }
 
   int upvalue = resolveUpvalue(compiler->enclosing, name);
   if (upvalue != -1) {
-    return addUpvalue(compiler, (uint8_t)upvalue, false);
+    return addUpvalue(compiler, (uint16_t)upvalue, false);
   }
 
   return -1;
 }
 
 static void addLocal(Token name) {
-  if (current->localCount == UINT8_COUNT) {
+  if (current->localCount == UINT16_COUNT) {
     error("Too many local variables in function.");
     return;
   }
 
-  Local* local = &current->locals[current->localCount++];
+  if (current->stackDepth > UINT16_MAX) {
+    error("Too many values on the stack to add a local.");
+    return;
+  }
+
+  Local* local = pushLocal();
   local->name = name;
   local->depth = -1;
+  local->slot = current->stackDepth;  // the value about to be pushed
   local->isCaptured = false;
 }
 
@@ -336,7 +525,7 @@ static void declareVariable() {
   addLocal(*name);
 }
 
-static uint8_t parseVariable(const char* errorMessage) {
+static int parseVariable(const char* errorMessage) {
   consume(TOKEN_IDENTIFIER, errorMessage);
 
   declareVariable();
@@ -350,13 +539,13 @@ static void markInitialized() {
   current->locals[current->localCount - 1].depth = current->scopeDepth;
 }
 
-static void defineVariable(uint8_t global) {
+static void defineVariable(int global) {
   if (current->scopeDepth > 0) {
     markInitialized();
     return;
   }
 
-  emitBytes(OP_DEFINE_GLOBAL, global);
+  emitIndexed(OP_DEFINE_GLOBAL, global);
 }
 
 static uint8_t argumentList() {
@@ -376,7 +565,7 @@ static uint8_t argumentList() {
 
 static void and_(__attribute__((unused)) bool canAssign) {
   int endJump = emitJump(OP_JUMP_IF_FALSE);
-  emitByte(OP_POP);
+  emitOp(OP_POP);
   parsePrecedence(PREC_AND);
 
   patchJump(endJump);
@@ -388,32 +577,84 @@ static void binary(__attribute__((unused)) bool canAssign) {
   parsePrecedence((Precedence)(rule->precedence + 1));
 
   switch (operatorType) {
-    case TOKEN_BANG_EQUAL: emitByte(OP_BANG_EQUAL); break;
-    case TOKEN_EQUAL_EQUAL: emitByte(OP_EQUAL); break;
-    case TOKEN_GREATER: emitByte(OP_GREATER); break;
-    case TOKEN_GREATER_EQUAL: emitByte(OP_GREATER_EQUAL); break;
-    case TOKEN_LESS: emitByte(OP_LESS); break;
-    case TOKEN_LESS_EQUAL: emitByte(OP_LESS_EQUAL); break;
-    case TOKEN_PLUS: emitByte(OP_ADD); break;
-    case TOKEN_MINUS: emitByte(OP_SUBTRACT); break;
-    case TOKEN_STAR: emitByte(OP_MULTIPLY); break;
-    case TOKEN_SLASH: emitByte(OP_DIVIDE); break;
-    case TOKEN_PERCENT: emitByte(OP_MODULO); break;
+    case TOKEN_BANG_EQUAL: emitOp(OP_BANG_EQUAL); break;
+    case TOKEN_EQUAL_EQUAL: emitOp(OP_EQUAL); break;
+    case TOKEN_GREATER: emitOp(OP_GREATER); break;
+    case TOKEN_GREATER_EQUAL: emitOp(OP_GREATER_EQUAL); break;
+    case TOKEN_LESS: emitOp(OP_LESS); break;
+    case TOKEN_LESS_EQUAL: emitOp(OP_LESS_EQUAL); break;
+    case TOKEN_PLUS: emitOp(OP_ADD); break;
+    case TOKEN_MINUS: emitOp(OP_SUBTRACT); break;
+    case TOKEN_STAR: emitOp(OP_MULTIPLY); break;
+    case TOKEN_SLASH: emitOp(OP_DIVIDE); break;
+    case TOKEN_PERCENT: emitOp(OP_MODULO); break;
     default:
       return;
   }
 }
 
+static void emitCall(int argCount) {
+  if (argCount <= 3) {
+    emitOp(OP_CALL_0 + argCount);
+  } else {
+    emitBytes(OP_CALL, (uint8_t)argCount);
+  }
+  stackEffect(-argCount);  // the result takes the callee slot
+}
+
+static const struct {
+  const char* name;
+  uint8_t op;
+} intrinsics[] = {
+    {"first", OP_FIRST},
+    {"second", OP_SECOND},
+    {"print", OP_PRINT},  // a keyword, so the global can't be redefined
+};
+
+static int intrinsicCallee(int start, uint8_t* op) {  // the length of the code from start if it only reads one of the natives above
+  Chunk* chunk = currentChunk();
+  int index;
+  if (chunk->count - start == 2 && chunk->code[start] == OP_GET_GLOBAL) {
+    index = chunk->code[start + 1];
+  } else if (chunk->count - start == 4 && chunk->code[start] == OP_GET_GLOBAL_LONG) {
+    index = (chunk->code[start + 1] << 16) | (chunk->code[start + 2] << 8) | chunk->code[start + 3];
+  } else {
+    return 0;
+  }
+
+  ObjString* name = AS_STRING(chunk->constants.values[index]);
+  for (size_t i = 0; i < sizeof(intrinsics) / sizeof(intrinsics[0]); i++) {
+    if (name->length == (int)strlen(intrinsics[i].name) && memcmp(name->chars, intrinsics[i].name, name->length) == 0) {
+      *op = intrinsics[i].op;
+      return chunk->count - start;
+    }
+  }
+  return 0;
+}
+
 static void call(__attribute__((unused)) bool canAssign) {
+  int callee = current->operandStart;
+  uint8_t op = OP_CALL;
+  int calleeLength = intrinsicCallee(callee, &op);
   uint8_t argCount = argumentList();
-  emitBytes(OP_CALL, argCount);
+  if (calleeLength == 0 || argCount != 1) {
+    emitCall(argCount);
+    return;
+  }
+
+  // PERF: drops the global lookup and the call, the arguments only have relative jumps so they can move; the callee
+  // slot stays in maxStack for the vm to call the global after all if the script redefined it
+  removeChunk(currentChunk(), callee, calleeLength);
+  if (current->lastOp > callee) current->lastOp -= calleeLength;
+  emitOp(op);
+  stackEffect(-1);
 }
 
 static void literal(__attribute__((unused)) bool canAssign) {
   switch (parser.previous.type) {
-    case TOKEN_FALSE: emitByte(OP_FALSE); break;
-    case TOKEN_NIL: emitByte(OP_NIL); break;
-    case TOKEN_TRUE: emitByte(OP_TRUE); break;
+    case TOKEN_FALSE: emitOp(OP_FALSE); break;
+    case TOKEN_NIL: emitOp(OP_NIL); break;
+    case TOKEN_TRUE: emitOp(OP_TRUE); break;
     default:
       return;
   }
@@ -424,33 +665,33 @@ static void grouping(__attribute__((unused)) bool canAssign) {
   if (match(TOKEN_COMMA)) {
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
-    emitByte(OP_DEFINE_TUPLE);
+    emitOp(OP_DEFINE_TUPLE);
   } else {
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
   }
 }
 
 static void number(__attribute__((unused)) bool canAssign) {
-  double value = strtod(parser.previous.start, NULL);
-  emitConstant(NUMBER_VAL(value));
+  emitConstant(parseInteger(parser.previous.start, parser.previous.length));
 }
 
 static void or_(__attribute__((unused)) bool canAssign) {
   int endJump = emitJump(OP_JUMP_IF_TRUE);
-  emitByte(OP_POP);
+  emitOp(OP_POP);
   parsePrecedence(PREC_OR);
 
   patchJump(endJump);
 }
 
-static void string(__attribute__((unused)) bool canAssign) {                                 // if string with \n were supported, this would be the function to convert it
-  emitConstant(OBJ_VAL(copyString(parser.previous.start + 1, parser.previous.length - 2)));  // MEM: this create a new constant every time the same variable is used, how to improve?
+static void string(__attribute__((unused)) bool canAssign) {  // the text as written, backslashes included
+  emitConstant(OBJ_VAL(sourceString(parser.previous.start + 1, parser.previous.length - 2)));  // MEM: points into the source, which is mapped for files, so nothing is copied
 }
 
 static void namedVariable(Token name, bool canAssign) {
   uint8_t getOp, setOp;
   int arg = resolveLocal(current, &name);
   if (arg != -1) {
+    arg = current->locals[arg].slot;
     getOp = OP_GET_LOCAL;
     setOp = OP_SET_LOCAL;
   } else if ((arg = resolveUpvalue(current, &name)) != -1) {
@@ -464,9 +705,9 @@ static void namedVariable(Token name, bool canAssign) {
 
   if (canAssign && match(TOKEN_EQUAL)) {
     expression();
-    emitBytes(setOp, (uint8_t)arg);
+    emitIndexed(setOp, arg);
   } else {
-    emitBytes(getOp, (uint8_t)arg);
+    emitIndexed(getOp, arg);
   }
 }
 
@@ -480,8 +721,8 @@ static void unary(__attribute__((unused)) bool canAssign) {
   parsePrecedence(PREC_UNARY);
 
   switch (operatorType) {
-    case TOKEN_BANG: emitByte(OP_NOT); break;
-    case TOKEN_MINUS: emitByte(OP_NEGATE); break;
+    case TOKEN_BANG: emitOp(OP_NOT); break;
+    case TOKEN_MINUS: emitOp(OP_NEGATE); break;
     default:
       return;
   }
@@ -561,11 +802,13 @@ static void parsePrecedence(Precedence precedence) {
   }
 
   bool canAssign = precedence <= PREC_ASSIGNMENT;
+  int start = currentChunk()->count;
   prefixRule(canAssign);
 
   while (precedence <= getRule(parser.current.type)->precedence) {
     advance();
     ParseFn infixRule = getRule(parser.previous.type)->infix;
+    current->operandStart = start;
     infixRule(canAssign);
   }
 
@@ -582,9 +825,22 @@ static void expression() {
   parsePrecedence(PREC_ASSIGNMENT);
 }
 
-static void function(FunctionType type) {
-  Compiler compiler;
-  initCompiler(&compiler, type);
+static void emitClosure(ObjFunction* function, Upvalue* upvalues) {
+  emitIndexed(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+
+  for (int i = 0; i < function->upvalueCount; i++) {
+    uint8_t flags = upvalues[i].isLocal ? UPVALUE_LOCAL : 0;
+    if (upvalues[i].index > UINT8_MAX) {
+      emitByte(flags | UPVALUE_WIDE);
+      emitByte((upvalues[i].index >> 8) & 0xff);
+    } else {
+      emitByte(flags);
+    }
+    emitByte(upvalues[i].index & 0xff);
+  }
+}
+
+static void functionBody() {
   beginScope();
 
   consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
@@ -594,8 +850,9 @@ static void function(FunctionType type) {
       if (current->function->arity > 255) {
         error("Can't have more than 255 parameters.");
       }
-      uint8_t constant = parseVariable("Expect parameter name.");
+      int constant = parseVariable("Expect parameter name.");
       defineVariable(constant);
+      stackEffect(1);
     } while (match(TOKEN_COMMA));
   }
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
@@ -605,23 +862,205 @@ static void function(FunctionType type) {
   } else {
     expression();
   }
+}
+
+static bool canDefer() {  // a well formed parameter list and a block body, which can be skipped by matching its braces
+  if (!check(TOKEN_LEFT_PAREN)) return false;
+
+  Scanner saved = saveScanner();
+  Token token = scanToken();
+  if (token.type == TOKEN_IDENTIFIER) {
+    token = scanToken();
+    while (token.type == TOKEN_COMMA) {
+      token = scanToken();
+      if (token.type != TOKEN_IDENTIFIER) break;
+      token = scanToken();
+    }
+  }
+  bool deferrable = token.type == TOKEN_RIGHT_PAREN && scanToken().type == TOKEN_ARROW && scanToken().type == TOKEN_LEFT_BRACE;
+  restoreScanner(saved);
+  return deferrable;
+}
+
+typedef struct {
+  Token* names;
+  Upvalue* upvalues;
+  int count;
+  int capacity;
+} Captures;
+
+typedef struct {  // names the body binds itself, which hide the enclosing locals of the same name
+  Token* names;
+  int* depths;  // brace depth of the block they belong to
+  int count;
+  int capacity;
+} Bindings;
+
+static void bind(Bindings* bindings, Token* name, int depth) {
+  if (bindings->count == bindings->capacity) {
+    int oldCapacity = bindings->capacity;
+    bindings->capacity = GROW_CAPACITY(oldCapacity);
+    bindings->names = GROW_ARRAY(Token, bindings->names, oldCapacity, bindings->capacity);
+    bindings->depths = GROW_ARRAY(int, bindings->depths, oldCapacity, bindings->capacity);
+  }
+  bindings->names[bindings->count] = *name;
+  bindings->depths[bindings->count++] = depth;
+}
+
+static bool bound(Bindings* bindings, Token* name) {
+  for (int i = bindings->count - 1; i >= 0; i--) {
+    if (identifiersEqual(name, &bindings->names[i])) return true;
+  }
+  return false;
+}
+
+static void captureName(Captures* captures, Token* name) {  // a name of the body that is a local of an enclosing function
+  for (int i = 0; i < captures->count; i++) {
+    if (identifiersEqual(name, &captures->names[i])) return;
+  }
+
+  Upvalue upvalue;
+  int local = resolveLocal(current, name);
+  if (local != -1) {
+    current->locals[local].isCaptured = true;
+    upvalue.index = (uint16_t)current->locals[local].slot;
+    upvalue.isLocal = true;
+  } else {
+    int index = resolveUpvalue(current, name);
+    if (index == -1) return;  // a global
+    upvalue.index = (uint16_t)index;
+    upvalue.isLocal = false;
+  }
+
+  if (captures->count == UINT16_COUNT) {
+    error("Too many closure variables in function.");
+    return;
+  }
+  if (captures->count == captures->capacity) {
+    int oldCapacity = captures->capacity;
+    captures->capacity = GROW_CAPACITY(oldCapacity);
+    captures->names = GROW_ARRAY(Token, captures->names, oldCapacity, captures->capacity);
+    captures->upvalues = GROW_ARRAY(Upvalue, captures->upvalues, oldCapacity, captures->capacity);
+  }
+  captures->names[captures->count] = *name;
+  captures->upvalues[captures->count++] = upvalue;
+}
+
+static void deferFunction(Token* name) {
+  // PERF: only the braces and the names are looked at, the bytecode is made by compileDeferred on the first call, so
+  // startup pays for the functions a run calls and not for all of them. a name is captured when it resolves to an
+  // enclosing local and the body has not bound it: parameters of the function and of nested block bodies, and lets
+  // from their token to the end of their block. parameters of nested expression bodies are not tracked, so a name
+  // they shadow is captured and left unused, which only costs the upvalue
+  const char* body = parser.current.start;
+  int line = parser.current.line;
+  Bindings bindings = {NULL, NULL, 0, 0};
+  while (!check(TOKEN_LEFT_BRACE)) {  // the parameters, checked by canDefer
+    advance();
+    if (parser.previous.type == TOKEN_IDENTIFIER) bind(&bindings, &parser.previous, 1);
+  }
 
+  Captures captures = {NULL, NULL, 0, 0};
+  int depth = 0;
+  bool declares = false;  // the token before was a let
+  int parameters = -1;    // of a nested function, read so far and bound as if its body was a block; -1 outside of them
+  do {
+    advance();
+    TokenType type = parser.previous.type;
+    if (parameters >= 0) {
+      if (type == TOKEN_IDENTIFIER) {
+        bind(&bindings, &parser.previous, depth + 1);
+        parameters++;
+        continue;
+      }
+      if (type != TOKEN_LEFT_PAREN && type != TOKEN_COMMA && type != TOKEN_RIGHT_PAREN && type != TOKEN_ARROW) {
+        if (type != TOKEN_LEFT_BRACE) bindings.count -= parameters;  // an expression body, which ends nowhere braces can tell
+        parameters = -1;
+      }
+    }
+
+    if (type == TOKEN_LEFT_BRACE) {
+      depth++;
+    } else if (type == TOKEN_RIGHT_BRACE) {
+      depth--;
+      while (bindings.count > 0 && bindings.depths[bindings.count - 1] > depth) bindings.count--;
+    } else if (type == TOKEN_FN && check(TOKEN_LEFT_PAREN)) {
+      parameters = 0;
+    } else if (type == TOKEN_IDENTIFIER && declares) {
+      bind(&bindings, &parser.previous, depth);  // its own initializer already resolves to it
+    } else if (type == TOKEN_IDENTIFIER && !bound(&bindings, &parser.previous)) {
+      captureName(&captures, &parser.previous);
+    }
+    declares = type == TOKEN_LET;
+  } while (depth > 0 && !check(TOKEN_EOF));
+  if (depth > 0) consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+  FREE_ARRAY(Token, bindings.names, bindings.capacity);
+  FREE_ARRAY(int, bindings.depths, bindings.capacity);
+
+  ObjFunction* function = newFunction();
+  push(OBJ_VAL(function));  // the name and the body allocate
+  function->name = sourceString(name->start, name->length);
+  int length = (int)(parser.previous.start + parser.previous.length - body);
+  function->deferred = newDeferred(body, length, line, captures.count);
+  function->upvalueCount = captures.count;
+  for (int i = 0; i < captures.count; i++) {
+    function->deferred->captures[i].chars = captures.names[i].start;
+    function->deferred->captures[i].length = captures.names[i].length;
+  }
+  emitClosure(function, captures.upvalues);
+  pop();
+  FREE_ARRAY(Token, captures.names, captures.capacity);
+  FREE_ARRAY(Upvalue, captures.upvalues, captures.capacity);
+}
+
+static void function(FunctionType type) {
+  Token name = parser.previous;
+  if (canDefer()) {
+    deferFunction(&name);
+    return;
+  }
+
+  Compiler compiler;
+  initCompiler(&compiler, type, &name, NULL);
+  functionBody();
   ObjFunction* function = endCompiler();
-  emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+  emitClosure(function, compiler.upvalues);
+  freeCompiler(&compiler);
+}
 
-  for (int i = 0; i < function->upvalueCount; i++) {
-    emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-    emitByte(compiler.upvalues[i].index);
+bool compileDeferred(ObjFunction* function) {  // the body deferFunction skipped, false after reporting its compile errors
+  DeferredBody* deferred = function->deferred;
+  initScanner(deferred->body, deferred->line);
+  current = NULL;
+  Compiler compiler;
+  initCompiler(&compiler, TYPE_FUNCTION, NULL, function);
+
+  parser.hadError = false;
+  parser.panicMode = false;
+  advance();
+  functionBody();
+  if (!parser.hadError && parser.previous.start + parser.previous.length != deferred->body + deferred->length) {  // a malformed body can parse past its brace
+    error("Expect '}' after block.");
+  }
+  endCompiler();
+  freeCompiler(&compiler);
+
+  if (parser.hadError) {  // left deferred, a later call reports the errors again
+    freeChunk(&function->chunk);
+    function->arity = 0;
+    return false;
   }
+  freeDeferred(function);
+  return true;
 }
 
 static void letDeclaration() {
-  uint8_t global = parseVariable("Expect variable name.");
+  int global = parseVariable("Expect variable name.");
 
   if (match(TOKEN_EQUAL)) {
     expression();
   } else {
-    emitByte(OP_NIL);
+    emitOp(OP_NIL);
   }
   consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
 
@@ -638,21 +1077,27 @@ static void ifStatement() {
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
   int thenJmp = emitJump(OP_JUMP_IF_FALSE);  // PERF: could be a single instruction OP_JUMP_IF_FALSE_AND_POP, different from the one in and_
-  emitByte(OP_POP);
+  int conditionDepth = current->stackDepth;
+  emitOp(OP_POP);
   expression();
 
   int elseJump = emitJump(OP_JUMP);
+  int thenDepth = current->stackDepth;
+  current->stackDepth = conditionDepth;
 
-  patchJump(thenJmp);
-  emitByte(OP_POP);
+  emitOp(OP_POP);
 
   if (match(TOKEN_ELSE)) expression();
-  patchJump(elseJump);
+  // the then jump is patched last: it lands right after the else jump, which moves if the else branch widens it,
+  // and widening the then jump only moves code that the else jump does not span
+  int widened = patchJump(elseJump);
+  patchJumpTo(thenJmp, elseJump + 2 + widened);
+  if (current->stackDepth < thenDepth) current->stackDepth = thenDepth;  // the branches meet here
 }
 
 static void printStatement() {
   expression();
-  emitByte(OP_PRINT);
+  emitOp(OP_PRINT);
 }
 
 static void synchronize() {
@@ -696,9 +1141,10 @@ static void statement() {
 }
 
 ObjFunction* compile(const char* source) {  // single pass, could be multiple pass to stretch performance
-  initScanner(source);
+  initScanner(source, 1);
+  current = NULL;  // a panic during a previous compile may have left it dangling
   Compiler compiler;
-  initCompiler(&compiler, TYPE_SCRIPT);
+  initCompiler(&compiler, TYPE_SCRIPT, NULL, NULL);
 
   parser.hadError = false;
   parser.panicMode = false;
@@ -708,6 +1154,361 @@ ObjFunction* compile(const char* source) {  // single pass, could be multiple pa
     declaration();
   }
   ObjFunction* function = endCompiler();
+  freeCompiler(&compiler);
+  return parser.hadError ? NULL : function;
+}
+
+// the rinha json ast, as the competition tooling writes it: every term is an object with its "kind" first and
+// its children in evaluation order, so terms are compiled as they are read in a single pass over the document
+// and only the terms still open are held, on the C stack
+
+#define JSON_MAX_DEPTH 10000  // nested terms, deeper documents would overflow the C stack
+
+static _Thread_local int termDepth;
+
+static void term(bool tail);
+
+static void jsonErrorAt(Token* token, const char* message) {  // a broken document explains the errors that follow it
+  int line;
+  const char* syntax = jsonError(&line);
+  if (syntax != NULL) {
+    Token at = {TOKEN_ERROR, "", 0, line};
+    errorAt(&at, syntax);
+  } else {
+    errorAt(token, message);
+  }
+}
+
+static void jsonFail(const char* message) {
+  jsonErrorAt(&parser.previous, message);
+  jsonStop();  // the reader is somewhere inside the term, stop reading instead of guessing where
+}
+
+static bool sameText(const char* start, int length, const char* text) {
+  return (int)strlen(text) == length && memcmp(start, text, length) == 0;
+}
+
+static bool field(const char* name) {  // skips the members before the one named, its value is read next
+  JsonToken key;
+  while (jsonMember(&key)) {
+    if (sameText(key.start, key.length, name)) return true;
+    jsonSkip(jsonValue());
+  }
+  return false;
+}
+
+static void requireField(const char* name) {
+  if (field(name)) return;
+  char message[64];
+  snprintf(message, sizeof(message), "Expect '%s' in the term, members are read in order.", name);
+  jsonFail(message);
+}
+
+static void endTerm() {  // the members after the last child, such as the location
+  JsonToken key;
+  while (jsonMember(&key)) {
+    jsonSkip(jsonValue());
+  }
+}
+
+static JsonToken stringField(const char* name) {
+  requireField(name);
+  JsonToken value = jsonValue();
+  if (value.type != JSON_STRING) jsonFail("Expect a string.");
+  return value;
+}
+
+static Token identifier(const char* field) {  // the text of a name, pointing into the document like the scanner's tokens
+  JsonToken value = jsonValue();
+  if (value.type != JSON_OBJECT) {
+    jsonFail("Expect a name.");
+    return parser.previous;
+  }
+  JsonToken text = stringField(field);
+  if (text.escaped) jsonFail("Escapes are not allowed in names.");
+  endTerm();
+  return (Token){TOKEN_IDENTIFIER, text.start, text.length, text.line};
+}
+
+static Token termKind() {  // enters the next term and reads its kind
+  JsonToken value = jsonValue();
+  if (value.type != JSON_OBJECT) {
+    jsonFail("Expect a term.");
+    return (Token){TOKEN_ERROR, "", 0, parser.previous.line};  // no kind, parser.previous may still name one and recurse again
+  }
+  JsonToken kind = stringField("kind");
+  parser.previous = (Token){TOKEN_IDENTIFIER, kind.start, kind.length, kind.line};  // errors and lines point at the kind
+  return parser.previous;
+}
+
+static bool isKind(Token* kind, const char* name) {
+  return sameText(kind->start, kind->length, name);
+}
+
+static void intTerm() {
+  requireField("value");
+  JsonToken value = jsonValue();
+  if (value.type != JSON_NUMBER) jsonFail("Expect an integer.");
+  emitConstant(parseInteger(value.start, value.length));
+}
+
+static void strTerm() {
+  JsonToken value = stringField("value");
+  if (!value.escaped) {
+    emitConstant(OBJ_VAL(sourceString(value.start, value.length)));
+    return;
+  }
+
+  char* chars = (char*)malloc(value.length > 0 ? value.length : 1);
+  int length = chars == NULL ? -1 : jsonDecode(&value, chars);
+  if (length < 0) {
+    free(chars);
+    jsonFail("Invalid escape in string.");
+    return;
+  }
+  emitConstant(OBJ_VAL(copyString(chars, length)));
+  free(chars);
+}
+
+static void boolTerm() {
+  requireField("value");
+  JsonToken value = jsonValue();
+  if (value.type != JSON_TRUE && value.type != JSON_FALSE) jsonFail("Expect a boolean.");
+  emitOp(value.type == JSON_TRUE ? OP_TRUE : OP_FALSE);
+}
+
+static void builtinCall(uint8_t op, const char* child) {  // first and second, like the surface syntax compiles first(x)
+  requireField(child);
+  stackEffect(1);  // the callee slot, in case the vm has to call a redefined global
+  term(false);
+  emitOp(op);
+  stackEffect(-1);
+}
+
+static void tupleTerm() {
+  requireField("first");
+  term(false);
+  requireField("second");
+  term(false);
+  emitOp(OP_DEFINE_TUPLE);
+}
+
+static void binaryTerm() {
+  requireField("lhs");
+  term(false);
+  JsonToken name = stringField("op");
+  Token op = {TOKEN_IDENTIFIER, name.start, name.length, name.line};
+
+  if (isKind(&op, "And") || isKind(&op, "Or")) {
+    int endJump = emitJump(isKind(&op, "And") ? OP_JUMP_IF_FALSE : OP_JUMP_IF_TRUE);
+    emitOp(OP_POP);
+    requireField("rhs");
+    term(false);
+    patchJump(endJump);
+    return;
+  }
+
+  requireField("rhs");
+  term(false);
+
+  static const struct {
+    const char* name;
+    OpCode op;
+  } operators[] = {
+      {"Add", OP_ADD}, {"Sub", OP_SUBTRACT}, {"Mul", OP_MULTIPLY}, {"Div", OP_DIVIDE}, {"Rem", OP_MODULO},
+      {"Eq", OP_EQUAL}, {"Neq", OP_BANG_EQUAL}, {"Lt", OP_LESS}, {"Gt", OP_GREATER}, {"Lte", OP_LESS_EQUAL}, {"Gte", OP_GREATER_EQUAL},
+  };
+  for (size_t i = 0; i < sizeof(operators) / sizeof(operators[0]); i++) {
+    if (isKind(&op, operators[i].name)) {
+      emitOp(operators[i].op);
+      return;
+    }
+  }
+  errorAt(&op, "Unknown binary operator.");
+}
+
+static void callTerm() {
+  requireField("callee");
+  term(false);
+
+  requireField("arguments");
+  if (jsonValue().type != JSON_ARRAY) jsonFail("Expect a list of arguments.");
+  int argCount = 0;
+  while (jsonElement()) {
+    term(false);
+    if (argCount == 255) error("Can't have more than 255 arguments.");
+    argCount++;
+  }
+  emitCall(argCount);
+}
+
+static void functionTerm() {
+  Token name = {TOKEN_FN, "fn", 2, parser.previous.line};  // named like the functions of the surface syntax
+  Compiler compiler;
+  initCompiler(&compiler, TYPE_FUNCTION, &name, NULL);
+  beginScope();
+
+  requireField("parameters");
+  if (jsonValue().type != JSON_ARRAY) jsonFail("Expect a list of parameters.");
+  while (jsonElement()) {
+    current->function->arity++;
+    if (current->function->arity > 255) error("Can't have more than 255 parameters.");
+    addLocal(identifier("text"));
+    markInitialized();
+    stackEffect(1);
+  }
+
+  requireField("value");
+  term(true);
+
+  ObjFunction* function = endCompiler();
+  emitClosure(function, compiler.upvalues);
+  freeCompiler(&compiler);
+}
+
+static void ifTerm(bool tail) {
+  requireField("condition");
+  term(false);
+
+  int thenJump = emitJump(OP_JUMP_IF_FALSE);
+  int conditionDepth = current->stackDepth;
+  emitOp(OP_POP);
+  requireField("then");
+  term(tail);
+
+  int elseJump = emitJump(OP_JUMP);
+  int thenDepth = current->stackDepth;
+  current->stackDepth = conditionDepth;
+
+  emitOp(OP_POP);
+  requireField("otherwise");
+  term(tail);
+  int widened = patchJump(elseJump);  // the then jump goes last, as in ifStatement
+  patchJumpTo(thenJump, elseJump + 2 + widened);
+  if (current->stackDepth < thenDepth) current->stackDepth = thenDepth;  // the branches meet here
+}
+
+static void termBody(Token kind, bool tail) {  // the members after the kind, up to the end of the term
+  if (isKind(&kind, "Int")) {
+    intTerm();
+  } else if (isKind(&kind, "Str")) {
+    strTerm();
+  } else if (isKind(&kind, "Bool")) {
+    boolTerm();
+  } else if (isKind(&kind, "Var")) {
+    JsonToken text = stringField("text");
+    namedVariable((Token){TOKEN_IDENTIFIER, text.start, text.length, text.line}, false);
+  } else if (isKind(&kind, "Tuple")) {
+    tupleTerm();
+  } else if (isKind(&kind, "First")) {
+    builtinCall(OP_FIRST, "value");
+  } else if (isKind(&kind, "Second")) {
+    builtinCall(OP_SECOND, "value");
+  } else if (isKind(&kind, "Print")) {
+    requireField("value");
+    term(false);
+    emitOp(OP_PRINT);
+  } else if (isKind(&kind, "Binary")) {
+    binaryTerm();
+  } else if (isKind(&kind, "Call")) {
+    callTerm();
+  } else if (isKind(&kind, "Function")) {
+    functionTerm();
+  } else if (isKind(&kind, "If")) {
+    ifTerm(tail);
+  } else {
+    jsonFail("Unknown kind of term.");
+  }
+  endTerm();
+}
+
+static void letTerm(bool tail) {  // follows next in a loop, generated programs chain more lets than the C stack could nest
+  // lets at the end of the script are globals, as in the surface syntax; elsewhere they are locals, and the ones with
+  // code after them move their result below their locals and pop them
+  bool global = tail && current->type == TYPE_SCRIPT && current->scopeDepth == 0;
+  int result = current->stackDepth;
+  if (!global) {
+    if (!tail) emitOp(OP_NIL);
+    beginScope();
+  }
+
+  int lets = 0;
+  Token kind;
+  do {
+    lets++;
+    requireField("name");
+    Token name = identifier("text");
+    requireField("value");
+    if (global) {
+      int constant = identifierConstant(&name);
+      term(false);
+      emitIndexed(OP_DEFINE_GLOBAL, constant);
+    } else {
+      addLocal(name);  // before the value, so a function can call itself through it
+      term(false);
+      markInitialized();
+    }
+    requireField("next");
+    kind = termKind();
+  } while (isKind(&kind, "Let") && !parser.hadError);
+  termBody(kind, tail);
+
+  for (int i = 0; i < lets; i++) {
+    endTerm();
+  }
+
+  if (global) return;
+  if (tail) {  // returned right after, so the locals are only forgotten, the return closes their upvalues
+    current->scopeDepth--;
+    while (current->localCount > 0 && current->locals[current->localCount - 1].depth > current->scopeDepth) {
+      current->localCount--;
+    }
+    return;
+  }
+  emitIndexed(OP_SET_LOCAL, result);
+  emitOp(OP_POP);
+  endScope();
+}
+
+static void term(bool tail) {  // tail terms are the last thing their function does
+  if (++termDepth > JSON_MAX_DEPTH) {
+    jsonFail("Terms nested too deeply.");
+  } else {
+    Token kind = termKind();
+    if (isKind(&kind, "Let")) {
+      letTerm(tail);
+    } else {
+      termBody(kind, tail);
+    }
+  }
+  termDepth--;
+}
+
+ObjFunction* compileJson(const char* source, size_t length) {
+  initJson(source, length);
+  current = NULL;
+  Compiler compiler;
+  initCompiler(&compiler, TYPE_SCRIPT, NULL, NULL);
+
+  parser.hadError = false;
+  parser.panicMode = false;
+  parser.previous = (Token){TOKEN_EOF, source, 0, 1};
+  termDepth = 0;
+
+  if (jsonValue().type != JSON_OBJECT) {
+    jsonFail("Expect a file object.");
+  } else {
+    requireField("expression");
+    term(true);
+    endTerm();
+  }
+  if (!jsonAtEnd()) jsonFail("Expect the end of the document.");
+  int line;
+  const char* syntax = jsonError(&line);
+  if (syntax != NULL) jsonErrorAt(&parser.previous, syntax);
+
+  ObjFunction* function = endCompiler();
+  freeCompiler(&compiler);
   return parser.hadError ? NULL : function;
 }
 
@@ -5,6 +5,8 @@
 #include "vm.h"
 
 ObjFunction* compile(const char* source);
+ObjFunction* compileJson(const char* source, size_t length);
+bool compileDeferred(ObjFunction* function);
 void markCompilerRoots();
 
 #endif
\ No newline at end of file
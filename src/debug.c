@@ -5,8 +5,8 @@
 #include "object.h"
 #include "value.h"
 
-void disassembleChunk(Chunk *chunk, const char *name) {
-  printf("== %s ==\n", name);
+void disassembleChunk(Chunk *chunk, const char *name, int length) {
+  printf("== %.*s ==\n", length, name);
 
   for (int offset = 0; offset < chunk->count;) {
     offset = disassembleInstruction(chunk, offset);
@@ -24,6 +24,12 @@ static int byteInstruction(const char *name, Chunk *chunk, int offset) {
   return offset + 2;
 }
 
+static int longByteInstruction(const char *name, Chunk *chunk, int offset) {
+  int slot = (chunk->code[offset + 1] << 16) | (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+  printf("%-16s %4d\n", name, slot);
+  return offset + 4;
+}
+
 static int jumpInstruction(const char *name, int sign, Chunk *chunk, int offset) {
   uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
   jump |= chunk->code[offset + 2];
@@ -31,6 +37,12 @@ static int jumpInstruction(const char *name, int sign, Chunk *chunk, int offset)
   return offset + 3;
 }
 
+static int longJumpInstruction(const char *name, Chunk *chunk, int offset) {
+  int jump = (chunk->code[offset + 1] << 16) | (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+  printf("%-16s %4d -> %d\n", name, offset, offset + 4 + jump);
+  return offset + 4;
+}
+
 static int constantInstruction(const char *name, Chunk *chunk, int offset) {
   uint8_t constant = chunk->code[offset + 1];
   printf("%-16s %4d '", name, constant);
@@ -39,18 +51,51 @@ static int constantInstruction(const char *name, Chunk *chunk, int offset) {
   return offset + 2;
 }
 
+static int longConstantInstruction(const char *name, Chunk *chunk, int offset) {
+  int constant = (chunk->code[offset + 1] << 16) | (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 4;
+}
+
+static int closureInstruction(const char *name, Chunk *chunk, int offset, bool wide) {
+  int constant = chunk->code[offset + 1];
+  offset += 2;
+  if (wide) {
+    constant = (constant << 16) | (chunk->code[offset] << 8) | chunk->code[offset + 1];
+    offset += 2;
+  }
+  printf("%-16s %4d ", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("\n");
+
+  ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
+  for (int j = 0; j < function->upvalueCount; j++) {
+    int start = offset;
+    int flags = chunk->code[offset++];
+    int index = chunk->code[offset++];
+    if (flags & UPVALUE_WIDE) index = (index << 8) | chunk->code[offset++];
+    printf("%04d      |                     %s %d\n", start, (flags & UPVALUE_LOCAL) ? "local" : "upvalue", index);
+  }
+  return offset;
+}
+
 int disassembleInstruction(Chunk *chunk, int offset) {
   printf("%04d ", offset);
-  if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+  int line = getLine(chunk, offset);
+  if (offset > 0 && line == getLine(chunk, offset - 1)) {
     printf("   | ");
   } else {
-    printf("%4d ", chunk->lines[offset]);
+    printf("%4d ", line);
   }
 
   uint8_t instruction = chunk->code[offset];
   switch (instruction) {
     case OP_CONSTANT:
       return constantInstruction("OP_CONSTANT", chunk, offset);
+    case OP_CONSTANT_LONG:
+      return longConstantInstruction("OP_CONSTANT_LONG", chunk, offset);
     case OP_NIL:
       return simpleInstruction("OP_NIL", offset);
     case OP_TRUE:
@@ -61,18 +106,32 @@ int disassembleInstruction(Chunk *chunk, int offset) {
       return simpleInstruction("OP_POP", offset);
     case OP_GET_LOCAL:
       return byteInstruction("OP_GET_LOCAL", chunk, offset);
+    case OP_GET_LOCAL_LONG:
+      return longByteInstruction("OP_GET_LOCAL_LONG", chunk, offset);
     case OP_SET_LOCAL:
       return byteInstruction("OP_SET_LOCAL", chunk, offset);
+    case OP_SET_LOCAL_LONG:
+      return longByteInstruction("OP_SET_LOCAL_LONG", chunk, offset);
     case OP_GET_GLOBAL:
       return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+    case OP_GET_GLOBAL_LONG:
+      return longConstantInstruction("OP_GET_GLOBAL_LONG", chunk, offset);
     case OP_DEFINE_GLOBAL:
       return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+    case OP_DEFINE_GLOBAL_LONG:
+      return longConstantInstruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
     case OP_SET_GLOBAL:
       return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+    case OP_SET_GLOBAL_LONG:
+      return longConstantInstruction("OP_SET_GLOBAL_LONG", chunk, offset);
     case OP_GET_UPVALUE:
       return byteInstruction("OP_GET_UPVALUE", chunk, offset);
+    case OP_GET_UPVALUE_LONG:
+      return longByteInstruction("OP_GET_UPVALUE_LONG", chunk, offset);
     case OP_SET_UPVALUE:
       return byteInstruction("OP_SET_UPVALUE", chunk, offset);
+    case OP_SET_UPVALUE_LONG:
+      return longByteInstruction("OP_SET_UPVALUE_LONG", chunk, offset);
     case OP_BANG_EQUAL:
       return simpleInstruction("OP_BANG_EQUAL", offset);
     case OP_EQUAL:
@@ -99,33 +158,48 @@ int disassembleInstruction(Chunk *chunk, int offset) {
       return simpleInstruction("OP_NEGATE", offset);
     case OP_PRINT:
       return simpleInstruction("OP_PRINT", offset);
+    case OP_FIRST:
+      return simpleInstruction("OP_FIRST", offset);
+    case OP_SECOND:
+      return simpleInstruction("OP_SECOND", offset);
     case OP_JUMP:
       return jumpInstruction("OP_JUMP", 1, chunk, offset);
+    case OP_JUMP_LONG:
+      return longJumpInstruction("OP_JUMP_LONG", chunk, offset);
     case OP_JUMP_IF_TRUE:
       return jumpInstruction("OP_JUMP_IF_TRUE", 1, chunk, offset);
+    case OP_JUMP_IF_TRUE_LONG:
+      return longJumpInstruction("OP_JUMP_IF_TRUE_LONG", chunk, offset);
     case OP_JUMP_IF_FALSE:
       return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_JUMP_IF_FALSE_LONG:
+      return longJumpInstruction("OP_JUMP_IF_FALSE_LONG", chunk, offset);
     case OP_LOOP:
       return jumpInstruction("OP_LOOP", -1, chunk, offset);
     case OP_CALL:
       return byteInstruction("OP_CALL", chunk, offset);
+    case OP_CALL_0:
+      return simpleInstruction("OP_CALL_0", offset);
+    case OP_CALL_1:
+      return simpleInstruction("OP_CALL_1", offset);
+    case OP_CALL_2:
+      return simpleInstruction("OP_CALL_2", offset);
+    case OP_CALL_3:
+      return simpleInstruction("OP_CALL_3", offset);
     case OP_TCALL:
       return byteInstruction("OP_TCALL", chunk, offset);
-    case OP_CLOSURE: {
-      offset++;
-      uint8_t constant = chunk->code[offset++];
-      printf("%-16s %4d ", "OP_CLOSURE", constant);
-      printValue(chunk->constants.values[constant]);
-      printf("\n");
-
-      ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
-      for (int j = 0; j < function->upvalueCount; j++) {
-        int isLocal = chunk->code[offset++];
-        int index = chunk->code[offset++];
-        printf("%04d      |                     %s %d\n", offset - 2, isLocal ? "local" : "upvalue", index);
-      }
-      return offset;
-    }
+    case OP_TCALL_0:
+      return simpleInstruction("OP_TCALL_0", offset);
+    case OP_TCALL_1:
+      return simpleInstruction("OP_TCALL_1", offset);
+    case OP_TCALL_2:
+      return simpleInstruction("OP_TCALL_2", offset);
+    case OP_TCALL_3:
+      return simpleInstruction("OP_TCALL_3", offset);
+    case OP_CLOSURE:
+      return closureInstruction("OP_CLOSURE", chunk, offset, false);
+    case OP_CLOSURE_LONG:
+      return closureInstruction("OP_CLOSURE_LONG", chunk, offset, true);
     case OP_CLOSE_UPVALUE:
       return simpleInstruction("OP_CLOSE_UPVALUE", offset);
     case OP_RETURN:
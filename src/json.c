@@ -0,0 +1,289 @@
+#include "json.h"
+
+#include <string.h>
+
+// pull reader over a json document in memory, the caller walks it value by value and nothing is built on the side
+// containers are entered by jsonValue and read with jsonMember or jsonElement until they return false
+
+typedef struct {
+  const char* current;
+  const char* end;
+  int line;
+  bool first;  // nothing read yet in the container just entered, so no comma before the next member
+  const char* error;
+  int errorLine;
+} JsonReader;
+
+static _Thread_local JsonReader json;
+
+void initJson(const char* source, size_t length) {
+  json.current = source;
+  json.end = source + length;
+  json.line = 1;
+  json.first = true;
+  json.error = NULL;
+  json.errorLine = 0;
+}
+
+static bool fail(const char* message) {  // only the first error is kept, every call after it fails fast
+  if (json.error == NULL) {
+    json.error = message;
+    json.errorLine = json.line;
+  }
+  json.current = json.end;
+  return false;
+}
+
+static void skipWhitespace() {
+  while (json.current < json.end) {
+    switch (*json.current) {
+      case '\n':
+        json.line++;
+        // fallthrough
+      case ' ':
+      case '\r':
+      case '\t':
+        json.current++;
+        break;
+      default:
+        return;
+    }
+  }
+}
+
+static bool match(char expected) {
+  skipWhitespace();
+  if (json.current == json.end || *json.current != expected) return false;
+  json.current++;
+  return true;
+}
+
+static bool isDigit(char c) {
+  return c >= '0' && c <= '9';
+}
+
+static JsonToken makeToken(JsonType type, const char* start) {
+  JsonToken token;
+  token.type = type;
+  token.start = start;
+  token.length = (int)(json.current - start);
+  token.line = json.line;
+  token.escaped = false;
+  return token;
+}
+
+static JsonToken errorToken(const char* message) {
+  fail(message);
+  return makeToken(JSON_ERROR, json.current);
+}
+
+static JsonToken string() {  // the opening quote was read
+  const char* start = json.current;
+  bool escaped = false;
+  while (json.current < json.end && *json.current != '"') {
+    unsigned char c = (unsigned char)*json.current++;
+    if (c < 0x20) return errorToken("Control character in string.");
+    if (c == '\\') {
+      if (json.current == json.end) break;
+      json.current++;
+      escaped = true;
+    }
+  }
+  if (json.current == json.end) return errorToken("Unterminated string.");
+
+  JsonToken token = makeToken(JSON_STRING, start);
+  token.escaped = escaped;
+  json.current++;  // the closing quote
+  return token;
+}
+
+static JsonToken number() {
+  const char* start = json.current;
+  if (*json.current == '-') json.current++;
+  if (json.current == json.end || !isDigit(*json.current)) return errorToken("Invalid number.");
+  while (json.current < json.end && isDigit(*json.current)) json.current++;
+
+  if (json.current < json.end && *json.current == '.') {
+    json.current++;
+    if (json.current == json.end || !isDigit(*json.current)) return errorToken("Invalid number.");
+    while (json.current < json.end && isDigit(*json.current)) json.current++;
+  }
+  if (json.current < json.end && (*json.current == 'e' || *json.current == 'E')) {
+    json.current++;
+    if (json.current < json.end && (*json.current == '+' || *json.current == '-')) json.current++;
+    if (json.current == json.end || !isDigit(*json.current)) return errorToken("Invalid number.");
+    while (json.current < json.end && isDigit(*json.current)) json.current++;
+  }
+  return makeToken(JSON_NUMBER, start);
+}
+
+static JsonToken literal(const char* text, int length, JsonType type) {
+  const char* start = json.current;
+  if (json.end - json.current < length || memcmp(json.current, text, length) != 0) return errorToken("Unexpected character.");
+  json.current += length;
+  return makeToken(type, start);
+}
+
+JsonToken jsonValue() {
+  skipWhitespace();
+  if (json.current == json.end) return errorToken("Expect a value.");
+
+  const char* start = json.current;
+  switch (*json.current) {
+    case '{':
+    case '[':
+      json.current++;
+      json.first = true;
+      return makeToken(*start == '{' ? JSON_OBJECT : JSON_ARRAY, start);
+    case '"':
+      json.current++;
+      return string();
+    case 't': return literal("true", 4, JSON_TRUE);
+    case 'f': return literal("false", 5, JSON_FALSE);
+    case 'n': return literal("null", 4, JSON_NULL);
+    default:
+      if (*json.current == '-' || isDigit(*json.current)) return number();
+      return errorToken("Unexpected character.");
+  }
+}
+
+bool jsonMember(JsonToken* key) {  // false at the closing brace, the value of the key is read next
+  if (match('}')) {
+    json.first = false;  // the object was a value of its parent
+    return false;
+  }
+  if (!json.first && !match(',')) return fail("Expect ',' or '}' after member.");
+  json.first = false;
+
+  if (!match('"')) return fail("Expect a string key.");
+  *key = string();
+  if (key->type == JSON_ERROR) return false;
+  if (!match(':')) return fail("Expect ':' after key.");
+  return true;
+}
+
+bool jsonElement() {  // false at the closing bracket, otherwise a value is read next
+  if (match(']')) {
+    json.first = false;
+    return false;
+  }
+  if (!json.first && !match(',')) return fail("Expect ',' or ']' after element.");
+  json.first = false;
+  return json.current < json.end;
+}
+
+void jsonSkip(JsonToken value) {  // the rest of a value, containers are only scanned for their brackets so nesting costs no recursion
+  if (value.type != JSON_OBJECT && value.type != JSON_ARRAY) return;
+
+  int depth = 1;
+  while (depth > 0) {
+    skipWhitespace();
+    if (json.current == json.end) {
+      fail("Unterminated container.");
+      return;
+    }
+
+    char c = *json.current++;
+    if (c == '{' || c == '[') depth++;
+    if (c == '}' || c == ']') depth--;
+    if (c == '"' && string().type == JSON_ERROR) return;
+  }
+  json.first = false;
+}
+
+void jsonStop() {  // the caller gave up on the document, every call after this fails fast
+  json.current = json.end;
+}
+
+bool jsonAtEnd() {
+  skipWhitespace();
+  return json.current == json.end;
+}
+
+static int hexDigit(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+static int hex4(const char* chars) {
+  int value = 0;
+  for (int i = 0; i < 4; i++) {
+    int digit = hexDigit(chars[i]);
+    if (digit < 0) return -1;
+    value = value * 16 + digit;
+  }
+  return value;
+}
+
+static int utf8(uint32_t code, char* chars) {
+  if (code < 0x80) {
+    chars[0] = (char)code;
+    return 1;
+  }
+  if (code < 0x800) {
+    chars[0] = (char)(0xc0 | (code >> 6));
+    chars[1] = (char)(0x80 | (code & 0x3f));
+    return 2;
+  }
+  if (code < 0x10000) {
+    chars[0] = (char)(0xe0 | (code >> 12));
+    chars[1] = (char)(0x80 | ((code >> 6) & 0x3f));
+    chars[2] = (char)(0x80 | (code & 0x3f));
+    return 3;
+  }
+  chars[0] = (char)(0xf0 | (code >> 18));
+  chars[1] = (char)(0x80 | ((code >> 12) & 0x3f));
+  chars[2] = (char)(0x80 | ((code >> 6) & 0x3f));
+  chars[3] = (char)(0x80 | (code & 0x3f));
+  return 4;
+}
+
+int jsonDecode(const JsonToken* string, char* chars) {  // chars needs string->length bytes, escapes never grow, -1 if one is invalid
+  const char* from = string->start;
+  const char* end = from + string->length;
+  int length = 0;
+
+  while (from < end) {
+    if (*from != '\\') {
+      chars[length++] = *from++;
+      continue;
+    }
+
+    char escape = from[1];
+    from += 2;
+    switch (escape) {
+      case '"': chars[length++] = '"'; break;
+      case '\\': chars[length++] = '\\'; break;
+      case '/': chars[length++] = '/'; break;
+      case 'b': chars[length++] = '\b'; break;
+      case 'f': chars[length++] = '\f'; break;
+      case 'n': chars[length++] = '\n'; break;
+      case 'r': chars[length++] = '\r'; break;
+      case 't': chars[length++] = '\t'; break;
+      case 'u': {
+        int code = end - from >= 4 ? hex4(from) : -1;
+        if (code < 0) return -1;
+        from += 4;
+        if (code >= 0xd800 && code <= 0xdbff && end - from >= 6 && from[0] == '\\' && from[1] == 'u') {  // a surrogate pair
+          int low = hex4(from + 2);
+          if (low >= 0xdc00 && low <= 0xdfff) {
+            code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+            from += 6;
+          }
+        }
+        length += utf8((uint32_t)code, chars + length);
+        break;
+      }
+      default:
+        return -1;
+    }
+  }
+  return length;
+}
+
+const char* jsonError(int* line) {
+  *line = json.errorLine;
+  return json.error;
+}
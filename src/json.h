@@ -0,0 +1,30 @@
+#ifndef crinha_json_h
+#define crinha_json_h
+
+#include "common.h"
+
+typedef enum {
+  JSON_STRING, JSON_NUMBER, JSON_TRUE, JSON_FALSE, JSON_NULL,
+  JSON_OBJECT, JSON_ARRAY,  // only the opening bracket is read, the members follow
+  JSON_ERROR
+} JsonType;
+
+typedef struct {
+  JsonType type;
+  const char* start;  // strings without the quotes
+  int length;
+  int line;
+  bool escaped;  // the string has escapes, jsonDecode gives its value
+} JsonToken;
+
+void initJson(const char* source, size_t length);
+JsonToken jsonValue();
+bool jsonMember(JsonToken* key);
+bool jsonElement();
+void jsonSkip(JsonToken value);
+bool jsonAtEnd();
+void jsonStop();
+int jsonDecode(const JsonToken* string, char* chars);
+const char* jsonError(int* line);
+
+#endif
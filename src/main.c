@@ -1,76 +1,278 @@
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "batch.h"
 #include "chunk.h"
 #include "common.h"
 #include "debug.h"
+#include "memory.h"
+#include "parallel.h"
+#include "serve.h"
+#include "snapshot.h"
+#include "source.h"
+#include "stack.h"
 #include "vm.h"
 
 static void repl() {
-  char line[1024];  // could support multiple lines instead
+  int count = 0;
+  int capacity = 0;
+  char** lines = NULL;  // string constants point into the lines, so they live as long as the vm
+
   for (;;) {
     printf("> ");
 
-    if (!fgets(line, sizeof(line), stdin)) {
+    if (capacity < count + 1) {
+      capacity = capacity < 8 ? 8 : capacity * 2;
+      lines = (char**)realloc(lines, sizeof(char*) * capacity);
+    }
+    char* line = (char*)malloc(1024);  // could support multiple lines instead
+    if (lines == NULL || line == NULL) {
+      fprintf(stderr, "Not enough memory to read the line.\n");
+      exit(74);
+    }
+    lines[count++] = line;
+
+    if (!fgets(line, 1024, stdin)) {
       printf("\n");
       break;
     }
 
-    interpret(line);
+    interpret(line, strlen(line), NULL);
+  }
+
+  freeVM();
+  for (int i = 0; i < count; i++) {
+    free(lines[i]);
   }
+  free(lines);
 }
 
-static char* readFile(const char* path) {
-  FILE* file = fopen(path, "rb");
-  if (file == NULL) {
+static bool useCache = true;
+static const char* snapshotIn = NULL;
+static const char* snapshotOut = NULL;
+static const char* batchDir = NULL;
+static int jobs = 0;  // 0 runs a worker per core
+static const char* servePath = NULL;
+static const char* clientPath = NULL;
+static uint32_t timeout = 0;  // ms, 0 for none
+
+static void runFile(const char* path) {
+  Source source;
+  if (!openSource(path, &source)) {
     fprintf(stderr, "Could not open file \"%s\".\n", path);
     exit(74);
   }
+  InterpretResult result = interpretFile(path, &source, useCache);
+  if (result == INTERPRET_OK && snapshotOut != NULL && !writeSnapshot(snapshotOut)) {
+    fprintf(stderr, "Could not write snapshot \"%s\".\n", snapshotOut);
+    result = INTERPRET_RUNTIME_ERROR;
+  }
+  freeVM();
+  closeSource(&source);  // string constants point into the source, it goes away only with the vm
+
+  if (result == INTERPRET_COMPILE_ERROR) exit(65);
+  if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+}
 
-  fseek(file, 0L, SEEK_END);
-  size_t fileSize = ftell(file);
-  rewind(file);
+static void usage() {
+  fprintf(stderr,
+          "Usage: crinha [options] [path]\n"
+          "  path                        a .rinha or .rinha.json script, - reads it from stdin\n"
+          "  --gc-initial-heap=SIZE      heap size of the first collection (default 1m)\n"
+          "  --gc-max-heap=SIZE          hard heap limit, 0 for unlimited (default 0)\n"
+          "  --gc-growth=FACTOR          base growth of the heap after a collection (default 2)\n"
+          "  --gc-target-overhead=PCT    time percentage the collector may take (default 5)\n"
+          "  --stack-limit=SIZE          memory for values and frames, deeper recursion is a stack overflow (default 64m)\n"
+          "  --cache=on|off              keep the compiled code in <path>.bc to skip compiling next time (default on)\n"
+          "  --check=on|off              compile every function body before running, so syntax errors in bodies\n"
+          "                              that are never called are reported too (default off)\n"
+          "  --snapshot-out=FILE         after running path, save its globals and everything they reach to FILE\n"
+          "  --snapshot-in=FILE          start from the globals saved in FILE\n"
+          "  --batch=DIR                 run every .rinha in DIR on its own vm, output in path order\n"
+          "  --jobs=N, -j N              scripts run at the same time in batch and server mode (default one per core)\n"
+          "  --serve=SOCK                keep warm vms and run the scripts sent to the unix socket SOCK\n"
+          "  --client=SOCK               run path, or the script on stdin, on the server at SOCK\n"
+          "  --timeout=MS                time limit of each script run by the server, 0 for none (default 0)\n"
+          "  --compile-jobs=N            compile the top-level functions up front on N threads, 0 compiles each\n"
+          "                              one on its first call (default 0)\n"
+          "SIZE accepts k, m and g suffixes. Each option can also be set through the environment,\n"
+          "e.g. CRINHA_GC_MAX_HEAP=512m, and given as --name value.\n");
+  exit(64);
+}
 
-  char* buffer = (char*)malloc(fileSize + 1);
-  if (buffer == NULL) {
-    fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-    exit(74);
+static size_t parseSize(const char* name, const char* text) {
+  char* end;
+  double size = strtod(text, &end);
+  switch (*end) {
+    case 'k': case 'K': size *= 1024; end++; break;
+    case 'm': case 'M': size *= 1024 * 1024; end++; break;
+    case 'g': case 'G': size *= 1024 * 1024 * 1024; end++; break;
   }
 
-  size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-  if (bytesRead < fileSize) {
-    fprintf(stderr, "Could not read file \"%s\".\n", path);
-    exit(74);
+  if (end == text || *end != '\0' || !(size >= 0 && size < (double)SIZE_MAX)) {  // SIZE_MAX rounds up to 2^64 as a double, also rejects nan
+    fprintf(stderr, "Invalid size \"%s\" for %s.\n", text, name);
+    usage();
   }
+  return (size_t)size;
+}
 
-  buffer[bytesRead] = '\0';
+static double parseNumber(const char* name, const char* text, double min) {
+  char* end;
+  double number = strtod(text, &end);
+  if (end == text || *end != '\0' || number <= min) {
+    fprintf(stderr, "Invalid value \"%s\" for %s, must be greater than %g.\n", text, name, min);
+    usage();
+  }
+  return number;
+}
 
-  fclose(file);
-  return buffer;
+static long parseInteger(const char* name, const char* text, long min, long max) {
+  char* end;
+  errno = 0;
+  long number = strtol(text, &end, 10);
+  if (end == text || *end != '\0' || errno == ERANGE || number < min || number > max) {
+    fprintf(stderr, "Invalid value \"%s\" for %s, must be an integer from %ld to %ld.\n", text, name, min, max);
+    usage();
+  }
+  return number;
 }
 
-static void runFile(const char* path) {
-  char* source = readFile(path);
-  InterpretResult result = interpret(source);
-  free(source);
+static void setInitialHeap(const char* name, const char* value) { gcConfig.initialHeap = parseSize(name, value); }
+static void setMaxHeap(const char* name, const char* value) { gcConfig.maxHeap = parseSize(name, value); }
+static void setGrowth(const char* name, const char* value) { gcConfig.growFactor = parseNumber(name, value, 1); }
+static void setTargetOverhead(const char* name, const char* value) { gcConfig.targetOverhead = parseNumber(name, value, 0); }
+static void setStackLimit(const char* name, const char* value) { stackLimit = parseSize(name, value); }
 
-  if (result == INTERPRET_COMPILE_ERROR) exit(65);
-  if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+static bool parseSwitch(const char* name, const char* value) {
+  if (strcmp(value, "on") != 0 && strcmp(value, "off") != 0) {
+    fprintf(stderr, "Invalid value \"%s\" for %s, must be on or off.\n", value, name);
+    usage();
+  }
+  return strcmp(value, "on") == 0;
+}
+
+static void setCache(const char* name, const char* value) { useCache = parseSwitch(name, value); }
+static void setCheck(const char* name, const char* value) { checkBodies = parseSwitch(name, value); }
+
+static void setSnapshotIn(__attribute__((unused)) const char* name, const char* value) { snapshotIn = value; }
+static void setSnapshotOut(__attribute__((unused)) const char* name, const char* value) { snapshotOut = value; }
+static void setBatch(__attribute__((unused)) const char* name, const char* value) { batchDir = value; }
+static void setJobs(const char* name, const char* value) { jobs = (int)parseInteger(name, value, 1, INT_MAX); }
+static void setServe(__attribute__((unused)) const char* name, const char* value) { servePath = value; }
+static void setClient(__attribute__((unused)) const char* name, const char* value) { clientPath = value; }
+static void setTimeout(const char* name, const char* value) { timeout = (uint32_t)parseInteger(name, value, 0, UINT32_MAX); }
+static void setCompileJobs(const char* name, const char* value) { compileJobs = (int)parseInteger(name, value, 0, INT_MAX); }
+
+typedef struct {
+  const char* flag;
+  const char* env;
+  void (*apply)(const char* name, const char* value);
+} Option;
+
+static Option options[] = {
+    {"--gc-initial-heap", "CRINHA_GC_INITIAL_HEAP", setInitialHeap},
+    {"--gc-max-heap", "CRINHA_GC_MAX_HEAP", setMaxHeap},
+    {"--gc-growth", "CRINHA_GC_GROWTH", setGrowth},
+    {"--gc-target-overhead", "CRINHA_GC_TARGET_OVERHEAD", setTargetOverhead},
+    {"--stack-limit", "CRINHA_STACK_LIMIT", setStackLimit},
+    {"--cache", "CRINHA_CACHE", setCache},
+    {"--check", "CRINHA_CHECK", setCheck},
+    {"--snapshot-in", "CRINHA_SNAPSHOT_IN", setSnapshotIn},
+    {"--snapshot-out", "CRINHA_SNAPSHOT_OUT", setSnapshotOut},
+    {"--batch", "CRINHA_BATCH", setBatch},
+    {"--jobs", "CRINHA_JOBS", setJobs},
+    {"--serve", "CRINHA_SERVE", setServe},
+    {"--client", "CRINHA_CLIENT", setClient},
+    {"--timeout", "CRINHA_TIMEOUT", setTimeout},
+    {"--compile-jobs", "CRINHA_COMPILE_JOBS", setCompileJobs},
+};
+
+#define OPTION_COUNT (int)(sizeof(options) / sizeof(options[0]))
+
+static void applyEnvironment() {
+  for (int i = 0; i < OPTION_COUNT; i++) {
+    const char* value = getenv(options[i].env);
+    if (value != NULL && *value != '\0') options[i].apply(options[i].env, value);
+  }
+}
+
+static int applyFlag(const char* arg, const char* next) {  // flags are in the form --name=value or --name value, returns the arguments used
+  for (int i = 0; i < OPTION_COUNT; i++) {
+    size_t length = strlen(options[i].flag);
+    if (strncmp(arg, options[i].flag, length) != 0) continue;
+    if (arg[length] == '=') {
+      options[i].apply(options[i].flag, arg + length + 1);
+      return 1;
+    }
+    if (arg[length] == '\0' && next != NULL) {
+      options[i].apply(options[i].flag, next);
+      return 2;
+    }
+  }
+  return 0;
 }
 
 int main(int argc, const char* argv[]) {
+  applyEnvironment();
+
+  const char* path = NULL;
+  for (int i = 1; i < argc; i++) {
+    const char* next = i + 1 < argc ? argv[i + 1] : NULL;
+    if (strncmp(argv[i], "--", 2) == 0) {
+      int used = applyFlag(argv[i], next);
+      if (used == 0) usage();
+      i += used - 1;
+    } else if (strncmp(argv[i], "-j", 2) == 0) {  // short form of --jobs, as in make
+      if (argv[i][2] != '\0') {
+        setJobs("-j", argv[i] + 2);
+      } else if (next != NULL) {
+        setJobs("-j", next);
+        i++;
+      } else {
+        usage();
+      }
+    } else if (path == NULL) {
+      path = argv[i];
+    } else {
+      usage();
+    }
+  }
+
+  if (snapshotOut != NULL && path == NULL) usage();
+
+  if (jobs == 0) jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (jobs <= 0) jobs = 1;
+
+  if (clientPath != NULL) {
+    if (batchDir != NULL || servePath != NULL || snapshotIn != NULL || snapshotOut != NULL) usage();
+    return runClient(clientPath, path, gcConfig.maxHeap, timeout);  // the limits go with the request
+  }
+
+  if (servePath != NULL) {
+    if (batchDir != NULL || path != NULL || snapshotOut != NULL) usage();
+    return runServer(servePath, jobs, useCache, snapshotIn, timeout);
+  }
+
+  if (batchDir != NULL) {
+    if (path != NULL || snapshotOut != NULL) usage();
+    return runBatch(batchDir, jobs, useCache, snapshotIn);
+  }
+
   initVM();
+  if (snapshotIn != NULL && !loadSnapshot(snapshotIn)) {
+    fprintf(stderr, "Could not load snapshot \"%s\".\n", snapshotIn);
+    exit(74);
+  }
 
-  if (argc == 1) {
+  if (path == NULL) {
     repl();
-  } else if (argc == 2) {
-    runFile(argv[1]);
   } else {
-    fprintf(stderr, "Usage: crinha [path]\n");
-    exit(64);
+    runFile(path);
   }
 
-  freeVM();
   return 0;
 }
\ No newline at end of file
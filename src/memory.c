@@ -1,8 +1,10 @@
 #include "memory.h"
 
 #include <stdlib.h>
+#include <time.h>
 
 #include "compiler.h"
+#include "snapshot.h"
 #include "vm.h"
 
 #ifdef DEBUG_LOG_GC
@@ -11,9 +13,20 @@
 #include "debug.h"
 #endif
 
+#define GC_INITIAL_HEAP (1024 * 1024)
 #define GC_HEAP_GROW_FACTOR 2
+#define GC_MAX_GROW_FACTOR 16
+#define GC_TARGET_OVERHEAD 5
 
-void* reallocate(void* pointer, __attribute__((unused)) size_t oldSize, size_t newSize) {
+GCConfig gcConfig = {GC_INITIAL_HEAP, 0, GC_HEAP_GROW_FACTOR, GC_TARGET_OVERHEAD};
+
+static double threadTime() {  // cpu time of the running thread, so the overhead is not skewed by other processes
+  struct timespec time;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static void trackAllocation(size_t oldSize, size_t newSize) {
   vm.bytesAllocated += newSize - oldSize;
   if (newSize > oldSize) {
 #ifdef DEBUG_STRESS_GC
@@ -22,18 +35,97 @@ void* reallocate(void* pointer, __attribute__((unused)) size_t oldSize, size_t n
     if (vm.bytesAllocated > vm.nextGC) {
       collectGarbage();
     }
+
+    if (vm.maxHeap != 0 && vm.bytesAllocated > vm.maxHeap) {
+      vm.bytesAllocated -= newSize - oldSize;
+      runtimePanic("Out of memory: heap limit of %zu bytes exceeded.", vm.maxHeap);
+    }
+  }
+}
+
+void initGC() {
+  vm.heap.arenas = NULL;
+  vm.heap.largeObjects = NULL;
+  for (int i = 0; i < HEAP_SIZE_CLASSES; i++) {
+    vm.heap.freeLists[i] = NULL;
+  }
+
+  if (gcConfig.maxHeap != 0 && gcConfig.initialHeap > gcConfig.maxHeap) {
+    gcConfig.initialHeap = gcConfig.maxHeap;
   }
 
+  vm.bytesAllocated = 0;
+  vm.maxHeap = gcConfig.maxHeap;
+  vm.nextGC = gcConfig.initialHeap;
+  vm.gcGrowFactor = gcConfig.growFactor;
+  vm.gcLastEnd = threadTime();
+
+  vm.grayCount = 0;
+  vm.grayCapacity = 0;
+  vm.grayStack = NULL;
+}
+
+void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
+  trackAllocation(oldSize, newSize);
+
   if (newSize == 0) {
     free(pointer);
     return NULL;
   }
 
   void* result = realloc(pointer, newSize);
-  if (result == NULL) exit(1);
+  if (result == NULL) {
+    vm.bytesAllocated -= newSize - oldSize;
+    runtimePanic("Out of memory: could not allocate %zu bytes.", newSize);
+  }
   return result;
 }
 
+static Arena* newArena(size_t slotSize, size_t slotCount) {
+  Arena* arena = (Arena*)malloc(sizeof(Arena) + slotSize * slotCount);
+  if (arena == NULL) runtimePanic("Out of memory: could not allocate a heap arena.");
+  arena->slotSize = slotSize;
+  arena->slotCount = slotCount;
+  return arena;
+}
+
+static FreeSlot* refillSizeClass(int sizeClass) {
+  size_t slotSize = (sizeClass + 1) * HEAP_GRANULE;
+  Arena* arena = newArena(slotSize, HEAP_ARENA_SIZE / slotSize);
+  arena->next = vm.heap.arenas;
+  vm.heap.arenas = arena;
+
+  FreeSlot* freeList = NULL;
+  for (size_t i = arena->slotCount; i > 0; i--) {  // backwards so the list hands out slots in address order
+    FreeSlot* slot = (FreeSlot*)(arena->slots + (i - 1) * slotSize);
+    slot->obj.type = OBJ_FREE;
+    slot->obj.isMarked = false;
+    slot->next = freeList;
+    freeList = slot;
+  }
+  return freeList;
+}
+
+Obj* allocateHeapObject(size_t size) {
+  if (size < sizeof(FreeSlot)) size = sizeof(FreeSlot);
+
+  if (size > HEAP_GRANULE * HEAP_SIZE_CLASSES) {
+    trackAllocation(0, size);
+    Arena* arena = newArena(size, 1);
+    arena->next = vm.heap.largeObjects;
+    vm.heap.largeObjects = arena;
+    return (Obj*)arena->slots;
+  }
+
+  int sizeClass = (int)((size + HEAP_GRANULE - 1) / HEAP_GRANULE) - 1;
+  trackAllocation(0, (sizeClass + 1) * HEAP_GRANULE);  // may collect, so the free list is read only afterwards
+
+  FreeSlot* slot = vm.heap.freeLists[sizeClass];
+  if (slot == NULL) slot = refillSizeClass(sizeClass);
+  vm.heap.freeLists[sizeClass] = slot->next;
+  return (Obj*)slot;
+}
+
 void markObject(Obj* object) {
   if (object == NULL) return;
   if (object->isMarked) return;
@@ -50,7 +142,7 @@ void markObject(Obj* object) {
     vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
     vm.grayStack = (Obj**)realloc(vm.grayStack, sizeof(Obj*) * vm.grayCapacity);
 
-    if (vm.grayStack == NULL) exit(1);
+    if (vm.grayStack == NULL) runtimePanic("Out of memory: could not grow the gray stack.");
   }
 
   vm.grayStack[vm.grayCount++] = object;
@@ -78,6 +170,7 @@ static void blackenObject(Obj* object) {
       ObjTuple* tuple = (ObjTuple*)object;
       markValue(tuple->first);
       markValue(tuple->second);
+      break;
     }
     case OBJ_CLOSURE: {
       ObjClosure* closure = (ObjClosure*)object;
@@ -96,13 +189,22 @@ static void blackenObject(Obj* object) {
     case OBJ_UPVALUE:
       markValue(((ObjUpvalue*)object)->closed);
       break;
+    case OBJ_STRING: {
+      ObjString* string = (ObjString*)object;
+      if (string->kind == STRING_ROPE) {
+        markObject((Obj*)AS_ROPE(string)->left);
+        markObject((Obj*)AS_ROPE(string)->right);
+      }
+      break;
+    }
+    case OBJ_BIGINT:
     case OBJ_NATIVE:
-    case OBJ_STRING:
+    case OBJ_FREE:
       break;
   }
 }
 
-static void freeObject(Obj* object) {
+static void freeObject(Obj* object, size_t slotSize) {  // releases what the object owns, the slot itself goes back to the heap
 #ifdef DEBUG_LOG_GC
   printf("%p free type %d\n\n", (void*)object, object->type);
 #endif
@@ -111,38 +213,35 @@ static void freeObject(Obj* object) {
     case OBJ_CLOSURE: {
       ObjClosure* closure = (ObjClosure*)object;
       FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
-      FREE(ObjClosure, object);
       break;
     }
     case OBJ_FUNCTION: {
       ObjFunction* function = (ObjFunction*)object;
       freeChunk(&function->chunk);
-      FREE(ObjFunction, object);
-      break;
-    }
-    case OBJ_NATIVE: {
-      FREE(ObjNative, object);
+      if (function->deferred != NULL) freeDeferred(function);
       break;
     }
     case OBJ_STRING: {
       ObjString* string = (ObjString*)object;
-      FREE_ARRAY(char, string->chars, string->length + 1);
-      FREE(ObjString, object);
-      break;
-    }
-    case OBJ_TUPLE: {
-      FREE(ObjTuple, object);
+      if (string->kind == STRING_ROPE && string->chars != NULL) {  // the only strings with chars of their own
+        FREE_ARRAY(char, string->chars, string->length + 1);
+      }
       break;
     }
-    case OBJ_UPVALUE: {
-      FREE(ObjUpvalue, object);
+    case OBJ_BIGINT:
+    case OBJ_NATIVE:
+    case OBJ_TUPLE:
+    case OBJ_UPVALUE:
+    case OBJ_FREE:
       break;
-    }
   }
+
+  object->type = OBJ_FREE;
+  vm.bytesAllocated -= slotSize;
 }
 
 static void markRoots() {
-  for (Value* slot = vm.stack; slot < vm.stack + vm.stackCount; slot++) {
+  for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
     markValue(*slot);
   }
 
@@ -156,6 +255,7 @@ static void markRoots() {
 
   markTable(&vm.globals);
   markCompilerRoots();
+  markSnapshotRoots();
 }
 
 static void traceReferences() {
@@ -165,40 +265,99 @@ static void traceReferences() {
   }
 }
 
-static void sweep() {
-  Obj* previous = NULL;
-  Obj* object = vm.objects;
-  while (object != NULL) {
+static void sweep() {  // walks every slot and rebuilds the free lists, arenas left without live objects are released
+  for (int i = 0; i < HEAP_SIZE_CLASSES; i++) {
+    vm.heap.freeLists[i] = NULL;
+  }
+
+  Arena** link = &vm.heap.arenas;
+  while (*link != NULL) {
+    Arena* arena = *link;
+    int sizeClass = (int)(arena->slotSize / HEAP_GRANULE) - 1;
+    FreeSlot* freeList = vm.heap.freeLists[sizeClass];
+    FreeSlot* arenaFree = freeList;
+    size_t live = 0;
+
+    for (size_t i = arena->slotCount; i > 0; i--) {
+      Obj* object = (Obj*)(arena->slots + (i - 1) * arena->slotSize);
+      if (object->isMarked) {
+        object->isMarked = false;
+        live++;
+        continue;
+      }
+
+      if (object->type != OBJ_FREE) freeObject(object, arena->slotSize);
+      FreeSlot* slot = (FreeSlot*)object;
+      slot->next = arenaFree;
+      arenaFree = slot;
+    }
+
+    if (live == 0) {
+      *link = arena->next;
+      free(arena);
+    } else {
+      vm.heap.freeLists[sizeClass] = arenaFree;
+      link = &arena->next;
+    }
+  }
+
+  link = &vm.heap.largeObjects;
+  while (*link != NULL) {
+    Arena* arena = *link;
+    Obj* object = (Obj*)arena->slots;
     if (object->isMarked) {
       object->isMarked = false;
-      previous = object;
-      object = object->next;
+      link = &arena->next;
     } else {
-      Obj* unreached = object;
-      object = object->next;
-      if (previous != NULL) {
-        previous->next = object;
-      } else {
-        vm.objects = object;
-      }
-
-      freeObject(unreached);
+      freeObject(object, arena->slotSize);
+      *link = arena->next;
+      free(arena);
     }
   }
 }
 
+static void adjustThreshold(size_t before, double pause, double mutator) {
+  double overhead = pause + mutator > 0 ? 100 * pause / (pause + mutator) : 0;
+  double survival = before > 0 ? (double)vm.bytesAllocated / before : 1;
+
+  if (overhead > gcConfig.targetOverhead) {  // collecting too often, give the mutator more room
+    vm.gcGrowFactor *= 1.5;
+    if (vm.gcGrowFactor > GC_MAX_GROW_FACTOR) vm.gcGrowFactor = GC_MAX_GROW_FACTOR;
+  } else if (overhead < gcConfig.targetOverhead / 2) {  // well under budget, tighten back to the base factor
+    vm.gcGrowFactor /= 1.25;
+    if (vm.gcGrowFactor < gcConfig.growFactor) vm.gcGrowFactor = gcConfig.growFactor;
+  }
+
+  // a collection that freed little will free little next time too, so the headroom scales with survival
+  double headroom = vm.bytesAllocated * (vm.gcGrowFactor - 1) * (0.5 + survival);
+  size_t next = vm.bytesAllocated + (size_t)headroom;
+
+  if (next < gcConfig.initialHeap) next = gcConfig.initialHeap;
+  if (vm.maxHeap != 0 && next > vm.maxHeap) next = vm.maxHeap;
+  vm.nextGC = next;
+
+#ifdef DEBUG_LOG_GC
+  printf("   overhead %.2f%% survival %.2f factor %.2f\n", overhead, survival, vm.gcGrowFactor);
+#endif
+}
+
 void collectGarbage() {
 #ifdef DEBUG_LOG_GC
   printf("-- gc begin\n");
-  size_t before = vm.bytesAllocated;
 #endif
+  size_t before = vm.bytesAllocated;
+  double start = threadTime();
 
   markRoots();
   traceReferences();
   tableRemoveWhite(&vm.strings);
   sweep();
+  trimStack(&vm.stackRegion, (size_t)((char*)vm.stackTop - (char*)vm.stack));
+  trimStack(&vm.frameRegion, vm.frameCount * sizeof(CallFrame));
 
-  vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+  double end = threadTime();
+  adjustThreshold(before, end - start, start - vm.gcLastEnd);
+  vm.gcLastEnd = end;
 
 #ifdef DEBUG_LOG_GC
   printf("-- gc end\n");
@@ -208,13 +367,22 @@ void collectGarbage() {
 #endif
 }
 
-void freeObjects() {
-  Obj* object = vm.objects;
-  while (object != NULL) {
-    Obj* next = object->next;
-    freeObject(object);
-    object = next;
+static void freeArenas(Arena* arena) {
+  while (arena != NULL) {
+    Arena* next = arena->next;
+    for (size_t i = 0; i < arena->slotCount; i++) {
+      Obj* object = (Obj*)(arena->slots + i * arena->slotSize);
+      if (object->type != OBJ_FREE) freeObject(object, arena->slotSize);
+    }
+    free(arena);
+    arena = next;
   }
+}
+
+void freeObjects() {
+  freeArenas(vm.heap.arenas);
+  freeArenas(vm.heap.largeObjects);
 
   free(vm.grayStack);
+  initGC();
 }
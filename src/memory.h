@@ -19,11 +19,44 @@
 #define FREE_ARRAY(type, pointer, oldCount) \
   (type*)reallocate(pointer, sizeof(type) * (oldCount), 0)
 
+typedef struct {
+  size_t initialHeap;     // first collection threshold, also the lower bound for every next one
+  size_t maxHeap;         // hard limit, 0 means unlimited
+  double growFactor;      // base growth of the threshold over the live heap
+  double targetOverhead;  // percentage of time the collector is allowed to take
+} GCConfig;
+
+#define HEAP_GRANULE 8
+#define HEAP_SIZE_CLASSES 32  // objects up to HEAP_GRANULE * HEAP_SIZE_CLASSES bytes share arenas, bigger ones get their own
+#define HEAP_ARENA_SIZE (64 * 1024)
+
+typedef struct Arena {
+  struct Arena* next;
+  size_t slotSize;
+  size_t slotCount;
+  _Alignas(16) char slots[];
+} Arena;
+
+typedef struct FreeSlot {
+  Obj obj;  // always OBJ_FREE
+  struct FreeSlot* next;
+} FreeSlot;
+
+typedef struct {
+  Arena* arenas;        // small objects, one size class per arena
+  Arena* largeObjects;  // one object per arena
+  FreeSlot* freeLists[HEAP_SIZE_CLASSES];
+} Heap;
+
+extern GCConfig gcConfig;
+
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+Obj* allocateHeapObject(size_t size);
+void initGC();
 void freeObjects();
 
 void markObject(Obj* object);
 void markValue(Value value);
 void collectGarbage();
 
-#endif
\ No newline at end of file
+#endif
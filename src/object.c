@@ -1,8 +1,11 @@
 #include "object.h"
 
+#include <inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "bigint.h"
 #include "memory.h"
 #include "table.h"
 #include "value.h"
@@ -11,14 +14,13 @@
 #define ALLOCATE_OBJ(type, objectType) \
   (type*)allocateObject(sizeof(type), objectType)
 
+#define ROPE_MIN_LENGTH 64  // shorter concatenations are copied right away, copying is cheaper than a rope
+
 static Obj* allocateObject(size_t size, ObjType type) {
-  Obj* object = (Obj*)reallocate(NULL, 0, size);
+  Obj* object = allocateHeapObject(size);
   object->type = type;
   object->isMarked = false;
 
-  object->next = vm.objects;
-  vm.objects = object;
-
 #ifdef DEBUG_LOG_GC
   printf("%p allocate %zu for %d\n\n", (void*)object, size, type);
 #endif
@@ -43,57 +45,221 @@ ObjFunction* newFunction() {
   ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
   function->arity = 0;
   function->upvalueCount = 0;
+  function->maxStack = 0;
   function->name = NULL;
+  function->cached = NULL;
+  function->deferred = NULL;
   initChunk(&function->chunk);
   return function;
 }
 
+DeferredBody* newDeferred(const char* body, int length, int line, int captureCount) {  // the captures are filled by the caller
+  DeferredBody* deferred = (DeferredBody*)reallocate(NULL, 0, sizeof(DeferredBody) + sizeof(Capture) * captureCount);
+  deferred->body = body;
+  deferred->length = length;
+  deferred->line = line;
+  return deferred;
+}
+
+void freeDeferred(ObjFunction* function) {  // once the body is compiled, or with the function
+  reallocate(function->deferred, sizeof(DeferredBody) + sizeof(Capture) * function->upvalueCount, 0);
+  function->deferred = NULL;
+}
+
 ObjNative* newNative(NativeFn function) {
   ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
   native->function = function;
   return native;
 }
 
-static ObjString* allocateString(char* chars, int length, uint32_t hash) {
-  ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+#define HASH_SEED 0xa0761d6478bd642full
+#define HASH_P1 0xe7037ed1a0b428dbull
+#define HASH_P2 0x8ebc6af09c88c6e3ull
+#define HASH_P3 0x589965cc75374cc3ull
+
+static inline uint64_t hashMix(uint64_t a, uint64_t b) {  // folded 64x64->128 multiply
+  __uint128_t product = (__uint128_t)a * b;
+  return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+static inline uint64_t read64(const uint8_t* p) {
+  uint64_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static inline uint64_t read32(const uint8_t* p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+uint64_t hashBytes(const char* key, size_t length) {  // word at a time multiply-mix (wyhash style), 32 bytes per step on long strings
+  const uint8_t* p = (const uint8_t*)key;
+  size_t remaining = length;
+  uint64_t seed = HASH_SEED ^ remaining;
+
+  if (remaining > 32) {
+    uint64_t other = seed;
+    do {  // two independent lanes so the multiplies overlap
+      seed = hashMix(read64(p) ^ HASH_P1, read64(p + 8) ^ seed);
+      other = hashMix(read64(p + 16) ^ HASH_P2, read64(p + 24) ^ other);
+      p += 32;
+      remaining -= 32;
+    } while (remaining > 32);
+    seed ^= other;
+  }
+
+  while (remaining > 16) {
+    seed = hashMix(read64(p) ^ HASH_P1, read64(p + 8) ^ seed);
+    p += 16;
+    remaining -= 16;
+  }
+
+  uint64_t a = 0, b = 0;
+  if (remaining >= 8) {  // the last word overlaps the first one when shorter than 16
+    a = read64(p);
+    b = read64(p + remaining - 8);
+  } else if (remaining >= 4) {
+    a = read32(p);
+    b = read32(p + remaining - 4);
+  } else if (remaining > 0) {
+    a = ((uint64_t)p[0] << 16) | ((uint64_t)p[remaining >> 1] << 8) | p[remaining - 1];
+  }
+
+  return hashMix(HASH_P3 ^ (uint64_t)length, hashMix(a ^ HASH_P1, b ^ seed));
+}
+
+static uint32_t hashString(const char* key, int length) {
+  uint64_t hash = hashBytes(key, (size_t)length);
+  return (uint32_t)(hash ^ (hash >> 32));
+}
+
+static ObjString* allocateString(size_t size, int length, StringKind kind) {
+  ObjString* string = (ObjString*)allocateObject(sizeof(ObjString) + size, OBJ_STRING);
   string->length = length;
-  string->chars = chars;
+  string->hash = 0;
+  string->kind = kind;
+  string->isInterned = false;
+  string->hasHash = false;
+  string->chars = string->data;
+  return string;
+}
+
+static ObjString* intern(ObjString* string, uint32_t hash) {
   string->hash = hash;
+  string->hasHash = true;
+  string->isInterned = true;
   push(OBJ_VAL(string));
   tableSet(&vm.strings, string, NIL_VAL);
   pop();
   return string;
 }
 
-static uint32_t hashString(const char* key, int length) {  // hash alg FNV-1a. There may be others that do the job better
-  uint32_t hash = 2166136261u;
-  for (int i = 0; i < length; i++) {
-    hash ^= (uint8_t)key[i];
-    hash *= 16777619;
-  }
-  return hash;
-}
-
-ObjString* takeString(char* chars, int length) {
+ObjString* copyString(const char* chars, int length) {
   uint32_t hash = hashString(chars, length);
   ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
-  if (interned != NULL) {
-    FREE_ARRAY(char, chars, length + 1);
-    return interned;
-  }
+  if (interned != NULL) return interned;
 
-  return allocateString(chars, length, hash);
+  ObjString* string = allocateString(length + 1, length, STRING_INLINE);
+  memcpy(string->data, chars, length);
+  string->data[length] = '\0';
+  return intern(string, hash);
 }
 
-ObjString* copyString(const char* chars, int length) {
+ObjString* sourceString(const char* chars, int length) {  // chars are not copied, they must outlive the vm
   uint32_t hash = hashString(chars, length);
   ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
   if (interned != NULL) return interned;
 
-  char* heapChars = ALLOCATE(char, length + 1);
-  memcpy(heapChars, chars, length);
-  heapChars[length] = '\0';
-  return allocateString(heapChars, length, hash);
+  ObjString* string = allocateString(0, length, STRING_SOURCE);
+  string->chars = (char*)chars;
+  return intern(string, hash);
+}
+
+ObjString* borrowString(const char* chars, int length) {  // like sourceString but not interned, for runtime strings loaded from a snapshot
+  ObjString* string = allocateString(0, length, STRING_SOURCE);
+  string->chars = (char*)chars;
+  return string;
+}
+
+ObjString* newString(const char* chars, int length) {
+  ObjString* string = allocateString(length + 1, length, STRING_INLINE);
+  memcpy(string->data, chars, length);
+  string->data[length] = '\0';
+  return string;
+}
+
+ObjString* concatenateStrings(ObjString* a, ObjString* b) {  // a and b must be reachable, allocating may collect
+  int length = a->length + b->length;
+  if (length > ROPE_MIN_LENGTH) {
+    ObjString* string = allocateString(sizeof(Rope), length, STRING_ROPE);
+    string->chars = NULL;
+    AS_ROPE(string)->left = a;
+    AS_ROPE(string)->right = b;
+    return string;
+  }
+
+  // both sides are shorter than a rope, so they are flat
+  char chars[ROPE_MIN_LENGTH];
+  memcpy(chars, a->chars, a->length);
+  memcpy(chars + a->length, b->chars, b->length);
+  return newString(chars, length);
+}
+
+static void flattenRope(ObjString* rope) {  // iterative, ropes built in loops are as deep as the loop
+  char* chars = ALLOCATE(char, rope->length + 1);
+
+  int capacity = 8;
+  int count = 0;
+  ObjString** pending = (ObjString**)malloc(sizeof(ObjString*) * capacity);
+  if (pending == NULL) runtimePanic("Out of memory: could not flatten string.");
+  pending[count++] = rope;
+
+  int offset = 0;
+  while (count > 0) {
+    ObjString* node = pending[--count];
+    if (node->chars != NULL) {
+      memcpy(chars + offset, node->chars, node->length);
+      offset += node->length;
+      continue;
+    }
+
+    if (capacity < count + 2) {
+      capacity = GROW_CAPACITY(capacity);
+      pending = (ObjString**)realloc(pending, sizeof(ObjString*) * capacity);
+      if (pending == NULL) runtimePanic("Out of memory: could not flatten string.");
+    }
+    pending[count++] = AS_ROPE(node)->right;
+    pending[count++] = AS_ROPE(node)->left;
+  }
+  free(pending);
+
+  chars[rope->length] = '\0';
+  rope->chars = chars;
+  AS_ROPE(rope)->left = NULL;  // the pieces can be collected now
+  AS_ROPE(rope)->right = NULL;
+}
+
+char* stringChars(ObjString* string) {  // flattens ropes, so the string must be reachable
+  if (string->chars == NULL) flattenRope(string);
+  return string->chars;
+}
+
+uint32_t stringHash(ObjString* string) {  // flattens ropes, so the string must be reachable
+  if (!string->hasHash) {
+    string->hash = hashString(stringChars(string), string->length);
+    string->hasHash = true;
+  }
+  return string->hash;
+}
+
+bool stringsEqual(ObjString* a, ObjString* b) {
+  if (a == b) return true;
+  if (a->isInterned && b->isInterned) return false;  // different pointers means different strings
+  if (a->length != b->length) return false;
+  if (stringHash(a) != stringHash(b)) return false;
+  return memcmp(a->chars, b->chars, a->length) == 0;
 }
 
 ObjTuple* newTuple(Value* first, Value* second) {
@@ -103,6 +269,13 @@ ObjTuple* newTuple(Value* first, Value* second) {
   return tuple;
 }
 
+ObjBigInt* newBigInt(int count) {  // the caller fills the limbs
+  ObjBigInt* bigInt = (ObjBigInt*)allocateObject(sizeof(ObjBigInt) + sizeof(uint32_t) * count, OBJ_BIGINT);
+  bigInt->negative = false;
+  bigInt->count = count;
+  return bigInt;
+}
+
 ObjUpvalue* newUpvalue(Value* slot) {
   ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
   upvalue->closed = NIL_VAL;
@@ -113,42 +286,57 @@ ObjUpvalue* newUpvalue(Value* slot) {
 
 ObjString* convertToString(Value value) {
   if (IS_NUMBER(value)) {
-    int number = AS_NUMBER(value);
-    int length = snprintf(NULL, 0, "%d", number);
-    char* str = ALLOCATE(char, length + 1);
-    snprintf(str, length + 1, "%d", number);
-    str[length] = '\0';
-    return takeString(str, length);
+    char chars[24];
+    int length = snprintf(chars, sizeof(chars), "%" PRId64, AS_NUMBER(value));
+    return newString(chars, length);
+  }
+  if (IS_BIGINT(value)) {
+    int length;
+    char* chars = formatBigInt(AS_BIGINT(value), &length);
+    ObjString* string = newString(chars, length);
+    free(chars);
+    return string;
   }
 
-  return takeString("", 0);
+  return newString("", 0);
 }
 
 void printObject(Value value) {
   switch (OBJ_TYPE(value)) {
+    case OBJ_BIGINT: {
+      int length;
+      char* chars = formatBigInt(AS_BIGINT(value), &length);
+      fprintf(vm.out, "%.*s", length, chars);
+      free(chars);
+      break;
+    }
     case OBJ_CLOSURE:
-      printf("<#closure>");
+      fprintf(vm.out, "<#closure>");
       break;
     case OBJ_FUNCTION:
-      printf("<#closure>");
+      fprintf(vm.out, "<#closure>");
       break;
     case OBJ_NATIVE:
-      printf("<native fn>");
+      fprintf(vm.out, "<native fn>");
       break;
-    case OBJ_STRING:
-      printf("%s", AS_CSTRING(value));
+    case OBJ_STRING: {
+      ObjString* string = AS_STRING(value);
+      fprintf(vm.out, "%.*s", string->length, stringChars(string));  // source strings are not null terminated
       break;
+    }
     case OBJ_TUPLE: {
       ObjTuple* tuple = AS_TUPLE(value);
-      printf("(");
+      fprintf(vm.out, "(");
       printValue(tuple->first);
-      printf(", ");
+      fprintf(vm.out, ", ");
       printValue(tuple->second);
-      printf(")");
+      fprintf(vm.out, ")");
       break;
     }
     case OBJ_UPVALUE:
-      printf("upvalue");
+      fprintf(vm.out, "upvalue");
+      break;
+    case OBJ_FREE:
       break;
   }
 }
\ No newline at end of file
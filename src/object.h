@@ -7,40 +7,57 @@
 
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 
+#define IS_BIGINT(value) isObjType(value, OBJ_BIGINT)
 #define IS_CLOSURE(value) isObjType(value, OBJ_CLOSURE)
 #define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
 #define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
 #define IS_TUPLE(value) isObjType(value, OBJ_TUPLE)
 
+#define AS_BIGINT(value) ((ObjBigInt*)AS_OBJ(value))
 #define AS_CLOSURE(value) ((ObjClosure*)AS_OBJ(value))
 #define AS_FUNCTION(value) ((ObjFunction*)AS_OBJ(value))
 #define AS_NATIVE(value) (((ObjNative*)AS_OBJ(value))->function)
 #define AS_STRING(value) ((ObjString*)AS_OBJ(value))
-#define AS_CSTRING(value) (((ObjString*)AS_OBJ(value))->chars)
 #define AS_TUPLE(value) ((ObjTuple*)AS_OBJ(value))
 
 typedef enum {
+  OBJ_BIGINT,
   OBJ_CLOSURE,
   OBJ_FUNCTION,
   OBJ_NATIVE,
   OBJ_STRING,
   OBJ_TUPLE,
   OBJ_UPVALUE,
+  OBJ_FREE,  // unused heap slot
 } ObjType;
 
-struct Obj {
-  ObjType type;
-  bool isMarked;
-  struct Obj* next;
+struct Obj {  // packed in a single word, objects are reached by walking the heap arenas instead of a list
+  ObjType type : 8;
+  bool isMarked : 1;
 };
 
+typedef struct {
+  const char* chars;
+  int length;
+} Capture;
+
+typedef struct {  // a function body that has not been compiled yet, see compileDeferred
+  const char* body;  // from the parameter list to the closing brace, in the source, which lives as long as the vm
+  int length;
+  int line;
+  Capture captures[];  // names of the upvalues in their order, upvalueCount of them
+} DeferredBody;
+
 typedef struct {
   Obj obj;
   int arity;
   int upvalueCount;
+  int maxStack;  // slots the function needs from its frame base, computed by the compiler
   Chunk chunk;
   ObjString* name;
+  const struct CachedFunction* cached;  // body still in the bytecode cache, loaded when the first closure is made
+  DeferredBody* deferred;  // body still in the source, compiled on the first call
 } ObjFunction;
 
 typedef Value (*NativeFn)(int argCount, Value* args);
@@ -50,19 +67,43 @@ typedef struct {
   NativeFn function;
 } ObjNative;
 
-struct ObjString {  // PERF: could allocate ObjString and chars once using flexible array members
+typedef enum {
+  STRING_INLINE,  // chars stored right after the header
+  STRING_SOURCE,  // chars point into a buffer that outlives the vm, like the source code
+  STRING_ROPE,    // result of a long concatenation, chars are built on the first read
+} StringKind;
+
+struct ObjString {  // strings made while running are neither interned nor hashed until a comparison needs it
   Obj obj;
   int length;
-  uint32_t hash;
-  char* chars;  // MEM: could point to the source string if the string is "constant", reducing memory usage
+  uint32_t hash;  // only valid if hasHash, see stringHash
+  StringKind kind : 8;
+  bool isInterned : 1;
+  bool hasHash : 1;
+  char* chars;  // NULL while a rope is not flattened
+  char data[];  // inline chars, or the Rope of a rope
 };
 
+typedef struct {
+  ObjString* left;
+  ObjString* right;
+} Rope;
+
+#define AS_ROPE(string) ((Rope*)(string)->data)
+
 typedef struct {
   Obj obj;
   Value first;
   Value second;
 } ObjTuple;
 
+typedef struct {  // an integer past int64_t, results that fit are always numbers so a bigint never equals one
+  Obj obj;
+  bool negative;
+  int count;         // limbs, the most significant one is never zero
+  uint32_t limbs[];  // magnitude, least significant first, see bigint.c
+} ObjBigInt;
+
 typedef struct ObjUpvalue {
   Obj obj;
   Value* location;
@@ -79,11 +120,21 @@ typedef struct {
 
 ObjClosure* newClosure(ObjFunction* function);
 ObjFunction* newFunction();
+DeferredBody* newDeferred(const char* body, int length, int line, int captureCount);
+void freeDeferred(ObjFunction* function);
 ObjNative* newNative(NativeFn function);
-ObjString* takeString(char* chars, int length);
 ObjString* copyString(const char* chars, int length);
+ObjString* sourceString(const char* chars, int length);
+ObjString* borrowString(const char* chars, int length);
+ObjString* newString(const char* chars, int length);
 ObjString* convertToString(Value value);
+ObjString* concatenateStrings(ObjString* a, ObjString* b);
+char* stringChars(ObjString* string);
+uint32_t stringHash(ObjString* string);
+uint64_t hashBytes(const char* key, size_t length);
+bool stringsEqual(ObjString* a, ObjString* b);
 ObjTuple* newTuple(Value* first, Value* second);
+ObjBigInt* newBigInt(int count);
 ObjUpvalue* newUpvalue(Value* slot);
 void printObject(Value value);
 
@@ -1,15 +1,23 @@
 OPCODE(CONSTANT)
+OPCODE(CONSTANT_LONG)
 OPCODE(NIL)
 OPCODE(TRUE)
 OPCODE(FALSE)
 OPCODE(POP)
 OPCODE(GET_LOCAL)
+OPCODE(GET_LOCAL_LONG)
 OPCODE(SET_LOCAL)
+OPCODE(SET_LOCAL_LONG)
 OPCODE(GET_GLOBAL)
+OPCODE(GET_GLOBAL_LONG)
 OPCODE(GET_UPVALUE)
+OPCODE(GET_UPVALUE_LONG)
 OPCODE(SET_UPVALUE)
+OPCODE(SET_UPVALUE_LONG)
 OPCODE(DEFINE_GLOBAL)
+OPCODE(DEFINE_GLOBAL_LONG)
 OPCODE(SET_GLOBAL)
+OPCODE(SET_GLOBAL_LONG)
 OPCODE(DEFINE_TUPLE)
 OPCODE(BANG_EQUAL)
 OPCODE(EQUAL)
@@ -25,12 +33,26 @@ OPCODE(MODULO)
 OPCODE(NOT)
 OPCODE(NEGATE)
 OPCODE(PRINT)
+OPCODE(FIRST)
+OPCODE(SECOND)
 OPCODE(JUMP)
+OPCODE(JUMP_LONG)
 OPCODE(JUMP_IF_TRUE)
+OPCODE(JUMP_IF_TRUE_LONG)
 OPCODE(JUMP_IF_FALSE)
+OPCODE(JUMP_IF_FALSE_LONG)
 OPCODE(LOOP)
 OPCODE(CALL)
+OPCODE(CALL_0)
+OPCODE(CALL_1)
+OPCODE(CALL_2)
+OPCODE(CALL_3)
 OPCODE(TCALL)
+OPCODE(TCALL_0)
+OPCODE(TCALL_1)
+OPCODE(TCALL_2)
+OPCODE(TCALL_3)
 OPCODE(CLOSURE)
+OPCODE(CLOSURE_LONG)
 OPCODE(CLOSE_UPVALUE)
 OPCODE(RETURN)
\ No newline at end of file
@@ -0,0 +1,191 @@
+#include "parallel.h"
+
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "memory.h"
+#include "vm.h"
+
+// the script is compiled first with its top-level functions deferred, which only matches their braces; then the
+// bodies are compiled on worker threads, each on a vm of its own as heaps are not shared, and copied into the
+// script's vm in the order of its constants, so interning and the constant pools come out the same on every run
+
+int compileJobs = 0;
+
+typedef struct {
+  ObjFunction** bodies;    // deferred functions of the script, filled in place
+  ObjFunction** compiled;  // the same bodies compiled in a worker heap, NULL if they have errors
+  int count;
+  atomic_int next;
+  int running;   // workers still compiling
+  bool adopted;  // the main thread is done copying, the workers can free their vms
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+} Work;
+
+static void compileNested(ObjFunction* function) {  // the whole tree below a body, the ones with errors stay deferred
+  for (int i = 0; i < function->chunk.constants.count; i++) {
+    Value constant = function->chunk.constants.values[i];
+    if (!IS_FUNCTION(constant)) continue;
+    ObjFunction* nested = AS_FUNCTION(constant);
+    if (nested->deferred == NULL || compileDeferred(nested)) compileNested(nested);
+  }
+}
+
+static ObjFunction* compileBody(ObjFunction* from) {  // in the worker heap, from belongs to the main thread which is waiting
+  ObjFunction* function = newFunction();
+  push(OBJ_VAL(function));  // stays on the worker stack until it is copied
+  function->upvalueCount = from->upvalueCount;
+  function->deferred = newDeferred(from->deferred->body, from->deferred->length, from->deferred->line, from->upvalueCount);
+  memcpy(function->deferred->captures, from->deferred->captures, sizeof(Capture) * from->upvalueCount);
+
+  if (!compileDeferred(function)) return NULL;
+  compileNested(function);
+  return function;
+}
+
+static void* worker(void* arg) {
+  Work* work = (Work*)arg;
+  initVM();
+  vm.maxHeap = 0;  // the limit is meant for the script, this heap only holds compiled code
+
+  FILE* sink = fopen("/dev/null", "w");  // errors are reported by the main thread when the function is called
+  jmp_buf panicJump;
+  if (sink != NULL && setjmp(panicJump) == 0) {  // a panic leaves the rest of the bodies to the other workers
+    vm.err = sink;
+    vm.panicJump = &panicJump;
+    for (int index = atomic_fetch_add(&work->next, 1); index < work->count; index = atomic_fetch_add(&work->next, 1)) {
+      work->compiled[index] = compileBody(work->bodies[index]);
+    }
+  }
+  vm.panicJump = NULL;
+
+  pthread_mutex_lock(&work->lock);
+  work->running--;
+  pthread_cond_broadcast(&work->changed);
+  while (!work->adopted) pthread_cond_wait(&work->changed, &work->lock);  // the compiled code lives in this heap
+  pthread_mutex_unlock(&work->lock);
+
+  vm.err = stderr;
+  if (sink != NULL) fclose(sink);
+  freeVM();
+  return NULL;
+}
+
+static void adoptChunk(ObjFunction* function, ObjFunction* from);
+
+static Value adoptValue(Value value) {  // a constant from a worker heap, compile time constants are strings, bigints and functions
+  if (!IS_OBJ(value)) return value;
+  if (IS_BIGINT(value)) {
+    ObjBigInt* from = AS_BIGINT(value);
+    ObjBigInt* bigInt = newBigInt(from->count);
+    bigInt->negative = from->negative;
+    memcpy(bigInt->limbs, from->limbs, sizeof(uint32_t) * from->count);
+    return OBJ_VAL(bigInt);
+  }
+  if (IS_STRING(value)) {
+    ObjString* string = AS_STRING(value);
+    if (string->kind == STRING_SOURCE) return OBJ_VAL(sourceString(string->chars, string->length));
+    return OBJ_VAL(copyString(string->chars, string->length));
+  }
+
+  ObjFunction* from = AS_FUNCTION(value);
+  ObjFunction* function = newFunction();
+  push(OBJ_VAL(function));
+  function->upvalueCount = from->upvalueCount;
+  if (from->name != NULL) function->name = AS_STRING(adoptValue(OBJ_VAL(from->name)));
+  if (from->deferred != NULL) {
+    function->deferred = newDeferred(from->deferred->body, from->deferred->length, from->deferred->line, from->upvalueCount);
+    memcpy(function->deferred->captures, from->deferred->captures, sizeof(Capture) * from->upvalueCount);
+  } else {
+    adoptChunk(function, from);
+  }
+  pop();
+  return OBJ_VAL(function);
+}
+
+static void adoptChunk(ObjFunction* function, ObjFunction* from) {  // function must be reachable, the copies allocate
+  int count = from->chunk.count;
+  uint8_t* code = ALLOCATE(uint8_t, count);
+  memcpy(code, from->chunk.code, count);
+  int lineCount = from->chunk.lineCount;
+  LineStart* lines = ALLOCATE(LineStart, lineCount);
+  memcpy(lines, from->chunk.lines, sizeof(LineStart) * lineCount);
+
+  function->arity = from->arity;
+  function->maxStack = from->maxStack;
+  function->chunk.code = code;
+  function->chunk.count = count;
+  function->chunk.capacity = count;
+  function->chunk.lines = lines;
+  function->chunk.lineCount = lineCount;
+  function->chunk.lineCapacity = lineCount;
+  for (int i = 0; i < from->chunk.constants.count; i++) {
+    addConstant(&function->chunk, adoptValue(from->chunk.constants.values[i]));
+  }
+}
+
+static int deferredBodies(ObjFunction* script, ObjFunction** bodies) {  // the top-level functions, bodies may be NULL to count them
+  int count = 0;
+  for (int i = 0; i < script->chunk.constants.count; i++) {
+    Value constant = script->chunk.constants.values[i];
+    if (!IS_FUNCTION(constant) || AS_FUNCTION(constant)->deferred == NULL) continue;
+    if (bodies != NULL) bodies[count] = AS_FUNCTION(constant);
+    count++;
+  }
+  return count;
+}
+
+void compileParallel(ObjFunction* script, int jobs) {  // best effort, a body left deferred is compiled on its first call
+  Work work = {.count = deferredBodies(script, NULL), .running = 0, .adopted = false};
+  if (work.count == 0) return;
+  work.bodies = (ObjFunction**)malloc(sizeof(ObjFunction*) * work.count);
+  work.compiled = (ObjFunction**)calloc(work.count, sizeof(ObjFunction*));
+  pthread_t* threads = (pthread_t*)malloc(sizeof(pthread_t) * (jobs < work.count ? jobs : work.count));
+  if (work.bodies == NULL || work.compiled == NULL || threads == NULL) {
+    free(work.bodies);
+    free(work.compiled);
+    free(threads);
+    return;
+  }
+  deferredBodies(script, work.bodies);
+  atomic_init(&work.next, 0);
+  pthread_mutex_init(&work.lock, NULL);
+  pthread_cond_init(&work.changed, NULL);
+
+  pthread_attr_t attributes;
+  pthread_attr_init(&attributes);
+  pthread_attr_setstacksize(&attributes, VM_THREAD_STACK);
+  pthread_mutex_lock(&work.lock);  // held while starting, so no worker reports before running is counted
+  int started = 0;
+  while (started < jobs && started < work.count && pthread_create(&threads[started], &attributes, worker, &work) == 0) started++;
+  pthread_attr_destroy(&attributes);
+  work.running = started;
+  while (work.running > 0) pthread_cond_wait(&work.changed, &work.lock);
+
+  push(OBJ_VAL(script));  // copying allocates
+  for (int i = 0; i < work.count; i++) {
+    if (work.compiled[i] == NULL) continue;
+    adoptChunk(work.bodies[i], work.compiled[i]);
+    freeDeferred(work.bodies[i]);
+  }
+  pop();
+
+  work.adopted = true;
+  pthread_cond_broadcast(&work.changed);
+  pthread_mutex_unlock(&work.lock);
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  free(threads);
+  free(work.bodies);
+  free(work.compiled);
+  pthread_mutex_destroy(&work.lock);
+  pthread_cond_destroy(&work.changed);
+}
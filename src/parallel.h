@@ -0,0 +1,11 @@
+#ifndef crinha_parallel_h
+#define crinha_parallel_h
+
+#include "common.h"
+#include "object.h"
+
+extern int compileJobs;  // threads compiling the top-level functions up front, 0 leaves them to their first call
+
+void compileParallel(ObjFunction* script, int jobs);
+
+#endif
@@ -1,22 +1,25 @@
 #include "scanner.h"
 
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
 #include "common.h"
 
-typedef struct {
-  const char* start;
-  const char* current;
-  int line;
-} Scanner;
-
-Scanner scanner;
+_Thread_local Scanner scanner;
 
-void initScanner(const char* source) {
+void initScanner(const char* source, int line) {  // line of the first character, deferred function bodies start mid source
   scanner.start = source;
   scanner.current = source;
-  scanner.line = 1;
+  scanner.line = line;
+}
+
+Scanner saveScanner() {  // for looking ahead, restoreScanner goes back to the same point
+  return scanner;
+}
+
+void restoreScanner(Scanner saved) {
+  scanner = saved;
 }
 
 static bool isAlpha(char c) {
@@ -74,25 +77,98 @@ static Token errorToken(const char* message) {
   return token;
 }
 
+// PERF: the runs of blanks, comments, identifiers, numbers and strings are found a block at a time, each byte class
+// is a bit mask over the block and the run ends at the lowest byte outside it. loads are aligned so a block never
+// crosses a page, the bytes before the token and after the null terminator are read but masked off or never reached
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+typedef __m128i Block;
+#define BLOCK_SIZE 16
+#define BLOCK_BITS 0xffffu
+
+static inline Block load(const char* block) { return _mm_load_si128((const __m128i*)block); }
+static inline unsigned eq(Block v, char c) { return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c))); }
+static inline Block lower(Block v) { return _mm_or_si128(v, _mm_set1_epi8(0x20)); }
+
+static inline unsigned range(Block v, char low, char high) {  // low <= c <= high, shifted so a signed compare does it
+  Block shifted = _mm_add_epi8(v, _mm_set1_epi8((char)(-128 - low)));
+  return (unsigned)_mm_movemask_epi8(_mm_cmplt_epi8(shifted, _mm_set1_epi8((char)(-128 + high - low + 1))));
+}
+#else
+typedef unsigned char Block;  // a block of one byte, the same code scans byte by byte
+#define BLOCK_SIZE 1
+#define BLOCK_BITS 1u
+
+static inline Block load(const char* block) { return (Block)*block; }
+static inline unsigned eq(Block v, char c) { return v == (Block)c; }
+static inline Block lower(Block v) { return v | 0x20; }
+static inline unsigned range(Block v, char low, char high) { return v >= (Block)low && v <= (Block)high; }
+#endif
+
+static inline unsigned identifierBytes(Block v) { return range(lower(v), 'a', 'z') | range(v, '0', '9') | eq(v, '_'); }
+static inline unsigned digitBytes(Block v) { return range(v, '0', '9'); }
+static inline unsigned commentBytes(Block v) { return ~(eq(v, '\n') | eq(v, '\0')); }
+static inline unsigned stringBytes(Block v) { return ~(eq(v, '"') | eq(v, '\n') | eq(v, '\0')); }
+
+static inline const char* blockOf(const char* at) {
+  return (const char*)((uintptr_t)at & ~(uintptr_t)(BLOCK_SIZE - 1));
+}
+
+static inline const char* skipWhile(const char* at, unsigned (*bytes)(Block)) {  // the first byte outside the class, '\0' never is in one
+  const char* block = blockOf(at);
+  unsigned stop = ~bytes(load(block)) & (BLOCK_BITS << (at - block)) & BLOCK_BITS;
+  while (stop == 0) {
+    block += BLOCK_SIZE;
+    stop = ~bytes(load(block)) & BLOCK_BITS;
+  }
+  return block + __builtin_ctz(stop);
+}
+
+static int countBits(unsigned bits) {  // newlines are few, cheaper than the popcount call sse2 targets get
+  int count = 0;
+  for (; bits != 0; bits &= bits - 1) count++;
+  return count;
+}
+
+// kept out of scanToken, inlined its vector constants would be set up on every token even when there's no run
+__attribute__((noinline)) static void skipBlanks() {  // spaces and newlines, the lines are counted from the newline mask
+  const char* block = blockOf(scanner.current);
+  unsigned from = (BLOCK_BITS << (scanner.current - block)) & BLOCK_BITS;
+  for (;;) {
+    Block v = load(block);
+    unsigned newlines = eq(v, '\n');
+    unsigned stop = ~(newlines | eq(v, ' ') | eq(v, '\t') | eq(v, '\r')) & from;
+    if (stop != 0) {
+      scanner.line += countBits(newlines & from & ((stop & -stop) - 1));
+      scanner.current = block + __builtin_ctz(stop);
+      return;
+    }
+    scanner.line += countBits(newlines & from);
+    block += BLOCK_SIZE;
+    from = BLOCK_BITS;
+  }
+}
+
+static bool isBlank(char c) {
+  return c == ' ' || c == '\n' || c == '\t' || c == '\r';
+}
+
 static void skipWhitespace() {
   for (;;) {
-    char c = peek();
-    switch (c) {
+    switch (peek()) {
+      case '\n':
+        scanner.line++;
+        // fallthrough
       case ' ':
       case '\r':
       case '\t':
         advance();
-        break;
-      case '\n':
-        scanner.line++;
-        advance();
+        if (isBlank(peek())) skipBlanks();  // most tokens are apart by a single space, only a run is worth a block
         break;
       case '/':
-        if (peekNext() == '/') {
-          while (peek() != '\n' && !isAtEnd()) advance();
-        } else {
-          return;
-        }
+        if (peekNext() != '/') return;
+        scanner.current = skipWhile(scanner.current + 2, commentBytes);
         break;
       default:
         return;
@@ -100,62 +176,71 @@ static void skipWhitespace() {
   }
 }
 
-static TokenType checkKeyword(int start, int length, const char* rest, TokenType type) {
-  if (scanner.current - scanner.start == start + length && memcmp(scanner.start + start, rest, length) == 0) {
-    return type;
-  }
-
-  return TOKEN_IDENTIFIER;
-}
-
-static TokenType identifierType() {  // could be dfa, trie, lex
-  switch (scanner.start[0]) {
-    case 'l':
-      return checkKeyword(1, 2, "et", TOKEN_LET);
-    case 'f': {
-      if (scanner.current - scanner.start > 1) {
-        switch (scanner.start[1]) {
-          case 'a': return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-          case 'n': return TOKEN_FN;
-        }
-      }
-    }
-    case 'e': return checkKeyword(1, 3, "lse", TOKEN_ELSE);
-    case 'i': return checkKeyword(1, 1, "f", TOKEN_IF);
-    case 'p': return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-    case 't': return checkKeyword(1, 3, "rue", TOKEN_TRUE);
+typedef struct {
+  const char* chars;
+  int length;
+  TokenType type;
+} Keyword;
+
+// perfect hash of the keywords: first byte + last byte + length lands each one in its own slot. the sum was found by
+// searching small multipliers of the first and last bytes for the smallest table without collisions, adding a keyword
+// means running that search again
+#define KEYWORD_SLOTS 16
+#define KEYWORD_MAX 5
+
+static const Keyword keywords[KEYWORD_SLOTS] = {
+    [0] = {"false", 5, TOKEN_FALSE},
+    [1] = {"if", 2, TOKEN_IF},
+    [3] = {"let", 3, TOKEN_LET},
+    [6] = {"fn", 2, TOKEN_FN},
+    [9] = {"print", 5, TOKEN_PRINT},
+    [13] = {"true", 4, TOKEN_TRUE},
+    [14] = {"else", 4, TOKEN_ELSE},
+};
+
+static TokenType identifierType() {
+  int length = (int)(scanner.current - scanner.start);
+  if (length > KEYWORD_MAX) return TOKEN_IDENTIFIER;
+
+  const unsigned char* chars = (const unsigned char*)scanner.start;
+  const Keyword* keyword = &keywords[(chars[0] + chars[length - 1] + length) & (KEYWORD_SLOTS - 1)];
+  if (keyword->length != length) return TOKEN_IDENTIFIER;
+  for (int i = 0; i < length; i++) {  // a loop of at most KEYWORD_MAX, memcmp of a variable length is a call
+    if (chars[i] != (unsigned char)keyword->chars[i]) return TOKEN_IDENTIFIER;
   }
-
-  return TOKEN_IDENTIFIER;
+  return keyword->type;
 }
 
 static Token identifier() {
-  while (isAlpha(peek()) || isDigit(peek())) advance();
+  if (isAlpha(peek()) || isDigit(peek())) scanner.current = skipWhile(scanner.current + 1, identifierBytes);
   return makeToken(identifierType());
 }
 
 static Token number() {
-  while (isDigit(peek())) advance();
+  if (isDigit(peek())) scanner.current = skipWhile(scanner.current + 1, digitBytes);
 
   if (peek() == '.' && isDigit(peekNext())) {
-    advance();
-
-    while (isDigit(peek())) advance();
+    scanner.current = skipWhile(scanner.current + 1, digitBytes);
   }
 
   return makeToken(TOKEN_NUMBER);
 }
 
-static Token string() {  // could convert to value in compile time, but it isn't performance critical
-  while (peek() != '"' && !isAtEnd()) {
-    if (peek() == '\n') scanner.line++;
+static Token string() {  // no escapes, the first quote closes it
+  for (;;) {
+    scanner.current = skipWhile(scanner.current, stringBytes);
+    switch (peek()) {
+      case '"':
+        advance();
+        return makeToken(TOKEN_STRING);
+      case '\0':
+        return errorToken("Unterminated string.");
+      case '\n':
+        scanner.line++;
+        break;
+    }
     advance();
   }
-
-  if (isAtEnd()) return errorToken("Unterminated string.");
-
-  advance();
-  return makeToken(TOKEN_STRING);
 }
 
 Token scanToken() {
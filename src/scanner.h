@@ -33,7 +33,15 @@ typedef struct {
   int line;
 } Token;
 
-void initScanner(const char* source);
+typedef struct {
+  const char* start;
+  const char* current;
+  int line;
+} Scanner;
+
+void initScanner(const char* source, int line);
+Scanner saveScanner();
+void restoreScanner(Scanner saved);
 Token scanToken();
 
 #endif
\ No newline at end of file
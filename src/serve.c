@@ -0,0 +1,403 @@
+#define _GNU_SOURCE  // fopencookie
+
+#include "serve.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "snapshot.h"
+#include "source.h"
+#include "vm.h"
+
+// a daemon keeping one warm vm per worker thread, scripts come in over a unix socket
+// every message is a frame: a type byte, a 4 byte length in host order (both ends are on the same machine) and the payload
+// client: optional FRAME_HEAP (8 bytes) and FRAME_TIMEOUT (4 bytes, ms) limits, then FRAME_PATH or FRAME_SOURCE runs the script
+// server: FRAME_OUT and FRAME_ERR chunks while the script runs, then FRAME_EXIT with the 4 byte exit status
+
+#define FRAME_HEAP 'H'
+#define FRAME_TIMEOUT 'T'
+#define FRAME_PATH 'P'
+#define FRAME_SOURCE 'S'
+#define FRAME_OUT 'O'
+#define FRAME_ERR 'E'
+#define FRAME_EXIT 'X'
+
+#define FRAME_HEADER 5
+#define MAX_FRAME (64 * 1024 * 1024)  // bigger requests drop the connection
+#define PENDING 128                   // accepted connections waiting for a worker
+
+typedef struct {
+  VM* vm;
+  struct timespec deadline;
+  bool armed;  // running a request with a time limit
+} Worker;
+
+typedef struct {
+  Worker* workers;
+  int workerCount;
+  int pending[PENDING];
+  int head;
+  int count;
+  pthread_mutex_t lock;
+  pthread_cond_t accepted;  // a connection is waiting
+  pthread_cond_t taken;     // room in pending again
+  pthread_cond_t armed;     // a deadline was set, wakes the watchdog
+  bool useCache;
+  const char* snapshotIn;
+  uint32_t timeout;
+} Server;
+
+typedef struct {
+  int fd;
+  char type;     // FRAME_OUT or FRAME_ERR
+  bool* failed;  // shared by both streams of a request
+} Stream;
+
+static Server server;
+static const char* listening = NULL;  // unlinked on shutdown
+
+static bool sendAll(int fd, const void* data, size_t size) {
+  const char* bytes = (const char*)data;
+  while (size > 0) {
+    ssize_t sent = send(fd, bytes, size, MSG_NOSIGNAL);  // a client that went away is an error, not a SIGPIPE
+    if (sent < 0 && errno == EINTR) continue;
+    if (sent <= 0) return false;
+    bytes += sent;
+    size -= (size_t)sent;
+  }
+  return true;
+}
+
+static bool receiveAll(int fd, void* data, size_t size) {
+  char* bytes = (char*)data;
+  while (size > 0) {
+    ssize_t received = recv(fd, bytes, size, 0);
+    if (received < 0 && errno == EINTR) continue;
+    if (received <= 0) return false;
+    bytes += received;
+    size -= (size_t)received;
+  }
+  return true;
+}
+
+static bool sendFrame(int fd, char type, const void* payload, uint32_t length) {
+  char header[FRAME_HEADER];
+  header[0] = type;
+  memcpy(header + 1, &length, sizeof(length));
+  return sendAll(fd, header, FRAME_HEADER) && sendAll(fd, payload, length);
+}
+
+static char* receiveFrame(int fd, char* type, uint32_t* length) {  // the payload is null terminated and owned by the caller
+  char header[FRAME_HEADER];
+  if (!receiveAll(fd, header, FRAME_HEADER)) return NULL;
+  *type = header[0];
+  memcpy(length, header + 1, sizeof(*length));
+  if (*length > MAX_FRAME) return NULL;
+
+  char* payload = (char*)malloc(*length + 1);
+  if (payload == NULL || !receiveAll(fd, payload, *length)) {
+    free(payload);
+    return NULL;
+  }
+  payload[*length] = '\0';
+  return payload;
+}
+
+static uint64_t tighter(uint64_t limit, uint64_t requested) {  // 0 is no limit, a request can only lower the server's
+  if (limit == 0) return requested;
+  if (requested == 0) return limit;
+  return requested < limit ? requested : limit;
+}
+
+static ssize_t writeStream(void* cookie, const char* data, size_t size) {
+  Stream* stream = (Stream*)cookie;
+  if (!*stream->failed && !sendFrame(stream->fd, stream->type, data, (uint32_t)size)) {
+    *stream->failed = true;
+    atomic_store(&vm.interrupted, true);  // nobody reads the output anymore, stop the script
+  }
+  return (ssize_t)size;  // dropped output still counts as written, print has nowhere to report it
+}
+
+static void arm(Worker* worker, uint32_t timeout) {
+  if (timeout == 0) return;
+  pthread_mutex_lock(&server.lock);
+  clock_gettime(CLOCK_MONOTONIC, &worker->deadline);
+  worker->deadline.tv_sec += timeout / 1000;
+  worker->deadline.tv_nsec += (long)(timeout % 1000) * 1000000;
+  if (worker->deadline.tv_nsec >= 1000000000) {
+    worker->deadline.tv_sec++;
+    worker->deadline.tv_nsec -= 1000000000;
+  }
+  worker->armed = true;
+  pthread_cond_signal(&server.armed);
+  pthread_mutex_unlock(&server.lock);
+}
+
+static void disarm(Worker* worker) {
+  pthread_mutex_lock(&server.lock);
+  worker->armed = false;
+  pthread_mutex_unlock(&server.lock);
+}
+
+static bool before(struct timespec a, struct timespec b) {
+  return a.tv_sec < b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec < b.tv_nsec);
+}
+
+static void* watchdog(__attribute__((unused)) void* arg) {  // sleeps until the nearest deadline and interrupts the scripts past theirs
+  pthread_mutex_lock(&server.lock);
+  for (;;) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    bool waiting = false;
+    struct timespec next = now;
+    for (int i = 0; i < server.workerCount; i++) {
+      Worker* worker = &server.workers[i];
+      if (!worker->armed) continue;
+      if (!before(now, worker->deadline)) {
+        atomic_store(&worker->vm->interrupted, true);
+        worker->armed = false;
+      } else if (!waiting || before(worker->deadline, next)) {
+        next = worker->deadline;
+        waiting = true;
+      }
+    }
+
+    if (waiting) {
+      pthread_cond_timedwait(&server.armed, &server.lock, &next);
+    } else {
+      pthread_cond_wait(&server.armed, &server.lock);
+    }
+  }
+  return NULL;
+}
+
+static int runRequest(Worker* worker, int fd, char type, char* payload, uint32_t length, uint64_t maxHeap, uint32_t timeout) {
+  bool failed = false;
+  Stream out = {fd, FRAME_OUT, &failed};
+  Stream err = {fd, FRAME_ERR, &failed};
+  cookie_io_functions_t io = {.write = writeStream};
+  vm.out = fopencookie(&out, "w", io);  // fully buffered, output goes back in chunks and all at once for small scripts
+  vm.err = fopencookie(&err, "w", io);
+  if (vm.out == NULL || vm.err == NULL) {
+    fprintf(stderr, "Not enough memory to run a request.\n");
+    exit(74);
+  }
+  vm.maxHeap = (size_t)maxHeap;
+  if (vm.maxHeap != 0 && vm.nextGC > vm.maxHeap) vm.nextGC = vm.maxHeap;  // collect before giving up on a small limit
+
+  arm(worker, timeout);
+  Source source = {0};
+  int status = server.snapshotIn != NULL ? restoreSnapshot(server.snapshotIn) : 0;  // a panic here must not take the server down
+  if (status != 0) {
+    // reported by restoreSnapshot
+  } else if (type == FRAME_PATH && !openSource(payload, &source)) {
+    fprintf(vm.err, "Could not read file \"%s\".\n", payload);
+    status = 74;
+  } else {
+    InterpretResult result = type == FRAME_PATH ? interpretFile(payload, &source, server.useCache) : interpret(payload, length, NULL);
+    status = result == INTERPRET_COMPILE_ERROR ? 65 : result == INTERPRET_RUNTIME_ERROR ? 70 : 0;
+  }
+  disarm(worker);
+
+  fclose(vm.out);
+  fclose(vm.err);
+  vm.out = stdout;
+  vm.err = stderr;
+  resetVM();  // string constants point into the source, it goes away only after the reset
+  if (source.chars != NULL) closeSource(&source);
+  return failed ? -1 : status;
+}
+
+static void serveConnection(Worker* worker, int fd) {  // requests on one connection run one after the other
+  uint64_t maxHeap = gcConfig.maxHeap;
+  uint32_t timeout = server.timeout;
+
+  for (;;) {
+    char type;
+    uint32_t length;
+    char* payload = receiveFrame(fd, &type, &length);
+    if (payload == NULL) return;
+
+    if (type == FRAME_HEAP && length == sizeof(uint64_t)) {
+      uint64_t requested;
+      memcpy(&requested, payload, sizeof(requested));
+      maxHeap = tighter(gcConfig.maxHeap, requested);
+    } else if (type == FRAME_TIMEOUT && length == sizeof(uint32_t)) {
+      uint32_t requested;
+      memcpy(&requested, payload, sizeof(requested));
+      timeout = (uint32_t)tighter(server.timeout, requested);
+    } else if (type == FRAME_PATH || type == FRAME_SOURCE) {
+      int status = runRequest(worker, fd, type, payload, length, maxHeap, timeout);
+      if (status < 0 || !sendFrame(fd, FRAME_EXIT, &status, sizeof(status))) {
+        free(payload);
+        return;
+      }
+      maxHeap = gcConfig.maxHeap;  // limits only hold for the request they came with
+      timeout = server.timeout;
+    } else {
+      free(payload);
+      return;
+    }
+    free(payload);
+  }
+}
+
+static void* work(void* arg) {
+  Worker* worker = (Worker*)arg;
+  initVM();  // kept warm across requests, resetVM only drops what a script left behind
+  pthread_mutex_lock(&server.lock);
+  worker->vm = &vm;
+  pthread_mutex_unlock(&server.lock);
+
+  for (;;) {
+    pthread_mutex_lock(&server.lock);
+    while (server.count == 0) pthread_cond_wait(&server.accepted, &server.lock);
+    int fd = server.pending[server.head];
+    server.head = (server.head + 1) % PENDING;
+    server.count--;
+    pthread_cond_signal(&server.taken);
+    pthread_mutex_unlock(&server.lock);
+
+    serveConnection(worker, fd);
+    close(fd);
+  }
+  return NULL;
+}
+
+static void stopServer(__attribute__((unused)) int signal) {
+  if (listening != NULL) unlink(listening);
+  _exit(0);
+}
+
+static int listenOn(const char* path) {
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(address.sun_path)) return -1;
+  strcpy(address.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+  unlink(path);  // left behind by a server that was killed
+  if (bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(fd, PENDING) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int runServer(const char* socketPath, int workers, bool useCache, const char* snapshotIn, uint32_t timeout) {
+  int listener = listenOn(socketPath);
+  if (listener < 0) {
+    fprintf(stderr, "Could not listen on \"%s\".\n", socketPath);
+    return 74;
+  }
+  listening = socketPath;
+  signal(SIGINT, stopServer);
+  signal(SIGTERM, stopServer);
+
+  server.workers = (Worker*)calloc(workers, sizeof(Worker));
+  server.workerCount = workers;
+  server.useCache = useCache;
+  server.snapshotIn = snapshotIn;
+  server.timeout = timeout;
+  pthread_mutex_init(&server.lock, NULL);
+  pthread_cond_init(&server.accepted, NULL);
+  pthread_cond_init(&server.taken, NULL);
+  pthread_condattr_t monotonic;  // deadlines don't move with the wall clock
+  pthread_condattr_init(&monotonic);
+  pthread_condattr_setclock(&monotonic, CLOCK_MONOTONIC);
+  pthread_cond_init(&server.armed, &monotonic);
+  pthread_condattr_destroy(&monotonic);
+
+  pthread_attr_t attributes;
+  pthread_attr_init(&attributes);
+  pthread_attr_setstacksize(&attributes, VM_THREAD_STACK);
+  pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+  pthread_t thread;
+  bool started = server.workers != NULL && pthread_create(&thread, &attributes, watchdog, NULL) == 0;
+  for (int i = 0; started && i < workers; i++) {
+    started = pthread_create(&thread, &attributes, work, &server.workers[i]) == 0;
+  }
+  pthread_attr_destroy(&attributes);
+  if (!started) {
+    fprintf(stderr, "Could not start the server workers.\n");
+    unlink(socketPath);
+    return 71;
+  }
+
+  for (;;) {
+    int fd = accept(listener, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      fprintf(stderr, "Could not accept connections on \"%s\".\n", socketPath);
+      unlink(socketPath);
+      return 74;
+    }
+
+    pthread_mutex_lock(&server.lock);
+    while (server.count == PENDING) pthread_cond_wait(&server.taken, &server.lock);
+    server.pending[(server.head + server.count) % PENDING] = fd;
+    server.count++;
+    pthread_cond_signal(&server.accepted);
+    pthread_mutex_unlock(&server.lock);
+  }
+}
+
+int runClient(const char* socketPath, const char* path, uint64_t maxHeap, uint32_t timeout) {
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  int fd = strlen(socketPath) < sizeof(address.sun_path) ? socket(AF_UNIX, SOCK_STREAM, 0) : -1;
+  if (fd >= 0) strcpy(address.sun_path, socketPath);
+  if (fd < 0 || connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+    fprintf(stderr, "Could not connect to \"%s\".\n", socketPath);
+    return 74;
+  }
+
+  bool sent = (maxHeap == 0 || sendFrame(fd, FRAME_HEAP, &maxHeap, sizeof(maxHeap))) &&
+              (timeout == 0 || sendFrame(fd, FRAME_TIMEOUT, &timeout, sizeof(timeout)));
+  if (path != NULL && strcmp(path, "-") != 0) {
+    char* absolute = realpath(path, NULL);  // the server has its own working directory
+    if (absolute == NULL) {
+      fprintf(stderr, "Could not open file \"%s\".\n", path);
+      return 74;
+    }
+    sent = sent && sendFrame(fd, FRAME_PATH, absolute, (uint32_t)strlen(absolute));
+    free(absolute);
+  } else {
+    size_t length;
+    char* source = readStream(stdin, &length);
+    if (source == NULL || length > MAX_FRAME) {
+      fprintf(stderr, "Could not read the script from stdin.\n");
+      return 74;
+    }
+    sent = sent && sendFrame(fd, FRAME_SOURCE, source, (uint32_t)length);
+    free(source);
+  }
+
+  int status = -1;
+  while (sent && status < 0) {
+    char type;
+    uint32_t length;
+    char* payload = receiveFrame(fd, &type, &length);
+    if (payload == NULL) break;
+    if (type == FRAME_OUT) fwrite(payload, 1, length, stdout);
+    if (type == FRAME_ERR) fwrite(payload, 1, length, stderr);
+    if (type == FRAME_EXIT && length == sizeof(status)) memcpy(&status, payload, sizeof(status));
+    free(payload);
+  }
+  close(fd);
+
+  if (status < 0) {
+    fprintf(stderr, "Lost the connection to \"%s\".\n", socketPath);
+    return 74;
+  }
+  return status;
+}
@@ -0,0 +1,9 @@
+#ifndef crinha_serve_h
+#define crinha_serve_h
+
+#include "common.h"
+
+int runServer(const char* socketPath, int workers, bool useCache, const char* snapshotIn, uint32_t timeout);
+int runClient(const char* socketPath, const char* path, uint64_t maxHeap, uint32_t timeout);
+
+#endif
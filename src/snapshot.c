@@ -0,0 +1,547 @@
+#include "snapshot.h"
+
+#include <fcntl.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bigint.h"
+#include "cache.h"
+#include "compiler.h"
+#include "memory.h"
+#include "vm.h"
+
+// the objects reachable from the globals, saved after running a prelude and mapped back before running a script:
+// header | object records | values | lines | code | strings
+// objects refer to each other by index, the loader creates them all and then links them
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t bytecodeVersion;  // functions carry code, so the opcodes must match too
+  uint32_t objectCount;
+  uint64_t size;
+  uint32_t objects;  // offsets of the sections from the start of the image
+  uint32_t values;
+  uint32_t lines;
+  uint32_t code;
+  uint32_t strings;
+  uint32_t globals;  // index of the first global in the values, key and value pairs
+  uint32_t globalCount;
+} SnapshotHeader;
+
+typedef struct {
+  uint32_t type;
+  union {
+    struct {
+      uint32_t chars;
+      uint32_t length;
+      uint32_t interned;
+    } string;
+    struct {
+      int32_t arity;
+      int32_t upvalueCount;
+      int32_t maxStack;
+      uint32_t name;  // object index + 1, 0 for the script
+      uint32_t code;
+      uint32_t codeCount;
+      uint32_t lines;
+      uint32_t lineCount;
+      uint32_t constants;  // index of the first value
+      uint32_t constantCount;
+    } function;
+    struct {
+      uint32_t function;
+      uint32_t upvalues;  // index of the first value, one object value per upvalue
+      uint32_t upvalueCount;
+    } closure;
+    struct {
+      uint32_t values;  // first and second
+    } tuple;
+    struct {
+      uint32_t value;
+    } upvalue;
+    struct {
+      uint32_t index;
+    } native;
+    struct {
+      uint32_t digits;  // in decimal among the strings
+      uint32_t length;
+    } bigint;
+  } as;
+} SnapshotObject;
+
+typedef struct {
+  uint32_t type;  // ValueType
+  int64_t as;     // the number or bool, or the object index
+} SnapshotValue;
+
+#define SNAPSHOT_MAGIC "CRSN"
+
+static _Thread_local const char* image = NULL;
+static _Thread_local size_t imageSize = 0;
+static _Thread_local Obj** loading = NULL;  // objects created so far while loading, rooted until they are linked
+static _Thread_local uint32_t loaded = 0;
+
+typedef struct {  // objects in the order they were reached, with a pointer to index map
+  Obj** objects;
+  uint32_t count;
+  uint32_t capacity;
+  Obj** keys;
+  uint32_t* indices;
+  uint32_t slots;
+  bool failed;
+} Walk;
+
+static uint32_t hashPointer(Obj* object) {
+  uint64_t x = (uint64_t)(uintptr_t)object;
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdull;
+  x ^= x >> 33;
+  return (uint32_t)x;
+}
+
+static uint32_t findSlot(Walk* walk, Obj* object) {  // linear probing, the key is NULL if object was not reached yet
+  uint32_t mask = walk->slots - 1;
+  uint32_t slot = hashPointer(object) & mask;
+  while (walk->keys[slot] != object && walk->keys[slot] != NULL) slot = (slot + 1) & mask;
+  return slot;
+}
+
+static uint32_t indexOf(Walk* walk, Obj* object) {  // only for objects already reached
+  return walk->indices[findSlot(walk, object)];
+}
+
+static bool growWalk(Walk* walk) {
+  uint32_t capacity = walk->capacity < 64 ? 64 : walk->capacity * 2;
+  Obj** objects = (Obj**)realloc(walk->objects, sizeof(Obj*) * capacity);
+  if (objects == NULL) return false;
+  walk->objects = objects;
+  walk->capacity = capacity;
+
+  Obj** keys = (Obj**)calloc(capacity * 2, sizeof(Obj*));  // at most half full
+  uint32_t* indices = (uint32_t*)malloc(sizeof(uint32_t) * capacity * 2);
+  if (keys == NULL || indices == NULL) {
+    free(keys);
+    free(indices);
+    return false;
+  }
+  free(walk->keys);
+  free(walk->indices);
+  walk->keys = keys;
+  walk->indices = indices;
+  walk->slots = capacity * 2;
+  for (uint32_t i = 0; i < walk->count; i++) {
+    uint32_t slot = findSlot(walk, walk->objects[i]);
+    walk->keys[slot] = walk->objects[i];
+    walk->indices[slot] = i;
+  }
+  return true;
+}
+
+static void reach(Walk* walk, Obj* object) {
+  if (object == NULL || walk->failed) return;
+  if (walk->count == walk->capacity && !growWalk(walk)) {
+    walk->failed = true;
+    return;
+  }
+
+  uint32_t slot = findSlot(walk, object);
+  if (walk->keys[slot] == object) return;
+  walk->keys[slot] = object;
+  walk->indices[slot] = walk->count;
+  walk->objects[walk->count++] = object;
+}
+
+static void reachValue(Walk* walk, Value value) {
+  if (IS_OBJ(value)) reach(walk, AS_OBJ(value));
+}
+
+static void walkObjects(Walk* walk) {  // breadth first, the list of reached objects is the queue
+  for (int i = 0; i < vm.globals.count; i++) {
+    reach(walk, (Obj*)vm.globals.entries[i].key);
+    reachValue(walk, vm.globals.entries[i].value);
+  }
+
+  for (uint32_t i = 0; i < walk->count && !walk->failed; i++) {
+    Obj* object = walk->objects[i];
+    switch (object->type) {
+      case OBJ_STRING:
+        stringChars((ObjString*)object);  // saved flat, the pieces of a rope are not needed
+        break;
+      case OBJ_FUNCTION: {
+        ObjFunction* function = (ObjFunction*)object;
+        if (function->cached != NULL) loadCachedFunction(function);
+        if (function->deferred != NULL && !compileDeferred(function)) runtimePanic("Could not compile a function body for the snapshot.");
+        reach(walk, (Obj*)function->name);
+        for (int j = 0; j < function->chunk.constants.count; j++) {
+          reachValue(walk, function->chunk.constants.values[j]);
+        }
+        break;
+      }
+      case OBJ_CLOSURE: {
+        ObjClosure* closure = (ObjClosure*)object;
+        reach(walk, (Obj*)closure->function);
+        for (int j = 0; j < closure->upvalueCount; j++) {
+          reach(walk, (Obj*)closure->upvalues[j]);
+        }
+        break;
+      }
+      case OBJ_UPVALUE:
+        reachValue(walk, *((ObjUpvalue*)object)->location);
+        break;
+      case OBJ_TUPLE:
+        reachValue(walk, ((ObjTuple*)object)->first);
+        reachValue(walk, ((ObjTuple*)object)->second);
+        break;
+      default:
+        break;
+    }
+  }
+}
+
+static SnapshotValue snapshotValue(Walk* walk, Value value) {
+  SnapshotValue saved = {value.type, 0};
+  if (IS_BOOL(value)) saved.as = AS_BOOL(value);
+  if (IS_NUMBER(value)) saved.as = AS_NUMBER(value);
+  if (IS_OBJ(value)) saved.as = indexOf(walk, AS_OBJ(value));
+  return saved;
+}
+
+static uint32_t appendValue(ImageBuffer* values, Walk* walk, Value value) {  // returns the index of the value
+  SnapshotValue saved = snapshotValue(walk, value);
+  return appendImage(values, &saved, sizeof(saved)) / sizeof(SnapshotValue);
+}
+
+static void writeObject(Walk* walk, Obj* object, ImageBuffer* objects, ImageBuffer* values, ImageBuffer* lines, ImageBuffer* code, ImageBuffer* strings) {
+  SnapshotObject record;
+  memset(&record, 0, sizeof(record));
+  record.type = object->type;
+
+  switch (object->type) {
+    case OBJ_STRING: {
+      ObjString* string = (ObjString*)object;
+      record.as.string.chars = appendImage(strings, string->chars, string->length);
+      record.as.string.length = (uint32_t)string->length;
+      record.as.string.interned = string->isInterned;
+      break;
+    }
+    case OBJ_FUNCTION: {
+      ObjFunction* function = (ObjFunction*)object;
+      record.as.function.arity = function->arity;
+      record.as.function.upvalueCount = function->upvalueCount;
+      record.as.function.maxStack = function->maxStack;
+      record.as.function.name = function->name == NULL ? 0 : indexOf(walk, (Obj*)function->name) + 1;
+      record.as.function.code = appendImage(code, function->chunk.code, function->chunk.count);
+      record.as.function.codeCount = (uint32_t)function->chunk.count;
+      record.as.function.lines = appendImage(lines, function->chunk.lines, sizeof(LineStart) * function->chunk.lineCount);
+      record.as.function.lineCount = (uint32_t)function->chunk.lineCount;
+      record.as.function.constants = (uint32_t)(values->count / sizeof(SnapshotValue));
+      record.as.function.constantCount = (uint32_t)function->chunk.constants.count;
+      for (int i = 0; i < function->chunk.constants.count; i++) {
+        appendValue(values, walk, function->chunk.constants.values[i]);
+      }
+      break;
+    }
+    case OBJ_CLOSURE: {
+      ObjClosure* closure = (ObjClosure*)object;
+      record.as.closure.function = indexOf(walk, (Obj*)closure->function);
+      record.as.closure.upvalues = (uint32_t)(values->count / sizeof(SnapshotValue));
+      record.as.closure.upvalueCount = (uint32_t)closure->upvalueCount;
+      for (int i = 0; i < closure->upvalueCount; i++) {
+        appendValue(values, walk, closure->upvalues[i] == NULL ? NIL_VAL : OBJ_VAL(closure->upvalues[i]));
+      }
+      break;
+    }
+    case OBJ_UPVALUE:  // every frame returned, so the upvalue is closed
+      record.as.upvalue.value = appendValue(values, walk, *((ObjUpvalue*)object)->location);
+      break;
+    case OBJ_TUPLE:
+      record.as.tuple.values = appendValue(values, walk, ((ObjTuple*)object)->first);
+      appendValue(values, walk, ((ObjTuple*)object)->second);
+      break;
+    case OBJ_NATIVE:
+      record.as.native.index = (uint32_t)nativeIndex(((ObjNative*)object)->function);
+      break;
+    case OBJ_BIGINT: {
+      int length;
+      char* digits = formatBigInt((ObjBigInt*)object, &length);
+      record.as.bigint.digits = appendImage(strings, digits, length);
+      record.as.bigint.length = (uint32_t)length;
+      free(digits);
+      break;
+    }
+    default:
+      break;
+  }
+
+  appendImage(objects, &record, sizeof(record));
+}
+
+bool writeSnapshot(const char* path) {  // everything reachable from the globals, call it with no frames left
+  Walk walk;
+  memset(&walk, 0, sizeof(walk));
+  ImageBuffer objects = {0}, values = {0}, lines = {0}, code = {0}, strings = {0};
+
+  walkObjects(&walk);
+  for (uint32_t i = 0; i < walk.count && !walk.failed; i++) {
+    writeObject(&walk, walk.objects[i], &objects, &values, &lines, &code, &strings);
+  }
+
+  SnapshotHeader header;
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.version = SNAPSHOT_VERSION;
+  header.bytecodeVersion = CACHE_VERSION;
+  header.objectCount = walk.count;
+  header.globals = (uint32_t)(values.count / sizeof(SnapshotValue));
+  header.globalCount = 0;
+  for (int i = 0; i < vm.globals.count && !walk.failed; i++) {
+    appendValue(&values, &walk, OBJ_VAL(vm.globals.entries[i].key));
+    appendValue(&values, &walk, vm.globals.entries[i].value);
+    header.globalCount++;
+  }
+  header.objects = sizeof(SnapshotHeader);
+  header.values = header.objects + (uint32_t)objects.count;
+  header.lines = header.values + (uint32_t)values.count;
+  header.code = header.lines + (uint32_t)lines.count;
+  header.strings = header.code + (uint32_t)code.count;
+  header.size = header.strings + strings.count;
+
+  bool written = !walk.failed && !objects.failed && !values.failed && !lines.failed && !code.failed && !strings.failed && header.size <= UINT32_MAX;
+  FILE* file = written ? fopen(path, "wb") : NULL;
+  if (file != NULL) {
+    written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(objects.data, 1, objects.count, file) == objects.count &&
+              fwrite(values.data, 1, values.count, file) == values.count &&
+              fwrite(lines.data, 1, lines.count, file) == lines.count &&
+              fwrite(code.data, 1, code.count, file) == code.count &&
+              fwrite(strings.data, 1, strings.count, file) == strings.count;
+    written = fclose(file) == 0 && written;
+  } else {
+    written = false;
+  }
+
+  free(walk.objects);
+  free(walk.keys);
+  free(walk.indices);
+  free(objects.data);
+  free(values.data);
+  free(lines.data);
+  free(code.data);
+  free(strings.data);
+  return written;
+}
+
+static bool validHeader(const SnapshotHeader* header, size_t size) {
+  return memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) == 0 &&
+         header->version == SNAPSHOT_VERSION &&
+         header->bytecodeVersion == CACHE_VERSION &&
+         header->size == size &&
+         header->objects == sizeof(SnapshotHeader) &&
+         header->objects + (uint64_t)header->objectCount * sizeof(SnapshotObject) <= header->values &&
+         header->values <= header->lines && header->lines <= header->code &&
+         header->code <= header->strings && header->strings <= size &&
+         header->globals + (uint64_t)header->globalCount * 2 <= (header->lines - header->values) / sizeof(SnapshotValue);
+}
+
+static void corrupted() {
+  runtimePanic("Corrupted snapshot.");
+}
+
+static bool inSection(uint64_t offset, uint64_t size, uint32_t start, uint32_t end) {
+  return offset + size <= (uint64_t)(end - start);
+}
+
+static Value loadValue(const SnapshotHeader* header, uint32_t index) {
+  if (index >= (header->lines - header->values) / sizeof(SnapshotValue)) corrupted();
+  const SnapshotValue* saved = (const SnapshotValue*)(image + header->values) + index;
+
+  switch (saved->type) {
+    case VAL_BOOL: return BOOL_VAL(saved->as != 0);
+    case VAL_NUMBER: return NUMBER_VAL(saved->as);
+    case VAL_OBJ:
+      if (saved->as < 0 || (uint64_t)saved->as >= header->objectCount) corrupted();
+      return OBJ_VAL(loading[saved->as]);
+    default: return NIL_VAL;
+  }
+}
+
+static Obj* loadObject(const SnapshotHeader* header, uint32_t index, ObjType type) {
+  if (index >= header->objectCount || loading[index]->type != type) corrupted();
+  return loading[index];
+}
+
+static Obj* createObject(const SnapshotHeader* header, const SnapshotObject* record) {  // fields that point to other objects are filled by linkObject
+  switch (record->type) {
+    case OBJ_STRING: {
+      if (!inSection(record->as.string.chars, record->as.string.length, header->strings, (uint32_t)header->size)) corrupted();
+      const char* chars = image + header->strings + record->as.string.chars;
+      int length = (int)record->as.string.length;
+      return (Obj*)(record->as.string.interned ? sourceString(chars, length) : borrowString(chars, length));
+    }
+    case OBJ_FUNCTION: {
+      if (!inSection(record->as.function.code, record->as.function.codeCount, header->code, header->strings) ||
+          !inSection(record->as.function.lines, (uint64_t)record->as.function.lineCount * sizeof(LineStart), header->lines, header->code)) {
+        corrupted();
+      }
+      ObjFunction* function = newFunction();
+      function->arity = record->as.function.arity;
+      function->upvalueCount = record->as.function.upvalueCount;
+      function->maxStack = record->as.function.maxStack;
+      function->chunk.code = (uint8_t*)(image + header->code + record->as.function.code);
+      function->chunk.lines = (LineStart*)(image + header->lines + record->as.function.lines);
+      function->chunk.lineCount = (int)record->as.function.lineCount;
+      function->chunk.lineCapacity = (int)record->as.function.lineCount;
+      function->chunk.count = (int)record->as.function.codeCount;
+      function->chunk.capacity = (int)record->as.function.codeCount;
+      function->chunk.mapped = true;
+      return (Obj*)function;
+    }
+    case OBJ_TUPLE: {
+      Value nil = NIL_VAL;
+      return (Obj*)newTuple(&nil, &nil);
+    }
+    case OBJ_UPVALUE: {
+      ObjUpvalue* upvalue = newUpvalue(NULL);
+      upvalue->location = &upvalue->closed;
+      return (Obj*)upvalue;
+    }
+    case OBJ_NATIVE: {
+      NativeFn native = nativeFunction((int)record->as.native.index);
+      if (native == NULL) corrupted();
+      return (Obj*)newNative(native);
+    }
+    case OBJ_BIGINT: {
+      if (!inSection(record->as.bigint.digits, record->as.bigint.length, header->strings, (uint32_t)header->size)) corrupted();
+      Value value = parseInteger(image + header->strings + record->as.bigint.digits, (int)record->as.bigint.length);
+      if (!IS_BIGINT(value)) corrupted();  // saved normalized, anything that fits is a number
+      return AS_OBJ(value);
+    }
+    default:
+      corrupted();
+      return NULL;
+  }
+}
+
+static void linkObject(const SnapshotHeader* header, const SnapshotObject* record, Obj* object) {
+  switch (record->type) {
+    case OBJ_FUNCTION: {
+      ObjFunction* function = (ObjFunction*)object;
+      if (record->as.function.name != 0) function->name = (ObjString*)loadObject(header, record->as.function.name - 1, OBJ_STRING);
+      for (uint32_t i = 0; i < record->as.function.constantCount; i++) {
+        addConstant(&function->chunk, loadValue(header, record->as.function.constants + i));
+      }
+      break;
+    }
+    case OBJ_CLOSURE: {
+      ObjClosure* closure = (ObjClosure*)object;
+      if ((uint32_t)closure->upvalueCount != record->as.closure.upvalueCount) corrupted();
+      for (int i = 0; i < closure->upvalueCount; i++) {
+        Value upvalue = loadValue(header, record->as.closure.upvalues + i);
+        if (!IS_OBJ(upvalue) || OBJ_TYPE(upvalue) != OBJ_UPVALUE) corrupted();
+        closure->upvalues[i] = (ObjUpvalue*)AS_OBJ(upvalue);
+      }
+      break;
+    }
+    case OBJ_UPVALUE:
+      ((ObjUpvalue*)object)->closed = loadValue(header, record->as.upvalue.value);
+      break;
+    case OBJ_TUPLE:
+      ((ObjTuple*)object)->first = loadValue(header, record->as.tuple.values);
+      ((ObjTuple*)object)->second = loadValue(header, record->as.tuple.values + 1);
+      break;
+    default:
+      break;
+  }
+}
+
+bool loadSnapshot(const char* path) {  // defines the saved globals, the image stays mapped until closeSnapshot
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return false;
+
+  struct stat info;
+  if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(SnapshotHeader)) {
+    close(fd);
+    return false;
+  }
+
+  size_t size = (size_t)info.st_size;
+  char* mapped = (char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) return false;
+  if (!validHeader((const SnapshotHeader*)mapped, size)) {
+    munmap(mapped, size);
+    return false;
+  }
+
+  closeSnapshot();
+  image = mapped;
+  imageSize = size;
+
+  const SnapshotHeader* header = (const SnapshotHeader*)image;
+  const SnapshotObject* records = (const SnapshotObject*)(image + header->objects);
+  loading = (Obj**)malloc(sizeof(Obj*) * (header->objectCount + 1));
+  if (loading == NULL) return false;
+  loaded = 0;
+
+  // closures are sized by their function, so they come after everything else exists
+  for (uint32_t i = 0; i < header->objectCount; i++) {
+    loading[i] = records[i].type == OBJ_CLOSURE ? NULL : createObject(header, &records[i]);
+    loaded = i + 1;
+  }
+  for (uint32_t i = 0; i < header->objectCount; i++) {
+    if (records[i].type != OBJ_CLOSURE) continue;
+    loading[i] = (Obj*)newClosure((ObjFunction*)loadObject(header, records[i].as.closure.function, OBJ_FUNCTION));
+  }
+  for (uint32_t i = 0; i < header->objectCount; i++) {
+    linkObject(header, &records[i], loading[i]);
+  }
+
+  for (uint32_t i = 0; i < header->globalCount; i++) {
+    Value name = loadValue(header, header->globals + i * 2);
+    if (!IS_STRING(name)) corrupted();
+    tableSet(&vm.globals, AS_STRING(name), loadValue(header, header->globals + i * 2 + 1));
+  }
+  checkIntrinsics();
+
+  free(loading);
+  loading = NULL;
+  loaded = 0;
+  return true;
+}
+
+void markSnapshotRoots() {
+  for (uint32_t i = 0; i < loaded; i++) {
+    markObject(loading[i]);
+  }
+}
+
+int restoreSnapshot(const char* path) {  // for vms that outlive a failed script: 0, or the exit code once the error is reported
+  jmp_buf panicJump;
+  jmp_buf* outer = vm.panicJump;
+  vm.panicJump = &panicJump;
+  if (setjmp(panicJump)) {  // a corrupted image or the heap limit, the half loaded objects go with the reset of the vm
+    vm.panicJump = outer;
+    free(loading);
+    loading = NULL;
+    loaded = 0;
+    return 70;
+  }
+
+  bool restored = loadSnapshot(path);
+  vm.panicJump = outer;
+  if (restored) return 0;
+  fprintf(vm.err, "Could not load snapshot \"%s\".\n", path);
+  return 74;
+}
+
+void closeSnapshot() {
+  if (image == NULL) return;
+  munmap((void*)image, imageSize);
+  image = NULL;
+  imageSize = 0;
+}
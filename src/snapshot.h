@@ -0,0 +1,14 @@
+#ifndef crinha_snapshot_h
+#define crinha_snapshot_h
+
+#include "common.h"
+
+#define SNAPSHOT_VERSION 4
+
+bool writeSnapshot(const char* path);
+bool loadSnapshot(const char* path);
+int restoreSnapshot(const char* path);
+void markSnapshotRoots();
+void closeSnapshot();
+
+#endif
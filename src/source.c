@@ -0,0 +1,95 @@
+#include "source.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// regular files are mapped read-only and compiled in place, so a big script is never copied and its pages
+// can be dropped by the kernel; pipes and stdin ("-") are read into a growing buffer instead
+
+static bool mapFile(int fd, size_t size, Source* source) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t mapped = (size / page + 1) * page;  // the page after the file is zero and terminates the source
+
+  char* chars = (char*)mmap(NULL, mapped, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (chars == MAP_FAILED) return false;
+  if (size > 0 && mmap(chars, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+    munmap(chars, mapped);
+    return false;
+  }
+  madvise(chars, mapped, MADV_SEQUENTIAL);  // read front to back by the scanner, deferred function bodies come back later
+
+  source->chars = chars;
+  source->length = size;
+  source->mapped = mapped;
+  return true;
+}
+
+char* readStream(FILE* file, size_t* length) {  // null terminated, for what can't be mapped
+  size_t capacity = 4096;
+  char* buffer = (char*)malloc(capacity);
+  *length = 0;
+  while (buffer != NULL) {
+    *length += fread(buffer + *length, 1, capacity - *length - 1, file);
+    if (*length < capacity - 1) break;
+
+    capacity *= 2;
+    char* grown = (char*)realloc(buffer, capacity);
+    if (grown == NULL) free(buffer);
+    buffer = grown;
+  }
+
+  if (buffer != NULL && ferror(file)) {
+    free(buffer);
+    return NULL;
+  }
+  if (buffer != NULL) buffer[*length] = '\0';
+  return buffer;
+}
+
+static bool readFile(FILE* file, Source* source) {
+  source->chars = readStream(file, &source->length);
+  source->mapped = 0;
+  return source->chars != NULL;
+}
+
+bool openSource(const char* path, Source* source) {  // false if it can't be read, callers report the error their own way
+  if (strcmp(path, "-") == 0) return readFile(stdin, source);
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return false;
+
+  struct stat status;
+  bool opened = fstat(fd, &status) == 0 && S_ISREG(status.st_mode) && mapFile(fd, (size_t)status.st_size, source);
+  if (!opened) {  // a pipe, a device or a failed mapping
+    FILE* file = fdopen(fd, "rb");
+    opened = file != NULL && readFile(file, source);
+    if (file != NULL) {
+      fclose(file);
+      return opened;
+    }
+  }
+  close(fd);
+  return opened;
+}
+
+void closeSource(Source* source) {
+  if (source->mapped > 0) {
+    munmap(source->chars, source->mapped);
+  } else {
+    free(source->chars);
+  }
+  source->chars = NULL;
+  source->length = 0;
+  source->mapped = 0;
+}
+
+InterpretResult interpretFile(const char* path, const Source* source, bool cache) {  // .json files are rinha asts, anything else the surface syntax
+  size_t length = strlen(path);
+  const char* cachePath = cache && strcmp(path, "-") != 0 ? path : NULL;
+  if (length >= 5 && strcmp(path + length - 5, ".json") == 0) return interpretJson(source->chars, source->length, cachePath);
+  return interpret(source->chars, source->length, cachePath);
+}
@@ -0,0 +1,20 @@
+#ifndef crinha_source_h
+#define crinha_source_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "vm.h"
+
+typedef struct {
+  char* chars;  // null terminated, string constants point into it so it lives as long as the vm
+  size_t length;
+  size_t mapped;  // bytes of the read-only mapping, 0 when chars was read into the heap
+} Source;
+
+bool openSource(const char* path, Source* source);
+void closeSource(Source* source);
+char* readStream(FILE* file, size_t* length);
+InterpretResult interpretFile(const char* path, const Source* source, bool cache);
+
+#endif
@@ -0,0 +1,93 @@
+#include "stack.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "vm.h"
+
+size_t stackLimit = STACK_LIMIT;
+
+static _Thread_local StackRegion* guarded[2];  // the handler runs on the thread that faulted, so it sees its own vm
+
+static size_t pageSize() {
+  static _Thread_local size_t size = 0;
+  if (size == 0) size = (size_t)sysconf(_SC_PAGESIZE);
+  return size;
+}
+
+static size_t roundToPage(size_t size) {
+  return (size + pageSize() - 1) & ~(pageSize() - 1);
+}
+
+void* reserveStack(StackRegion* region, size_t size) {  // address space only, pages are committed as the stack runs into them
+  region->reserved = roundToPage(size);
+  region->committed = region->reserved < STACK_SEGMENT ? region->reserved : STACK_SEGMENT;
+  region->base = mmap(NULL, region->reserved + pageSize(), PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (region->base == MAP_FAILED || mprotect(region->base, region->committed, PROT_READ | PROT_WRITE) != 0) {
+    fprintf(stderr, "Could not reserve %zu bytes of stack.\n", size);
+    exit(74);
+  }
+  return region->base;
+}
+
+void releaseStack(StackRegion* region) {
+  if (region->base == NULL) return;
+  munmap(region->base, region->reserved + pageSize());
+  region->base = NULL;
+  region->committed = 0;
+  region->reserved = 0;
+}
+
+void trimStack(StackRegion* region, size_t used) {  // gives back what a deep recursion left committed, keeping room so shallow calls never fault
+  size_t keep = (used * 2 + STACK_SEGMENT - 1) / STACK_SEGMENT * STACK_SEGMENT;
+  if (keep < STACK_SEGMENT) keep = STACK_SEGMENT;
+  if (region->committed < keep * 2) return;
+
+  // remapping drops the pages and makes the range fault again, so growStack commits it back if needed
+  if (mmap(region->base + keep, region->committed - keep, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED) return;
+  region->committed = keep;
+}
+
+static bool growStack(StackRegion* region, char* address) {
+  size_t needed = roundToPage((size_t)(address - region->base) + 1);
+  size_t committed = region->committed * 2 > needed ? region->committed * 2 : needed;
+  if (committed > region->reserved) committed = region->reserved;
+
+  if (mprotect(region->base + region->committed, committed - region->committed, PROT_READ | PROT_WRITE) != 0) return false;
+  region->committed = committed;
+  return true;
+}
+
+static void stackFault(int signal, siginfo_t* info, __attribute__((unused)) void* context) {
+  char* address = (char*)info->si_addr;
+
+  for (int i = 0; i < 2; i++) {
+    StackRegion* region = guarded[i];
+    if (region == NULL || address < region->base || address >= region->base + region->reserved + pageSize()) continue;
+
+    // a push or a new frame ran past the committed part, commit more and let the write happen again
+    if (address < region->base + region->reserved && growStack(region, address)) return;
+
+    // the guard page, SA_NODEFER keeps SIGSEGV unblocked after unwinding out of here
+    runtimePanic("Stack overflow: limit of %zu bytes exceeded.", stackLimit);
+  }
+
+  // not a vm stack, crash as usual
+  struct sigaction action = {0};
+  action.sa_handler = SIG_DFL;
+  sigaction(signal, &action, NULL);
+}
+
+void installStackGuard(StackRegion* values, StackRegion* frames) {
+  guarded[0] = values;
+  guarded[1] = frames;
+
+  struct sigaction action = {0};
+  action.sa_sigaction = stackFault;
+  action.sa_flags = SA_SIGINFO | SA_NODEFER;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGSEGV, &action, NULL);
+}
@@ -0,0 +1,22 @@
+#ifndef crinha_stack_h
+#define crinha_stack_h
+
+#include "common.h"
+
+#define STACK_LIMIT (64 * 1024 * 1024)  // budget for values and frames together, the only bound on recursion depth
+#define STACK_SEGMENT (64 * 1024)       // stacks are committed and given back in multiples of this
+
+typedef struct {
+  char* base;
+  size_t committed;  // readable and writable prefix, the rest faults until it is needed
+  size_t reserved;   // followed by a guard page that is never committed
+} StackRegion;
+
+extern size_t stackLimit;
+
+void* reserveStack(StackRegion* region, size_t size);
+void releaseStack(StackRegion* region);
+void trimStack(StackRegion* region, size_t used);
+void installStackGuard(StackRegion* values, StackRegion* frames);
+
+#endif
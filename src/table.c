@@ -3,139 +3,223 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "memory.h"
 #include "object.h"
 #include "value.h"
 
-#define TABLE_MAX_LOAD 0.75  // PERF: arbitrary value, should be tuned
+#define TABLE_MAX_LOAD 0.875  // tags filter out almost every false candidate, so the table can run fuller
+
+#define CTRL_EMPTY 0x00
+#define CTRL_DELETED 0x01
+#define HASH_TAG(hash) ((uint8_t)(0x80 | ((hash) >> 25)))  // top 7 bits of the hash, the high bit marks the slot as full
 
 void initTable(Table* table) {
   table->count = 0;
+  table->tombstones = 0;
   table->capacity = 0;
   table->entries = NULL;
+  table->slots = NULL;
+  table->control = NULL;
+}
+
+static int entryCapacity(int capacity) {
+  return (int)(capacity * TABLE_MAX_LOAD);
 }
 
 void freeTable(Table* table) {
-  FREE_ARRAY(Entry, table->entries, table->capacity);
+  FREE_ARRAY(Entry, table->entries, entryCapacity(table->capacity));
+  FREE_ARRAY(uint32_t, table->slots, table->capacity);
+  FREE_ARRAY(uint8_t, table->control, table->capacity + TABLE_GROUP);
   initTable(table);
 }
 
-static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
-  uint32_t index = key->hash & (capacity - 1);
-  Entry* tombstone = NULL;
+static void setControl(Table* table, uint32_t index, uint8_t control) {
+  table->control[index] = control;
+  if (index < TABLE_GROUP) table->control[table->capacity + index] = control;  // mirrored, so reading a group never wraps around
+}
 
-  for (;;) {
-    Entry* entry = &entries[index];
-    if (entry->key == NULL) {
-      if (IS_NIL(entry->value)) {
-        return tombstone != NULL ? tombstone : entry;
-      } else {
-        if (tombstone == NULL) tombstone = entry;
-      }
-    } else if (entry->key == key) {
-      return entry;
+static inline uint32_t matchGroup(const uint8_t* group, uint8_t control) {  // bit i set if group[i] == control
+#ifdef __SSE2__
+  __m128i bytes = _mm_loadu_si128((const __m128i*)group);
+  return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8((char)control)));
+#else
+  uint32_t matches = 0;
+  for (int i = 0; i < TABLE_GROUP; i++) {
+    if (group[i] == control) matches |= 1u << i;
+  }
+  return matches;
+#endif
+}
+
+static inline uint32_t matchFree(const uint8_t* group) {  // bit i set if group[i] is empty or deleted
+#ifdef __SSE2__
+  __m128i bytes = _mm_loadu_si128((const __m128i*)group);
+  return ~(uint32_t)_mm_movemask_epi8(bytes) & 0xffff;
+#else
+  uint32_t matches = 0;
+  for (int i = 0; i < TABLE_GROUP; i++) {
+    if (!(group[i] & 0x80)) matches |= 1u << i;
+  }
+  return matches;
+#endif
+}
+
+// probing jumps whole groups with a triangular stride, which visits every group of a power of two table
+#define FOR_EACH_GROUP(table, hash, index)                \
+  for (uint32_t index = (hash) & ((table)->capacity - 1), \
+                stride = TABLE_GROUP;                     \
+       ; index = (index + stride) & ((table)->capacity - 1), stride += TABLE_GROUP)
+
+static int findSlot(Table* table, ObjString* key) {
+  uint32_t mask = table->capacity - 1;
+  uint8_t tag = HASH_TAG(key->hash);
+
+  FOR_EACH_GROUP(table, key->hash, index) {
+    const uint8_t* group = table->control + index;
+    for (uint32_t matches = matchGroup(group, tag); matches != 0; matches &= matches - 1) {
+      uint32_t slot = (index + __builtin_ctz(matches)) & mask;
+      if (table->entries[table->slots[slot]].key == key) return (int)slot;
     }
 
-    index = (index + 1) & (capacity - 1);  // alg linear probing. Other options are: double hashing, cuckoo hashing, Robin Hood hashing
+    if (matchGroup(group, CTRL_EMPTY) != 0) return -1;
+  }
+}
+
+static uint32_t findFreeSlot(Table* table, uint32_t hash) {
+  FOR_EACH_GROUP(table, hash, index) {
+    uint32_t free = matchFree(table->control + index);
+    if (free != 0) return (index + __builtin_ctz(free)) & (table->capacity - 1);
   }
 }
 
 bool tableGet(Table* table, ObjString* key, Value* value) {
   if (table->count == 0) return false;
 
-  Entry* entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL) return false;
+  int slot = findSlot(table, key);
+  if (slot == -1) return false;
 
-  *value = entry->value;
+  *value = table->entries[table->slots[slot]].value;
   return true;
 }
 
-static void adjustCapacity(Table* table, int capacity) {
-  Entry* entries = ALLOCATE(Entry, capacity);
-  for (int i = 0; i < capacity; i++) {
-    entries[i].key = NULL;
-    entries[i].value = NIL_VAL;
-  }
-
-  table->count = 0;
-  for (int i = 0; i < table->capacity; i++) {
-    Entry* entry = &table->entries[i];
-    if (entry->key == NULL) continue;
-
-    Entry* dest = findEntry(entries, capacity, entry->key);
-    dest->key = entry->key;
-    dest->value = entry->value;
-    table->count++;
-  }
+static void adjustCapacity(Table* table, int capacity) {  // entries stay where they are, only the index is rebuilt
+  uint32_t* slots = ALLOCATE(uint32_t, capacity);
+  uint8_t* control = ALLOCATE(uint8_t, capacity + TABLE_GROUP);
+  Entry* entries = GROW_ARRAY(Entry, table->entries, entryCapacity(table->capacity), entryCapacity(capacity));
+  memset(control, CTRL_EMPTY, capacity + TABLE_GROUP);
 
-  FREE_ARRAY(Entry, table->entries, table->capacity);
+  FREE_ARRAY(uint32_t, table->slots, table->capacity);
+  FREE_ARRAY(uint8_t, table->control, table->capacity + TABLE_GROUP);
   table->entries = entries;
+  table->slots = slots;
+  table->control = control;
   table->capacity = capacity;
+  table->tombstones = 0;
+
+  for (int i = 0; i < table->count; i++) {
+    uint32_t hash = entries[i].key->hash;
+    uint32_t slot = findFreeSlot(table, hash);
+    table->slots[slot] = (uint32_t)i;
+    setControl(table, slot, HASH_TAG(hash));
+  }
 }
 
 bool tableSet(Table* table, ObjString* key, Value value) {
-  if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-    int capacity = GROW_CAPACITY(table->capacity);
-    adjustCapacity(table, capacity);
+  int existing = table->count == 0 ? -1 : findSlot(table, key);
+  if (existing != -1) {
+    table->entries[table->slots[existing]].value = value;
+    return false;
+  }
+
+  if (table->count + table->tombstones + 1 > entryCapacity(table->capacity)) {
+    int capacity = table->capacity;
+    if (table->count + 1 > entryCapacity(capacity) / 2) {  // otherwise dropping the tombstones is enough
+      capacity = GROW_CAPACITY(capacity);
+    }
+    adjustCapacity(table, capacity < TABLE_GROUP ? TABLE_GROUP : capacity);
   }
-  Entry* entry = findEntry(table->entries, table->capacity, key);
-  bool isNewKey = entry->key == NULL;
-  if (isNewKey && IS_NIL(entry->value)) table->count++;
 
-  entry->key = key;
-  entry->value = value;
-  return isNewKey;
+  uint32_t slot = findFreeSlot(table, key->hash);
+  if (table->control[slot] == CTRL_DELETED) table->tombstones--;
+  table->entries[table->count].key = key;
+  table->entries[table->count].value = value;
+  table->slots[slot] = (uint32_t)table->count;
+  setControl(table, slot, HASH_TAG(key->hash));
+  table->count++;
+  return true;
 }
 
 bool tableDelete(Table* table, ObjString* key) {
   if (table->count == 0) return false;
 
-  Entry* entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL) return false;
+  int found = findSlot(table, key);
+  if (found == -1) return false;
+
+  uint32_t mask = table->capacity - 1;
+  uint32_t slot = (uint32_t)found;
+  uint32_t emptyBefore = matchGroup(table->control + ((slot - TABLE_GROUP) & mask), CTRL_EMPTY);
+  uint32_t emptyAfter = matchGroup(table->control + slot, CTRL_EMPTY);
+
+  // if the run of full slots around this one is shorter than a group, every probe that crossed it also saw an
+  // empty slot and stopped, so it can go back to empty instead of leaving a tombstone
+  bool wasNeverFull = emptyBefore != 0 && emptyAfter != 0 &&
+                      __builtin_ctz(emptyAfter) + (__builtin_clz(emptyBefore) - (32 - TABLE_GROUP)) < TABLE_GROUP;
+  if (wasNeverFull) {
+    setControl(table, slot, CTRL_EMPTY);
+  } else {
+    setControl(table, slot, CTRL_DELETED);
+    table->tombstones++;
+  }
 
-  entry->key = NULL;
-  entry->value = BOOL_VAL(true);
+  // keep the entries packed by moving the last one into the hole
+  uint32_t hole = table->slots[slot];
+  uint32_t last = (uint32_t)--table->count;
+  if (hole != last) {
+    table->entries[hole] = table->entries[last];
+    table->slots[findSlot(table, table->entries[hole].key)] = hole;
+  }
   return true;
 }
 
 void tableAddAll(Table* from, Table* to) {
-  for (int i = 0; i < from->capacity; i++) {
-    Entry* entry = &from->entries[i];
-    if (entry->key != NULL) {
-      tableSet(to, entry->key, entry->value);
-    }
+  for (int i = 0; i < from->count; i++) {
+    tableSet(to, from->entries[i].key, from->entries[i].value);
   }
 }
 
-ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash) {
+ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash) {  // only the tags are read until a candidate matches
   if (table->count == 0) return NULL;
 
-  uint32_t index = hash & (table->capacity - 1);
-  for (;;) {
-    Entry* entry = &table->entries[index];
-    if (entry->key == NULL) {
-      if (IS_NIL(entry->value)) return NULL;
-    } else if (entry->key->length == length && entry->key->hash == hash && memcmp(entry->key->chars, chars, length) == 0) {
-      return entry->key;
+  uint32_t mask = table->capacity - 1;
+  uint8_t tag = HASH_TAG(hash);
+
+  FOR_EACH_GROUP(table, hash, index) {
+    const uint8_t* group = table->control + index;
+    for (uint32_t matches = matchGroup(group, tag); matches != 0; matches &= matches - 1) {
+      ObjString* key = table->entries[table->slots[(index + __builtin_ctz(matches)) & mask]].key;
+      if (key->length == length && key->hash == hash && memcmp(key->chars, chars, length) == 0) {
+        return key;
+      }
     }
 
-    index = (index + 1) & (table->capacity - 1);
+    if (matchGroup(group, CTRL_EMPTY) != 0) return NULL;
   }
 }
 
-void tableRemoveWhite(Table* table) {
-  for (int i = 0; i < table->capacity; i++) {
-    Entry* entry = &table->entries[i];
-    if (entry->key != NULL && !entry->key->obj.isMarked) {
-      tableDelete(table, entry->key);
-    }
+void tableRemoveWhite(Table* table) {  // backwards, a delete moves the last entry into the hole
+  for (int i = table->count - 1; i >= 0; i--) {
+    ObjString* key = table->entries[i].key;
+    if (!key->obj.isMarked) tableDelete(table, key);
   }
 }
 
 void markTable(Table* table) {
-  for (int i = 0; i < table->capacity; i++) {
-    Entry* entry = &table->entries[i];
-    markObject((Obj*)entry->key);
-    markValue(entry->value);
+  for (int i = 0; i < table->count; i++) {
+    markObject((Obj*)table->entries[i].key);
+    markValue(table->entries[i].value);
   }
-}
\ No newline at end of file
+}
@@ -9,10 +9,15 @@ typedef struct {
   Value value;
 } Entry;
 
-typedef struct {
+#define TABLE_GROUP 16  // control bytes probed at once, one SSE2 register
+
+typedef struct {  // swiss table: a control byte per slot says if it is empty, deleted or full (with 7 bits of the hash)
   int count;
-  int capacity;
-  Entry* entries;
+  int tombstones;
+  int capacity;      // slots, a power of two
+  Entry* entries;    // the count live entries packed at the front, so walking the table costs only what is in it
+  uint32_t* slots;   // index in entries of each full slot
+  uint8_t* control;  // capacity bytes followed by a copy of the first TABLE_GROUP
 } Table;
 
 void initTable(Table* table);
@@ -1,10 +1,13 @@
 #include "value.h"
 
+#include <inttypes.h>
 #include <stdio.h>
 #include <string.h>
 
+#include "bigint.h"
 #include "object.h"
 #include "memory.h"
+#include "vm.h"
 
 void initValueArray(ValueArray* array) {
   array->values = NULL;
@@ -30,9 +33,9 @@ void freeValueArray(ValueArray* array) {
 
 void printValue(Value value) {
   switch (value.type) {
-    case VAL_BOOL: printf(AS_BOOL(value) ? "true" : "false"); break;
-    case VAL_NIL: printf("nil"); break;
-    case VAL_NUMBER: printf("%d", AS_NUMBER(value)); break;
+    case VAL_BOOL: fputs(AS_BOOL(value) ? "true" : "false", vm.out); break;
+    case VAL_NIL: fputs("nil", vm.out); break;
+    case VAL_NUMBER: fprintf(vm.out, "%" PRId64, AS_NUMBER(value)); break;
     case VAL_OBJ: printObject(value); break;
   }
 }
@@ -43,7 +46,10 @@ bool valuesEqual(Value a, Value b) {
     case VAL_BOOL: return AS_BOOL(a) == AS_BOOL(b);
     case VAL_NIL: return true;
     case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
-    case VAL_OBJ: return AS_OBJ(a) == AS_OBJ(b);
+    case VAL_OBJ:
+      if (IS_STRING(a) && IS_STRING(b)) return stringsEqual(AS_STRING(a), AS_STRING(b));
+      if (IS_BIGINT(a) && IS_BIGINT(b)) return bigIntsEqual(AS_BIGINT(a), AS_BIGINT(b));
+      return AS_OBJ(a) == AS_OBJ(b);
     default: return false;
   }
 }
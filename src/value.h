@@ -17,7 +17,7 @@ typedef struct {  // memory layout is interesting in this one, see the differenc
   ValueType type;
   union {
     bool boolean;
-    int number;
+    int64_t number;  // overflows into an ObjBigInt
     Obj* obj;
   } as;
 } Value;
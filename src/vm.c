@@ -2,45 +2,74 @@
 
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#include "bigint.h"
+#include "cache.h"
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "parallel.h"
 #include "memory.h"
 #include "object.h"
+#include "snapshot.h"
 
-VM vm;  // if needed to run multiple vm, better if this is not global
+#define TRACE_FRAMES 16  // innermost and outermost frames shown in an error
+#define PANIC_RUNTIME 1  // the values vm.panicJump is unwound with
+#define PANIC_COMPILE 2  // a body compiled on its first call had errors
+
+_Thread_local VM vm;  // one per thread, so batch mode can run scripts side by side
+bool checkBodies = false;
 
 static void resetStack() {
-  vm.stackCount = 0;
+  vm.stackTop = vm.stack;
   vm.frameCount = 0;
   vm.openUpvalues = NULL;
 }
 
-static void runtimeError(const char* format, ...) {
-  va_list args;
-  va_start(args, format);
-  vfprintf(stderr, format, args);
-  va_end(args);
-  fputs("\n", stderr);
+static void reportError(const char* format, va_list args) {
+  vfprintf(vm.err, format, args);
+  fputs("\n", vm.err);
 
   for (int i = vm.frameCount - 1; i >= 0; i--) {
+    if (i == vm.frameCount - 1 - TRACE_FRAMES && i >= TRACE_FRAMES) {  // a stack overflow would print every frame
+      fprintf(vm.err, "[... %d more frames]\n", i - TRACE_FRAMES + 1);
+      i = TRACE_FRAMES - 1;
+    }
+
     CallFrame* frame = &vm.frames[i];
     ObjFunction* function = frame->closure->function;
-    size_t instruction = frame->ip - function->chunk.code - 1;
-    fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
+    size_t instruction = frame->ip > function->chunk.code ? frame->ip - function->chunk.code - 1 : 0;
+    fprintf(vm.err, "[line %d] in ", getLine(&function->chunk, (int)instruction));
     if (function->name == NULL) {
-      fprintf(stderr, "script\n");
+      fprintf(vm.err, "script\n");
     } else {
-      fprintf(stderr, "%s()\n", function->name->chars);
+      fprintf(vm.err, "%.*s()\n", function->name->length, function->name->chars);
     }
   }
 
   resetStack();
 }
 
+static void runtimeError(const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  reportError(format, args);
+  va_end(args);
+}
+
+void runtimePanic(const char* format, ...) {  // for errors raised deep inside the runtime (e.g. allocation), where there is no way to return INTERPRET_RUNTIME_ERROR
+  va_list args;
+  va_start(args, format);
+  reportError(format, args);
+  va_end(args);
+
+  if (vm.panicJump == NULL) exit(70);
+  longjmp(*vm.panicJump, PANIC_RUNTIME);
+}
+
 static Value clockNative(int argCount, __attribute__((unused)) Value* args) {
   if (argCount > 0) {
     runtimeError("Expected 0 arguments");
@@ -57,12 +86,12 @@ static Value printNative(int argCount, Value* args) {
   }
 
   printValue(args[0]);
-  printf("\n");
+  fputc('\n', vm.out);
   return args[0];
 }
 
 static Value firstNative(int argCount, Value* args) {
-  if (argCount != 1 && !IS_TUPLE(args[0])) {
+  if (argCount != 1 || !IS_TUPLE(args[0])) {
     runtimeError("Expect 1 argument of type Tuple");
     return NIL_VAL;
   }
@@ -71,7 +100,7 @@ static Value firstNative(int argCount, Value* args) {
 }
 
 static Value secondNative(int argCount, Value* args) {
-  if (argCount != 1 && !IS_TUPLE(args[0])) {
+  if (argCount != 1 || !IS_TUPLE(args[0])) {
     runtimeError("Expect 1 argument of type Tuple");
     return NIL_VAL;
   }
@@ -79,102 +108,182 @@ static Value secondNative(int argCount, Value* args) {
   return AS_TUPLE(args[0])->second;
 }
 
+static const struct {
+  const char* name;
+  NativeFn function;
+} natives[] = {
+    {"clock", clockNative},
+    {"print", printNative},
+    {"first", firstNative},
+    {"second", secondNative},
+};
+
+#define NATIVE_COUNT (int)(sizeof(natives) / sizeof(natives[0]))
+
+int nativeIndex(NativeFn function) {  // natives are saved in snapshots by their position here
+  for (int i = 0; i < NATIVE_COUNT; i++) {
+    if (natives[i].function == function) return i;
+  }
+  return -1;
+}
+
+NativeFn nativeFunction(int index) {
+  return index >= 0 && index < NATIVE_COUNT ? natives[index].function : NULL;
+}
+
 static void defineNative(const char* name, NativeFn function) {
-  push(OBJ_VAL(copyString(name, (int)strlen(name))));
+  push(OBJ_VAL(sourceString(name, (int)strlen(name))));
   push(OBJ_VAL(newNative(function)));
   tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
   pop();
   pop();
 }
 
-void initVM() {
-  vm.stack = ALLOCATE(Value, STACK_MIN);
-  vm.stackCapacity = STACK_MIN;
-  vm.frames = ALLOCATE(CallFrame, FRAMES_MIN);
-  vm.frameCapacity = FRAMES_MIN;
+void checkIntrinsics() {  // after anything that may redefine first or second, like a script or a snapshot
+  static const NativeFn functions[] = {firstNative, secondNative};
+  vm.intrinsicsShadowed = false;
+  for (int i = 0; i < 2; i++) {
+    Value value;
+    if (!tableGet(&vm.globals, vm.intrinsicNames[i], &value) || !IS_NATIVE(value) || AS_NATIVE(value) != functions[i]) {
+      vm.intrinsicsShadowed = true;
+    }
+  }
+}
 
+static void initRuntime() {  // the part of the vm a script changes, the stacks stay
+  initGC();
   resetStack();
   initTable(&vm.globals);
   initTable(&vm.strings);
+  atomic_store(&vm.interrupted, false);
+
+  for (int i = 0; i < NATIVE_COUNT; i++) {
+    defineNative(natives[i].name, natives[i].function);
+  }
+  vm.intrinsicNames[0] = sourceString("first", 5);  // interned, the keys of the globals just defined
+  vm.intrinsicNames[1] = sourceString("second", 6);
+  vm.intrinsicsShadowed = false;
+}
+
+void initVM() {
+  vm.panicJump = NULL;
+  vm.out = stdout;
+  vm.err = stderr;
 
-  defineNative("clock", clockNative);
-  defineNative("print", printNative);
-  defineNative("first", firstNative);
-  defineNative("second", secondNative);
-  vm.objects = NULL;
-  vm.bytesAllocated = 0;
-  vm.nextGC = 1024 * 1024;
+  vm.stack = reserveStack(&vm.stackRegion, stackLimit);  // either one may take the whole budget, only address space is reserved
+  vm.frames = reserveStack(&vm.frameRegion, stackLimit);
+  installStackGuard(&vm.stackRegion, &vm.frameRegion);
+  initCodeArena(&vm.code);
 
-  vm.grayCount = 0;
-  vm.grayCapacity = 0;
-  vm.grayStack = NULL;
+  initRuntime();
 }
 
 void freeVM() {
-  FREE_ARRAY(Value*, vm.stack, vm.stackCapacity);
-  FREE_ARRAY(CallFrame*, vm.frames, vm.frameCapacity);
+  releaseStack(&vm.stackRegion);
+  releaseStack(&vm.frameRegion);
   freeTable(&vm.globals);
   freeTable(&vm.strings);
   freeObjects();
+  releaseCodeArena(&vm.code);
+  closeCache();  // after the objects, loaded strings point into the images
+  closeSnapshot();
 }
 
-void push(Value value) {
-  if (vm.stackCapacity < vm.stackCount + 1) {
-    int oldCapacity = vm.stackCapacity;
-    vm.stackCapacity = GROW_CAPACITY(oldCapacity);
-    vm.stack = GROW_ARRAY(Value, vm.stack, oldCapacity, vm.stackCapacity);
-  }
-
-  vm.stack[vm.stackCount] = value;
-  vm.stackCount++;
+void resetVM() {  // back to a fresh vm without giving up the stacks, so a pooled vm is ready for the next script
+  freeTable(&vm.globals);
+  freeTable(&vm.strings);
+  freeObjects();
+  releaseCodeArena(&vm.code);
+  closeCache();
+  closeSnapshot();
+  trimStack(&vm.stackRegion, 0);
+  trimStack(&vm.frameRegion, 0);
+  initRuntime();
 }
 
-CallFrame* newFrame() {
-  if (vm.frameCapacity < vm.frameCount + 1) {
-    int oldCapacity = vm.frameCapacity;
-    vm.frameCapacity = GROW_CAPACITY(oldCapacity);
-    vm.frames = GROW_ARRAY(CallFrame, vm.frames, oldCapacity, vm.frameCapacity);
-  }
-
-  return &vm.frames[vm.frameCount++];
+void push(Value value) {  // no capacity check, call() made room for the whole function and stack.c commits the pages
+  *vm.stackTop = value;
+  vm.stackTop++;
 }
 
 Value pop() {
-  vm.stackCount--;
-  return vm.stack[vm.stackCount];
+  vm.stackTop--;
+  return *vm.stackTop;
 }
 
 static Value peek(int distance) {
-  return vm.stack[vm.stackCount - 1 - distance];
+  return vm.stackTop[-1 - distance];
+}
+
+static bool fitsStack(Value* top, int frameCount) {  // values and frames share one budget
+  return (size_t)((char*)top - (char*)vm.stack) + (size_t)frameCount * sizeof(CallFrame) <= stackLimit;
+}
+
+static bool interrupted() {  // scripts only loop through calls, so checking there bounds any script
+  if (!atomic_load_explicit(&vm.interrupted, memory_order_relaxed)) return false;
+  runtimeError("Interrupted: time limit exceeded.");
+  return true;
+}
+
+static bool compiled(ObjFunction* function) {  // bodies left in the source by the compiler are compiled on the first call
+  if (function->deferred != NULL && !compileDeferred(function)) {  // the errors are reported, the run ends as if they were found up front
+    resetStack();
+    if (vm.panicJump != NULL) longjmp(*vm.panicJump, PANIC_COMPILE);
+    return false;
+  }
+  packChunk(&function->chunk);  // PERF: placed in the code arena in first call order, next to the code that called it
+  return true;
 }
 
 static bool call(ObjClosure* closure, int argCount) {
+  if (interrupted() || !compiled(closure->function)) return false;
   if (argCount != closure->function->arity) {
     runtimeError("Expected %d arguments but got %d.", closure->function->arity, argCount);
     return false;
   }
 
+  Value* slots = vm.stackTop - argCount - 1;
+  if (!fitsStack(slots + closure->function->maxStack, vm.frameCount + 1)) {  // the only check, pushes inside the function can't go past this
+    runtimeError("Stack overflow: limit of %zu bytes exceeded.", stackLimit);
+    return false;
+  }
 
-  CallFrame* frame = newFrame();
+  CallFrame* frame = &vm.frames[vm.frameCount++];
   frame->closure = closure;
   frame->ip = closure->function->chunk.code;
-  frame->slots = vm.stack + vm.stackCount - argCount - 1;
+  frame->slots = slots;
   return true;
 }
 
+static void closeUpvalues(Value* last) {
+  while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
+    ObjUpvalue* upvalue = vm.openUpvalues;
+    upvalue->closed = *upvalue->location;
+    upvalue->location = &upvalue->closed;
+    vm.openUpvalues = upvalue->next;
+  }
+}
+
 static bool tailCall(ObjClosure* closure, int argCount) {
+  if (interrupted() || !compiled(closure->function)) return false;
   if (argCount != closure->function->arity) {
     runtimeError("Expected %d arguments but got %d.", closure->function->arity, argCount);
     return false;
   }
 
-
   CallFrame* frame = vm.frames + vm.frameCount - 1;
+  if (!fitsStack(frame->slots + closure->function->maxStack, vm.frameCount)) {
+    runtimeError("Stack overflow: limit of %zu bytes exceeded.", stackLimit);
+    return false;
+  }
+
+  closeUpvalues(frame->slots);  // closures made by the frame keep the values they captured, the slots are reused below
   Value* dst;
   for (int i = 0; i < argCount + 1; i++) {
     dst = frame->slots + i;
-    *dst = vm.stack[vm.stackCount - argCount - 1 + i];
+    *dst = vm.stackTop[i - argCount - 1];
   }
+  vm.stackTop = frame->slots + argCount + 1;
   frame->closure = closure;
   frame->ip = closure->function->chunk.code;
   return true;
@@ -191,8 +300,9 @@ static bool callValue(Value callee, int argCount, bool shouldTailCall) {
         }
       case OBJ_NATIVE: {
         NativeFn native = AS_NATIVE(callee);
-        Value result = native(argCount, vm.stack + vm.stackCount - argCount);
-        vm.stackCount -= argCount + 1;
+        Value result = native(argCount, vm.stackTop - argCount);
+        if (vm.frameCount == 0) return false;  // the native reported an error, which unwound the frames
+        vm.stackTop -= argCount + 1;
         push(result);
         return true;
       }
@@ -204,6 +314,20 @@ static bool callValue(Value callee, int argCount, bool shouldTailCall) {
   return false;
 }
 
+static bool callIntrinsic(int intrinsic) {  // OP_FIRST or OP_SECOND after the script redefined the global, called like OP_CALL would
+  ObjString* name = vm.intrinsicNames[intrinsic];
+  Value callee;
+  if (!tableGet(&vm.globals, name, &callee)) {
+    runtimeError("Undefined variable '%.*s'.", name->length, name->chars);
+    return false;
+  }
+
+  vm.stackTop[0] = vm.stackTop[-1];  // the compiler kept the slot below the argument
+  vm.stackTop[-1] = callee;
+  vm.stackTop++;
+  return callValue(callee, 1, false);
+}
+
 static ObjUpvalue* captureUpValue(Value* local) {
   ObjUpvalue* prevUpValue = NULL;
   ObjUpvalue* upvalue = vm.openUpvalues;
@@ -226,35 +350,33 @@ static ObjUpvalue* captureUpValue(Value* local) {
   return createdUpvalue;
 }
 
-static void closeUpvalues(Value* last) {
-  while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
-    ObjUpvalue* upvalue = vm.openUpvalues;
-    upvalue->closed = *upvalue->location;
-    upvalue->location = &upvalue->closed;
-    vm.openUpvalues = upvalue->next;
-  }
-}
-
 static bool isFalsey(Value value) {
   return (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate(char* a, int aLength, char* b, int bLength) {
-  int length = aLength + bLength;
-  char* chars = ALLOCATE(char, length + 1);
-  memcpy(chars, a, aLength);
-  memcpy(chars + aLength, b, bLength);
-  chars[length] = '\0';
-
-  ObjString* result = takeString(chars, length);
+static void concatenate() {
+  ObjString* result = concatenateStrings(AS_STRING(peek(1)), AS_STRING(peek(0)));
   pop();
   pop();
   push(OBJ_VAL(result));
 }
 
+static inline bool divideOverflow(int64_t a, int64_t b, int64_t* result) {  // zero and INT64_MIN / -1 take the slow path
+  if (b == 0 || (a == INT64_MIN && b == -1)) return true;
+  *result = a / b;
+  return false;
+}
+
+static inline bool moduloOverflow(int64_t a, int64_t b, int64_t* result) {
+  if (b == 0 || b == -1) return true;  // INT64_MIN % -1 traps like the division
+  *result = a % b;
+  return false;
+}
+
 static InterpretResult runOptimized() {  // dispatching can be made faster with direct threaded code, jump table, computed goto
   register CallFrame* frame;
   register uint8_t* ip;
+  register Value* sp;  // call() checked the room for the whole function, so no bounds checks here
 
 #define LOAD_FRAME()                     \
   frame = &vm.frames[vm.frameCount - 1]; \
@@ -262,10 +384,16 @@ static InterpretResult runOptimized() {  // dispatching can be made faster with
 
 #define STORE_FRAME() frame->ip = ip
 
+#define PUSH(value) (*sp++ = (value))
+#define POP() (*--sp)
+#define PEEK(distance) (sp[-1 - (distance)])
+#define LOAD_STACK() sp = vm.stackTop
+#define STORE_STACK() vm.stackTop = sp  // before anything that allocates or reads the stack, so the GC sees every value
+
 #ifdef DEBUG_TRACE_EXECUTION
 #define TRACE_EXECUTION()                                                 \
   printf("          ");                                                   \
-  for (Value* slot = vm.stack; slot < vm.stack + vm.stackCount; slot++) { \
+  for (Value* slot = vm.stack; slot < sp; slot++) {                       \
     printf("[");                                                          \
     printValue(*slot);                                                    \
     printf("]");                                                          \
@@ -311,164 +439,325 @@ static InterpretResult runOptimized() {  // dispatching can be made faster with
 #define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
 #define READ_SHORT() \
   (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_LONG() \
+  (ip += 3, (uint32_t)((ip[-3] << 16) | (ip[-2] << 8) | ip[-1]))
+#define CONSTANT_AT(index) (frame->closure->function->chunk.constants.values[index])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
-#define BINARY_OP(valueType, op)                      \
-  do {                                                \
-    if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-      frame->ip = ip;                                 \
-      runtimeError("Operands must be numbers.");      \
-      return INTERPRET_RUNTIME_ERROR;                 \
-    }                                                 \
-    int b = AS_NUMBER(pop());                         \
-    int a = AS_NUMBER(pop());                         \
-    push(valueType(a op b));                          \
+#define GET_GLOBAL(constant)                                                 \
+  do {                                                                       \
+    ObjString* name = AS_STRING(CONSTANT_AT(constant));                      \
+    Value value;                                                             \
+    if (!tableGet(&vm.globals, name, &value)) {                              \
+      frame->ip = ip;                                                        \
+      runtimeError("Undefined variable '%.*s'.", name->length, name->chars); \
+      return INTERPRET_RUNTIME_ERROR;                                        \
+    }                                                                        \
+    PUSH(value);                                                             \
+  } while (false)
+#define DEFINE_GLOBAL(constant)                         \
+  do {                                                  \
+    ObjString* name = AS_STRING(CONSTANT_AT(constant)); \
+    STORE_STACK(); /* growing the table may collect */  \
+    tableSet(&vm.globals, name, PEEK(0));               \
+    sp--;                                               \
+    CHECK_INTRINSIC(name);                              \
+  } while (false)
+#define SET_GLOBAL(constant)                                                 \
+  do {                                                                       \
+    ObjString* name = AS_STRING(CONSTANT_AT(constant));                      \
+    STORE_STACK();                                                           \
+    if (tableSet(&vm.globals, name, PEEK(0))) {                              \
+      tableDelete(&vm.globals, name);                                        \
+      frame->ip = ip;                                                        \
+      runtimeError("Undefined variable '%.*s'.", name->length, name->chars); \
+      return INTERPRET_RUNTIME_ERROR;                                        \
+    }                                                                        \
+    CHECK_INTRINSIC(name);                                                   \
+  } while (false)
+#define CHECK_INTRINSIC(name) \
+  if ((name) == vm.intrinsicNames[0] || (name) == vm.intrinsicNames[1]) checkIntrinsics()
+#define CLOSURE(constant)                                              \
+  do {                                                                 \
+    ObjFunction* function = AS_FUNCTION(CONSTANT_AT(constant));        \
+    STORE_STACK();                                                     \
+    if (function->cached != NULL) loadCachedFunction(function);        \
+    ObjClosure* closure = newClosure(function);                        \
+    PUSH(OBJ_VAL(closure));                                            \
+    STORE_STACK(); /* capturing allocates upvalues */                  \
+    for (int i = 0; i < closure->upvalueCount; i++) {                  \
+      uint8_t flags = READ_BYTE();                                     \
+      int index = (flags & UPVALUE_WIDE) ? READ_SHORT() : READ_BYTE(); \
+      if (flags & UPVALUE_LOCAL) {                                     \
+        closure->upvalues[i] = captureUpValue(frame->slots + index);   \
+      } else {                                                         \
+        closure->upvalues[i] = frame->closure->upvalues[index];        \
+      }                                                                \
+    }                                                                  \
+  } while (false)
+// PERF: the checks of call() without leaving the loop, natives, errors and first calls go through callValue
+#define CALL(argCount)                                                                                   \
+  do {                                                                                                   \
+    Value callee = PEEK(argCount);                                                                       \
+    frame->ip = ip;                                                                                      \
+    if (IS_CLOSURE(callee)) {                                                                            \
+      ObjClosure* closure = AS_CLOSURE(callee);                                                          \
+      ObjFunction* function = closure->function;                                                         \
+      Value* slots = sp - (argCount) - 1;                                                                \
+      if (function->arity == (argCount) && (function->chunk.packed || function->chunk.mapped) &&         \
+          !atomic_load_explicit(&vm.interrupted, memory_order_relaxed) &&                                \
+          fitsStack(slots + function->maxStack, vm.frameCount + 1)) {                                    \
+        frame = &vm.frames[vm.frameCount++];                                                             \
+        frame->closure = closure;                                                                        \
+        frame->slots = slots;                                                                            \
+        frame->ip = ip = function->chunk.code;                                                           \
+        DISPATCH();                                                                                      \
+      }                                                                                                  \
+    }                                                                                                    \
+    STORE_STACK();                                                                                       \
+    if (!callValue(callee, argCount, false)) return INTERPRET_RUNTIME_ERROR;                             \
+    LOAD_FRAME();                                                                                        \
+    LOAD_STACK();                                                                                        \
+  } while (false)
+#define TAIL_CALL(argCount)                                                  \
+  do {                                                                       \
+    frame->ip = ip;                                                          \
+    STORE_STACK();                                                           \
+    if (!callValue(PEEK(argCount), argCount, true)) {                        \
+      return INTERPRET_RUNTIME_ERROR;                                        \
+    }                                                                        \
+    LOAD_FRAME();                                                            \
+    LOAD_STACK();                                                            \
+  } while (false)
+#define TUPLE_FIELD(intrinsic, field)                                      \
+  do {                                                                     \
+    if (IS_TUPLE(PEEK(0)) && !vm.intrinsicsShadowed) {                     \
+      sp[-1] = AS_TUPLE(sp[-1])->field;                                    \
+    } else if (!vm.intrinsicsShadowed) {                                   \
+      frame->ip = ip;                                                      \
+      runtimeError("Expect 1 argument of type Tuple");                     \
+      return INTERPRET_RUNTIME_ERROR;                                      \
+    } else {                                                               \
+      frame->ip = ip;                                                      \
+      STORE_STACK();                                                       \
+      if (!callIntrinsic(intrinsic)) return INTERPRET_RUNTIME_ERROR;       \
+      LOAD_FRAME();                                                        \
+      LOAD_STACK();                                                        \
+    }                                                                      \
+  } while (false)
+#define COMPARE_OP(op)                                                 \
+  do {                                                                 \
+    Value b = PEEK(0);                                                 \
+    Value a = PEEK(1);                                                 \
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {                                \
+      sp--;                                                            \
+      sp[-1] = BOOL_VAL(AS_NUMBER(a) op AS_NUMBER(b));                 \
+    } else if (IS_INTEGER(a) && IS_INTEGER(b)) {                       \
+      sp--;                                                            \
+      sp[-1] = BOOL_VAL(compareIntegers(a, b) op 0);                   \
+    } else {                                                           \
+      frame->ip = ip;                                                  \
+      runtimeError("Operands must be numbers.");                       \
+      return INTERPRET_RUNTIME_ERROR;                                  \
+    }                                                                  \
+  } while (false)
+// PERF: int64_t on the fast path, overflowed says when the result does not fit and the operands go to bigint.c
+#define ARITHMETIC_OP(overflowed, slow, divides)                       \
+  do {                                                                 \
+    Value b = PEEK(0);                                                 \
+    Value a = PEEK(1);                                                 \
+    int64_t result;                                                    \
+    if (IS_NUMBER(a) && IS_NUMBER(b) &&                                \
+        !overflowed(AS_NUMBER(a), AS_NUMBER(b), &result)) {            \
+      sp--;                                                            \
+      sp[-1] = NUMBER_VAL(result);                                     \
+      break;                                                           \
+    }                                                                  \
+    frame->ip = ip;                                                    \
+    if (!IS_INTEGER(a) || !IS_INTEGER(b)) {                            \
+      runtimeError("Operands must be numbers.");                       \
+      return INTERPRET_RUNTIME_ERROR;                                  \
+    }                                                                  \
+    if ((divides) && IS_NUMBER(b) && AS_NUMBER(b) == 0) {              \
+      runtimeError("Division by zero.");                               \
+      return INTERPRET_RUNTIME_ERROR;                                  \
+    }                                                                  \
+    STORE_STACK(); /* the operands stay rooted while the result allocates */ \
+    Value value = slow(a, b);                                          \
+    sp--;                                                              \
+    sp[-1] = value;                                                    \
   } while (false)
 
   LOAD_FRAME();
+  LOAD_STACK();
   OpCode instruction;
   INTERPRET_LOOP {
     CASE_CODE(CONSTANT) : {
       Value constant = READ_CONSTANT();
-      push(constant);
+      PUSH(constant);
       DISPATCH();
     }
-    CASE_CODE(NIL) : push(NIL_VAL);
+    CASE_CODE(CONSTANT_LONG) : {
+      Value constant = CONSTANT_AT(READ_LONG());
+      PUSH(constant);
+      DISPATCH();
+    }
+    CASE_CODE(NIL) : PUSH(NIL_VAL);
     DISPATCH();
-    CASE_CODE(TRUE) : push(BOOL_VAL(true));
+    CASE_CODE(TRUE) : PUSH(BOOL_VAL(true));
     DISPATCH();
-    CASE_CODE(FALSE) : push(BOOL_VAL(false));
+    CASE_CODE(FALSE) : PUSH(BOOL_VAL(false));
     DISPATCH();
-    CASE_CODE(POP) : pop();
+    CASE_CODE(POP) : sp--;
     DISPATCH();
     CASE_CODE(GET_LOCAL) : {
       uint8_t slot = READ_BYTE();
-      push(frame->slots[slot]);
+      PUSH(frame->slots[slot]);
+      DISPATCH();
+    }
+    CASE_CODE(GET_LOCAL_LONG) : {
+      uint32_t slot = READ_LONG();
+      PUSH(frame->slots[slot]);
       DISPATCH();
     }
     CASE_CODE(SET_LOCAL) : {
       uint8_t slot = READ_BYTE();
-      frame->slots[slot] = peek(0);
+      frame->slots[slot] = PEEK(0);
       DISPATCH();
     }
-    CASE_CODE(GET_GLOBAL) : {  // PERF: looking up in hash tables is slow, how to improve?
-      ObjString* name = READ_STRING();
-      Value value;
-      if (!tableGet(&vm.globals, name, &value)) {
-        frame->ip = ip;
-        runtimeError("Undefined variable '%s'.", name->chars);
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      push(value);
+    CASE_CODE(SET_LOCAL_LONG) : {
+      uint32_t slot = READ_LONG();
+      frame->slots[slot] = PEEK(0);
       DISPATCH();
     }
-    CASE_CODE(DEFINE_GLOBAL) : {  // PERF: global vars are lazy eval, change to compile time to improve perf
-      ObjString* name = READ_STRING();
-      tableSet(&vm.globals, name, peek(0));
-      pop();
+    CASE_CODE(GET_GLOBAL) : GET_GLOBAL(READ_BYTE());  // PERF: looking up in hash tables is slow, how to improve?
+    DISPATCH();
+    CASE_CODE(GET_GLOBAL_LONG) : GET_GLOBAL(READ_LONG());
+    DISPATCH();
+    CASE_CODE(DEFINE_GLOBAL) : DEFINE_GLOBAL(READ_BYTE());  // PERF: global vars are lazy eval, change to compile time to improve perf
+    DISPATCH();
+    CASE_CODE(DEFINE_GLOBAL_LONG) : DEFINE_GLOBAL(READ_LONG());
+    DISPATCH();
+    CASE_CODE(SET_GLOBAL) : SET_GLOBAL(READ_BYTE());
+    DISPATCH();
+    CASE_CODE(SET_GLOBAL_LONG) : SET_GLOBAL(READ_LONG());
+    DISPATCH();
+    CASE_CODE(GET_UPVALUE) : {
+      uint8_t slot = READ_BYTE();
+      PUSH(*frame->closure->upvalues[slot]->location);
       DISPATCH();
     }
-    CASE_CODE(SET_GLOBAL) : {
-      ObjString* name = READ_STRING();
-      if (tableSet(&vm.globals, name, peek(0))) {
-        tableDelete(&vm.globals, name);
-        frame->ip = ip;
-        runtimeError("Undefined variable '%s'.", name->chars);
-        return INTERPRET_RUNTIME_ERROR;
-      }
+    CASE_CODE(GET_UPVALUE_LONG) : {
+      uint32_t slot = READ_LONG();
+      PUSH(*frame->closure->upvalues[slot]->location);
       DISPATCH();
     }
-    CASE_CODE(GET_UPVALUE) : {
+    CASE_CODE(SET_UPVALUE) : {
       uint8_t slot = READ_BYTE();
-      push(*frame->closure->upvalues[slot]->location);
+      *frame->closure->upvalues[slot]->location = PEEK(0);
       DISPATCH();
     }
-    CASE_CODE(SET_UPVALUE) : {
-      uint8_t slot = READ_BYTE();
-      *frame->closure->upvalues[slot]->location = peek(0);
+    CASE_CODE(SET_UPVALUE_LONG) : {
+      uint32_t slot = READ_LONG();
+      *frame->closure->upvalues[slot]->location = PEEK(0);
       DISPATCH();
     }
     CASE_CODE(DEFINE_TUPLE) : {
-      Value second = pop();
-      Value first = pop();
-      push(OBJ_VAL(newTuple(&first, &second)));
+      STORE_STACK();
+      ObjTuple* tuple = newTuple(&sp[-2], &sp[-1]);  // elements stay on the stack while allocating
+      sp -= 2;
+      PUSH(OBJ_VAL(tuple));
       DISPATCH();
     }
     CASE_CODE(BANG_EQUAL) : {
-      Value b = pop();
-      Value a = pop();
-      push(BOOL_VAL(!valuesEqual(a, b)));
+      STORE_STACK();
+      bool equal = valuesEqual(PEEK(1), PEEK(0));  // operands stay rooted, comparing ropes flattens them
+      sp -= 2;
+      PUSH(BOOL_VAL(!equal));
       DISPATCH();
     }
     CASE_CODE(EQUAL) : {
-      Value b = pop();
-      Value a = pop();
-      push(BOOL_VAL(valuesEqual(a, b)));
+      STORE_STACK();
+      bool equal = valuesEqual(PEEK(1), PEEK(0));
+      sp -= 2;
+      PUSH(BOOL_VAL(equal));
       DISPATCH();
     }
-    CASE_CODE(GREATER) : BINARY_OP(BOOL_VAL, >);
+    CASE_CODE(GREATER) : COMPARE_OP(>);
     DISPATCH();
-    CASE_CODE(LESS) : BINARY_OP(BOOL_VAL, <);
+    CASE_CODE(LESS) : COMPARE_OP(<);
     DISPATCH();
-    CASE_CODE(GREATER_EQUAL) : BINARY_OP(BOOL_VAL, >=);
+    CASE_CODE(GREATER_EQUAL) : COMPARE_OP(>=);
     DISPATCH();
-    CASE_CODE(LESS_EQUAL) : BINARY_OP(BOOL_VAL, <=);
+    CASE_CODE(LESS_EQUAL) : COMPARE_OP(<=);
     DISPATCH();
     CASE_CODE(ADD) : {
-      Value p0 = peek(0);
-      Value p1 = peek(1);
-      if (IS_STRING(p0) && IS_STRING(p1)) {
-        ObjString* b = AS_STRING(peek(0));
-        ObjString* a = AS_STRING(peek(1));
-
-        concatenate(a->chars, a->length, b->chars, b->length);
-      } else if (IS_NUMBER(p0) && IS_NUMBER(p1)) {
-        int b = AS_NUMBER(pop());
-        int a = AS_NUMBER(pop());
-
-        push(NUMBER_VAL(a + b));
-      } else if (IS_NUMBER(p0) && IS_STRING(p1)) {
-        ObjString* b = convertToString(peek(0));
-        ObjString* a = AS_STRING(peek(1));
-
-        concatenate(a->chars, a->length, b->chars, b->length);
-      } else if (IS_STRING(p0) && IS_NUMBER(p1)) {
-        ObjString* b = AS_STRING(peek(0));
-        ObjString* a = convertToString(peek(1));
-
-        concatenate(a->chars, a->length, b->chars, b->length);
+      Value p0 = PEEK(0);
+      Value p1 = PEEK(1);
+      int64_t sum;
+      if (IS_NUMBER(p0) && IS_NUMBER(p1) && !__builtin_add_overflow(AS_NUMBER(p1), AS_NUMBER(p0), &sum)) {
+        sp--;
+        sp[-1] = NUMBER_VAL(sum);
+        DISPATCH();
+      }
 
+      STORE_STACK();  // every other case allocates a bigint or a string
+      if (IS_INTEGER(p0) && IS_INTEGER(p1)) {
+        Value value = addIntegers(p1, p0);
+        sp--;
+        sp[-1] = value;
+        DISPATCH();
+      } else if (IS_STRING(p0) && IS_STRING(p1)) {
+        concatenate();
+      } else if (IS_INTEGER(p0) && IS_STRING(p1)) {
+        sp[-1] = OBJ_VAL(convertToString(p0));  // keep the converted operand rooted
+        concatenate();
+      } else if (IS_STRING(p0) && IS_INTEGER(p1)) {
+        sp[-2] = OBJ_VAL(convertToString(p1));
+        concatenate();
       } else {
         frame->ip = ip;
         runtimeError("Operands must be two numbers or two strings.");
         return INTERPRET_RUNTIME_ERROR;
       }
+      LOAD_STACK();
 
       DISPATCH();
     }
-    CASE_CODE(SUBTRACT) : BINARY_OP(NUMBER_VAL, -);
+    CASE_CODE(SUBTRACT) : ARITHMETIC_OP(__builtin_sub_overflow, subtractIntegers, false);
     DISPATCH();
-    CASE_CODE(MULTIPLY) : BINARY_OP(NUMBER_VAL, *);
+    CASE_CODE(MULTIPLY) : ARITHMETIC_OP(__builtin_mul_overflow, multiplyIntegers, false);
     DISPATCH();
-    CASE_CODE(DIVIDE) : BINARY_OP(NUMBER_VAL, /);
+    CASE_CODE(DIVIDE) : ARITHMETIC_OP(divideOverflow, divideIntegers, true);
     DISPATCH();
-    CASE_CODE(MODULO) : BINARY_OP(NUMBER_VAL, %);
+    CASE_CODE(MODULO) : ARITHMETIC_OP(moduloOverflow, moduloIntegers, true);
     DISPATCH();
-    CASE_CODE(NOT) : push(BOOL_VAL(isFalsey(pop())));
+    CASE_CODE(NOT) : PUSH(BOOL_VAL(isFalsey(POP())));
     DISPATCH();
     CASE_CODE(NEGATE) : {
-      if (!IS_NUMBER(peek(0))) {
+      Value value = PEEK(0);
+      if (IS_NUMBER(value) && AS_NUMBER(value) != INT64_MIN) {
+        sp[-1] = NUMBER_VAL(-AS_NUMBER(value));
+        DISPATCH();
+      }
+      if (!IS_INTEGER(value)) {
         frame->ip = ip;
         runtimeError("Operand must be a number.");
         return INTERPRET_RUNTIME_ERROR;
       }
-      push(NUMBER_VAL(-AS_NUMBER(pop())));
+      STORE_STACK();
+      sp[-1] = negateInteger(value);
       DISPATCH();
     }
     CASE_CODE(PRINT) : {
-      printValue(peek(0));
-      printf("\n");
+      STORE_STACK();  // printing a rope flattens it
+      printValue(PEEK(0));
+      fputc('\n', vm.out);
       DISPATCH();
     }
+    CASE_CODE(FIRST) : TUPLE_FIELD(0, first);
+    DISPATCH();
+    CASE_CODE(SECOND) : TUPLE_FIELD(1, second);
+    DISPATCH();
     CASE_CODE(JUMP) : {
       uint16_t offset = READ_SHORT();
       ip += offset;
@@ -476,12 +765,27 @@ static InterpretResult runOptimized() {  // dispatching can be made faster with
     }
     CASE_CODE(JUMP_IF_TRUE) : {
       uint16_t offset = READ_SHORT();
-      if (!isFalsey(peek(0))) ip += offset;
+      if (!isFalsey(PEEK(0))) ip += offset;
       DISPATCH();
     }
     CASE_CODE(JUMP_IF_FALSE) : {
       uint16_t offset = READ_SHORT();
-      if (isFalsey(peek(0))) ip += offset;
+      if (isFalsey(PEEK(0))) ip += offset;
+      DISPATCH();
+    }
+    CASE_CODE(JUMP_LONG) : {
+      uint32_t offset = READ_LONG();
+      ip += offset;
+      DISPATCH();
+    }
+    CASE_CODE(JUMP_IF_TRUE_LONG) : {
+      uint32_t offset = READ_LONG();
+      if (!isFalsey(PEEK(0))) ip += offset;
+      DISPATCH();
+    }
+    CASE_CODE(JUMP_IF_FALSE_LONG) : {
+      uint32_t offset = READ_LONG();
+      if (isFalsey(PEEK(0))) ip += offset;
       DISPATCH();
     }
     CASE_CODE(LOOP) : {
@@ -491,56 +795,50 @@ static InterpretResult runOptimized() {  // dispatching can be made faster with
     }
     CASE_CODE(CALL) : {
       int argCount = READ_BYTE();
-      frame->ip = ip;
-      if (!callValue(peek(argCount), argCount, false)) {
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      frame = &vm.frames[vm.frameCount - 1];
-      ip = frame->ip;
+      CALL(argCount);
       DISPATCH();
     }
+    CASE_CODE(CALL_0) : CALL(0);
+    DISPATCH();
+    CASE_CODE(CALL_1) : CALL(1);
+    DISPATCH();
+    CASE_CODE(CALL_2) : CALL(2);
+    DISPATCH();
+    CASE_CODE(CALL_3) : CALL(3);
+    DISPATCH();
     CASE_CODE(TCALL) : {
       int argCount = READ_BYTE();
-      frame->ip = ip;
-      if (!callValue(peek(argCount), argCount, true)) {
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      frame = &vm.frames[vm.frameCount - 1];
-      vm.stackCount = frame->slots + argCount + 1 - vm.stack;
-      ip = frame->ip;
-      DISPATCH();
-    }
-    CASE_CODE(CLOSURE) : {
-      ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
-      ObjClosure* closure = newClosure(function);
-      push(OBJ_VAL(closure));
-      for (int i = 0; i < closure->upvalueCount; i++) {
-        uint8_t isLocal = READ_BYTE();
-        uint8_t index = READ_BYTE();
-        if (isLocal) {
-          closure->upvalues[i] = captureUpValue(frame->slots + index);
-        } else {
-          closure->upvalues[i] = frame->closure->upvalues[index];
-        }
-      }
+      TAIL_CALL(argCount);
       DISPATCH();
     }
+    CASE_CODE(TCALL_0) : TAIL_CALL(0);
+    DISPATCH();
+    CASE_CODE(TCALL_1) : TAIL_CALL(1);
+    DISPATCH();
+    CASE_CODE(TCALL_2) : TAIL_CALL(2);
+    DISPATCH();
+    CASE_CODE(TCALL_3) : TAIL_CALL(3);
+    DISPATCH();
+    CASE_CODE(CLOSURE) : CLOSURE(READ_BYTE());
+    DISPATCH();
+    CASE_CODE(CLOSURE_LONG) : CLOSURE(READ_LONG());
+    DISPATCH();
     CASE_CODE(CLOSE_UPVALUE) : {
-      closeUpvalues(vm.stack + vm.stackCount - 1);
-      pop();
+      closeUpvalues(sp - 1);
+      sp--;
       DISPATCH();
     }
     CASE_CODE(RETURN) : {
-      Value result = pop();
+      Value result = POP();
       closeUpvalues(frame->slots);
       vm.frameCount--;
+      sp = frame->slots;  // a script that pushed nothing returns its own slot, popping again would underflow
       if (vm.frameCount == 0) {
-        pop();
+        STORE_STACK();
         return INTERPRET_OK;
       }
 
-      vm.stackCount = frame->slots - vm.stack;
-      push(result);
+      PUSH(result);
       frame = &vm.frames[vm.frameCount - 1];
       ip = frame->ip;
       DISPATCH();
@@ -551,12 +849,68 @@ static InterpretResult runOptimized() {  // dispatching can be made faster with
 #undef READ_SHORT
 #undef READ_CONSTANT
 #undef READ_STRING
+#undef READ_LONG
+#undef CONSTANT_AT
+#undef GET_GLOBAL
+#undef DEFINE_GLOBAL
+#undef SET_GLOBAL
+#undef CHECK_INTRINSIC
+#undef CLOSURE
+#undef CALL
+#undef TAIL_CALL
+#undef TUPLE_FIELD
 #undef READ_BINARY_OP
+#undef COMPARE_OP
+#undef ARITHMETIC_OP
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef LOAD_STACK
+#undef STORE_STACK
 }
 
-InterpretResult interpret(const char* source) {
-  ObjFunction* function = compile(source);
-  if (function == NULL) return INTERPRET_COMPILE_ERROR;
+static bool compileBodies(ObjFunction* function) {  // --check: every body below function up front, false after reporting the errors
+  push(OBJ_VAL(function));  // compiling allocates
+  bool valid = true;
+  for (int i = 0; i < function->chunk.constants.count; i++) {
+    Value constant = function->chunk.constants.values[i];
+    if (!IS_FUNCTION(constant)) continue;
+    ObjFunction* nested = AS_FUNCTION(constant);
+    if (nested->cached != NULL) loadCachedFunction(nested);
+    if (nested->deferred != NULL && !compileDeferred(nested)) {
+      valid = false;
+      continue;
+    }
+    valid = compileBodies(nested) && valid;
+  }
+  pop();
+  return valid;
+}
+
+static InterpretResult execute(const char* source, size_t length, const char* path, bool json) {  // with a path the compiled code is cached next to it
+  jmp_buf panicJump;
+  vm.panicJump = &panicJump;
+  switch (setjmp(panicJump)) {
+    case 0: break;
+    case PANIC_COMPILE: vm.panicJump = NULL; return INTERPRET_COMPILE_ERROR;
+    default: vm.panicJump = NULL; return INTERPRET_RUNTIME_ERROR;
+  }
+
+  ObjFunction* function = path != NULL ? loadCache(path, source, length) : NULL;
+  bool compiledNow = function == NULL;
+  if (compiledNow) {
+    function = json ? compileJson(source, length) : compile(source);
+    if (function == NULL) {
+      vm.panicJump = NULL;
+      return INTERPRET_COMPILE_ERROR;
+    }
+    if (compileJobs > 0) compileParallel(function, compileJobs);
+  }
+  if (checkBodies && !compileBodies(function)) {
+    vm.panicJump = NULL;
+    return INTERPRET_COMPILE_ERROR;
+  }
+  if (compiledNow && path != NULL) writeCache(path, function, source, length);
 
   push(OBJ_VAL(function));
   ObjClosure* closure = newClosure(function);
@@ -566,5 +920,14 @@ InterpretResult interpret(const char* source) {
 
   InterpretResult result = runOptimized();
 
+  vm.panicJump = NULL;
   return result;
 }
+
+InterpretResult interpret(const char* source, size_t length, const char* path) {  // source[length] must be the null terminator
+  return execute(source, length, path, false);
+}
+
+InterpretResult interpretJson(const char* source, size_t length, const char* path) {  // a rinha json ast instead of the surface syntax
+  return execute(source, length, path, true);
+}
@@ -1,14 +1,18 @@
 #ifndef crinha_vm_h
 #define crinha_vm_h
 
+#include <setjmp.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+#include "code.h"
+#include "memory.h"
 #include "object.h"
+#include "stack.h"
 #include "table.h"
 #include "value.h"
 
-#define FRAMES_MIN 256
-#define FRAMES_MAX 16384
-#define STACK_MIN (FRAMES_MIN * UINT8_COUNT) // even if dynamically allocated, should have a artificial limit for security reasons
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT) // even if dynamically allocated, should have a artificial limit for security reasons
+#define VM_THREAD_STACK (8 * 1024 * 1024)  // C stack of threads running a vm, the compiler recurses on nesting and musl only gives 128k
 
 typedef struct {
   ObjClosure* closure;
@@ -17,24 +21,35 @@ typedef struct {
 } CallFrame;
 
 typedef struct {
-  CallFrame* frames;
+  CallFrame* frames;  // both stacks never move, so frame slots and open upvalues can point into them
   int frameCount;
-  int frameCapacity;
+  StackRegion frameRegion;
 
   Value* stack;
-  int stackCount;
-  int stackCapacity;
+  Value* stackTop;  // the interpreter loop keeps it in a register and stores it back before anything that looks at the stack
+  StackRegion stackRegion;
 
   Table globals;
   Table strings;
   ObjUpvalue* openUpvalues;
 
   size_t bytesAllocated;
+  size_t maxHeap;  // gcConfig.maxHeap unless the server set a limit for the request
   size_t nextGC;
-  Obj* objects;
+  double gcGrowFactor;
+  double gcLastEnd;
+  Heap heap;
   int grayCount;
   int grayCapacity;
   Obj** grayStack;
+  CodeArena code;  // finished chunks, read-only
+  ObjString* intrinsicNames[2];  // first and second, which the compiler turns into OP_FIRST and OP_SECOND
+  bool intrinsicsShadowed;       // either global no longer holds its native, so those opcodes call the global
+
+  jmp_buf* panicJump;  // where runtimePanic unwinds to, set while interpreting
+  FILE* out;           // where print writes, batch mode captures it per script
+  FILE* err;
+  atomic_bool interrupted;  // set by another thread to stop the script at its next call
 } VM;
 
 typedef enum {
@@ -43,11 +58,18 @@ typedef enum {
   INTERPRET_RUNTIME_ERROR,
 } InterpretResult;
 
-extern VM vm;
+extern _Thread_local VM vm;
+extern bool checkBodies;  // compile every deferred body before running, so syntax errors never wait for a call
 
 void initVM();
 void freeVM();
-InterpretResult interpret(const char* source);
+void resetVM();
+InterpretResult interpret(const char* source, size_t length, const char* path);
+InterpretResult interpretJson(const char* source, size_t length, const char* path);
+void runtimePanic(const char* format, ...);
+void checkIntrinsics();
+int nativeIndex(NativeFn function);
+NativeFn nativeFunction(int index);
 void push(Value value);
 Value pop();
 
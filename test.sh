@@ -3,7 +3,7 @@
 function setup() {
   echo -n "building....."
 
-  rm -rf tmp
+  rm -rf tmp tests/*.bc
   mkdir -p tmp
   make clean &> /dev/null
   make &> /dev/null
@@ -18,7 +18,7 @@ function setup() {
 
 function tests() {
   e=0
-  for f in tests/*.rinha; do
+  for f in tests/*.rinha tests/*.rinha.json; do
     filename=$(basename $f)
     expected="$f.out"
     result="tmp/$filename.out"
@@ -26,13 +26,17 @@ function tests() {
     printf %-30s $filename | tr ' ' .
 
     tmp/crinha $f > $result
-    if cmp -s $expected $result; then
+    tmp/crinha $f > $result.cached  # the second run loads the bytecode cache written by the first
+    CRINHA_COMPILE_JOBS=4 CRINHA_CHECK=on tmp/crinha --cache=off $f > $result.parallel  # bodies compiled in worker vms and copied over, and checked before running
+    if cmp -s $expected $result && cmp -s $expected $result.cached && cmp -s $expected $result.parallel; then
       echo OK
     else
       ((e+=1))
       echo ERROR
       echo "    expected: $(cat $expected)"
       echo "    got:      $(cat $result)"
+      cmp -s $result $result.cached || echo "    cached:   $(cat $result.cached)"
+      cmp -s $result $result.parallel || echo "    parallel: $(cat $result.parallel)"
     fi
   done
 